@@ -0,0 +1,152 @@
+/*
+ Admission control, CMPT 276, Spring 2016.
+ */
+
+#include "Admission.h"
+
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <pplx/pplxtasks.h>
+
+#include "Metrics.h"
+
+using std::size_t;
+using std::vector;
+
+using pplx::extensibility::scoped_critical_section_t;
+
+constexpr std::chrono::milliseconds AdmissionControl::target;
+constexpr std::chrono::milliseconds AdmissionControl::interval;
+constexpr std::chrono::milliseconds AdmissionControl::sweep_period;
+
+AdmissionControl::AdmissionControl () :
+  max_in_flight {0},
+  queue_length {0},
+  in_flight {0},
+  queues {},
+  next_queue {0},
+  lock {},
+  stopping {false},
+  sweep_lock {},
+  stop_requested {},
+  sweeper {}
+{
+  const char* names[class_count] {"read", "write"};
+  for (size_t i {0}; i < class_count; ++i) {
+    queues[i].last_empty = clock_t::now();
+    queues[i].wait_time = &server_metrics().dependency("queue", names[i]);
+  }
+}
+
+AdmissionControl::~AdmissionControl () {
+  {
+    std::lock_guard<std::mutex> l {sweep_lock};
+    stopping = true;
+  }
+  stop_requested.notify_all();
+  if (sweeper.joinable())
+    sweeper.join();
+}
+
+void AdmissionControl::set_limits (size_t max, size_t length) {
+  {
+    scoped_critical_section_t l {lock};
+    max_in_flight = max;
+    queue_length = length;
+  }
+  // Without a limit nothing is ever queued, so there is nothing to sweep
+  if (max > 0 && ! sweeper.joinable())
+    sweeper = std::thread {&AdmissionControl::sweep, this};
+}
+
+void AdmissionControl::sweep () {
+  std::unique_lock<std::mutex> l {sweep_lock};
+  while ( ! stop_requested.wait_for(l, sweep_period, [this] () { return stopping.load(); })) {
+    l.unlock();
+    vector<action_t> rejected {};
+    {
+      scoped_critical_section_t cs {lock};
+      const clock_t::time_point now {clock_t::now()};
+      for (auto& q : queues) {
+        shed(q, now, rejected);
+      }
+    }
+    for (const auto& r : rejected) {
+      r();
+    }
+    l.lock();
+  }
+}
+
+void AdmissionControl::shed (queue_t& q, clock_t::time_point now, vector<action_t>& rejected) {
+  const std::chrono::milliseconds limit {now - q.last_empty > interval ? target : interval};
+  while ( ! q.waiting.empty() && now - q.waiting.front().arrived > limit) {
+    rejected.push_back(std::move(q.waiting.front().reject));
+    q.waiting.pop_front();
+  }
+  if (q.waiting.empty())
+    q.last_empty = now;
+}
+
+void AdmissionControl::admit (op_class c, action_t start, action_t reject) {
+  vector<action_t> rejected {};
+  bool started {false};
+  {
+    scoped_critical_section_t l {lock};
+    const clock_t::time_point now {clock_t::now()};
+    queue_t& q = queues[static_cast<size_t> (c)];
+    shed(q, now, rejected);
+    if (max_in_flight == 0 || in_flight < max_in_flight) {
+      ++in_flight;
+      started = true;
+    }
+    else if (q.waiting.size() < queue_length) {
+      q.waiting.push_back(waiting_t {now, std::move(start), std::move(reject)});
+    }
+    else {
+      rejected.push_back(std::move(reject));
+    }
+  }
+
+  for (const auto& r : rejected) {
+    r();
+  }
+  if (started)
+    start();
+}
+
+void AdmissionControl::finished () {
+  vector<action_t> rejected {};
+  action_t start {};
+  {
+    scoped_critical_section_t l {lock};
+    --in_flight;
+    const clock_t::time_point now {clock_t::now()};
+    for (size_t i {0}; i < class_count && ! start; ++i) {
+      queue_t& q = queues[(next_queue + i) % class_count];
+      shed(q, now, rejected);
+      if (q.waiting.empty())
+        continue;
+      q.wait_time->record(std::chrono::duration_cast<std::chrono::microseconds> (
+                            now - q.waiting.front().arrived));
+      start = std::move(q.waiting.front().start);
+      q.waiting.pop_front();
+      if (q.waiting.empty())
+        q.last_empty = now;
+      ++in_flight;
+      next_queue = (next_queue + i + 1) % class_count;
+    }
+  }
+
+  for (const auto& r : rejected) {
+    r();
+  }
+  // On a task of its own, so a chain of requests does not nest on this stack
+  if (start)
+    pplx::create_task(start);
+}
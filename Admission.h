@@ -0,0 +1,106 @@
+#ifndef Admission_h
+#define Admission_h
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <pplx/pplxtasks.h>
+
+#include "Metrics.h"
+
+/*
+  Admission control: a limit on the requests a server works on at
+  once, with a short queue in front of it
+
+  A request that finds fewer than max_in_flight requests running
+  starts at once. Otherwise it waits in the queue for its class of
+  operation, and a request finding that queue full is rejected
+  straight away. Each time a request finishes, the next waiting
+  request starts, taking the classes' queues in turn so that a
+  flood of writes cannot starve reads.
+
+  How long a request may wait adapts to the load, as in CoDel: if
+  a queue has been empty at some point in the last interval, a
+  request may wait up to interval, which absorbs a burst; if it has
+  stayed non-empty for longer, the server is overloaded and
+  requests that have waited more than target are rejected. A
+  standing queue only adds latency, so under overload requests fail
+  fast rather than time out.
+
+  Rejected requests get their reject action, which replies 503 with
+  Retry-After; admitted ones their start action. Both run outside
+  the lock, on the thread calling admit() or finished(), except
+  that a request started by finished() runs as a new task.
+
+  Once a limit is set, a thread also sheds the queues every
+  sweep_period, so that requests queued behind a stalled burst are
+  rejected once they have waited too long, even when no request
+  arrives or finishes to shed them.
+ */
+class AdmissionControl {
+public:
+  using clock_t = std::chrono::steady_clock;
+  using action_t = std::function<void ()>;
+
+  enum class op_class {read, write};
+  static constexpr std::size_t class_count {2};
+
+  static constexpr std::chrono::milliseconds target {5};
+  static constexpr std::chrono::milliseconds interval {100};
+  static constexpr std::chrono::milliseconds sweep_period {10};
+
+private:
+  struct waiting_t {
+    clock_t::time_point arrived;
+    action_t start;
+    action_t reject;
+  };
+
+  struct queue_t {
+    std::deque<waiting_t> waiting;
+    clock_t::time_point last_empty;
+    Histogram* wait_time;
+  };
+
+  std::size_t max_in_flight; // 0 for no limit
+  std::size_t queue_length;
+  std::size_t in_flight;
+  std::array<queue_t,class_count> queues;
+  std::size_t next_queue; // Where finished() starts looking, for round robin
+  pplx::extensibility::critical_section_t lock;
+
+  std::atomic<bool> stopping;
+  std::mutex sweep_lock;
+  std::condition_variable stop_requested;
+  std::thread sweeper; // Started by the first set_limits() with a limit
+
+  // Remove the requests at the front of q that have waited too long
+  void shed (queue_t& q, clock_t::time_point now, std::vector<action_t>& rejected);
+
+  void sweep ();
+
+public:
+  AdmissionControl ();
+  ~AdmissionControl ();
+
+  AdmissionControl (const AdmissionControl&) = delete;
+  AdmissionControl& operator= (const AdmissionControl&) = delete;
+
+  void set_limits (std::size_t max_in_flight, std::size_t queue_length);
+
+  // Start, queue or reject a request of class c
+  void admit (op_class c, action_t start, action_t reject);
+
+  // A started request's handler has returned; start the next one waiting, if any
+  void finished ();
+};
+
+#endif
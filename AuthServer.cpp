@@ -2,18 +2,20 @@
  Authorization Server code for CMPT 276, Spring 2016.
  */
 
-#include <iostream>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
-#include <cpprest/http_listener.h>
 #include <cpprest/json.h>
 
 #include <was/common.h>
 #include <was/table.h>
 
+#include "Logger.h"
+#include "Router.h"
+#include "ServerConfig.h"
 #include "TableCache.h"
+#include "TableStore.h"
 #include "make_unique.h"
 #include "ClientUtils.h"
 
@@ -30,12 +32,9 @@ using azure::storage::table_request_options;
 using azure::storage::table_result;
 using azure::storage::table_shared_access_policy;
 
-using std::cin;
-using std::cout;
-using std::endl;
-using std::getline;
 using std::make_pair;
 using std::pair;
+using std::shared_ptr;
 using std::string;
 using std::unordered_map;
 using std::vector;
@@ -49,11 +48,10 @@ using web::http::uri;
 
 using web::json::value;
 
-using web::http::experimental::listener::http_listener;
 
 using prop_str_vals_t = vector<pair<string,string>>;
 
-constexpr const char* def_url = "http://localhost:34570";
+constexpr unsigned def_port {34570};
 
 const string auth_table_name {"AuthTable"};
 const string auth_table_userid_partition {"Userid"};
@@ -89,6 +87,21 @@ prop_str_vals_t get_string_properties (const table_entity::properties_type& prop
   return values;
 }
 
+/*
+  Return the value of the named property, or the empty string
+  if there is none.
+
+  The order of an entity's properties depends on the table store,
+  so they must be looked up by name.
+ */
+string get_string_property (const prop_str_vals_t& values, const string& name) {
+  for (const auto& v : values) {
+    if (v.first == name)
+      return v.second;
+  }
+  return string {};
+}
+
 /*
   Given an HTTP message with a JSON body, return the JSON
   body as an unordered map of strings to strings.
@@ -140,77 +153,71 @@ unordered_map<string,string> get_json_body(http_request message) {
       table_shared_access_policy::permissions::read |
       table_shared_access_policy::permissions::update
  */
-pair<status_code,string> do_get_token (const cloud_table& data_table,
+pair<status_code,string> do_get_token (TableStore& data_table,
                    const string& partition,
                    const string& row,
                    uint8_t permissions) {
-  cout << "Retrieving token from /" + partition + "/" + row << endl;
+  log_info() << "Retrieving token from /" + partition + "/" + row;
   utility::datetime exptime {utility::datetime::utc_now() + utility::datetime::from_days(1)};
   try {
     string limited_access_token {
-      data_table.get_shared_access_signature(table_shared_access_policy {
-                                               exptime,
-                                               permissions},
-                                             string(), // Unnamed policy
-                                             // Start of range (inclusive)
-                                             partition,
-                                             row,
-                                             // End of range (inclusive)
-                                             partition,
-                                             row)
-        // Following token allows read access to entire table
-        //table.get_shared_access_signature(table_shared_access_policy {exptime, permissions})
+      data_table.shared_access_signature(table_shared_access_policy {
+                                           exptime,
+                                           permissions},
+                                         partition,
+                                         row)
       };
-    cout << "Token " << limited_access_token << endl;
+    if (limited_access_token.empty()) {
+      log_info() << "Table store cannot issue tokens";
+      return make_pair(status_codes::NotImplemented, string{});
+    }
+    log_debug() << "Token issued"; // The token itself grants access, so is not logged
     return make_pair(status_codes::OK, limited_access_token);
   }
   catch (const storage_exception& e) {
-    cout << "Azure Table Storage error: " << e.what() << endl;
-    cout << e.result().extended_error().message() << endl;
+    log_error() << "Azure Table Storage error: " << e.what() << ": "
+                << e.result().extended_error().message();
     return make_pair(status_codes::InternalError, string{});
   }
 }
 
 /*
-  Top-level routine for processing all HTTP GET requests.
+  GetReadToken/USERID, GetUpdateToken/USERID and
+  GetUpdateData/USERID (GET), with the password in the JSON body
  */
-void handle_get(http_request message) { 
-  string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** AuthServer GET " << path << endl;
-  auto paths = uri::split_path(path);
-  // Need at least an operation and userid
-  if (paths.size() < 2) {
-    message.reply(status_codes::BadRequest);
-    return;
-  }
+void handle_get_token(http_request message, const vector<string>& paths) {
 
   //CONTAINS THE PASSWORD SO WE NEED ONE OF THESE CALLS
   unordered_map<string,string> json_body {get_json_body(message)}; 
 
-  table_cache.init(storage_connection_string);
-  cloud_table table {table_cache.lookup_table(auth_table_name)};  
-  if ( ! table.exists()) {
+  bool exists {false};
+  shared_ptr<TableStore> table {table_cache.lookup_table(auth_table_name, exists)};
+  if ( ! exists) {
     message.reply(status_codes::NotFound);
     return;
   }
-  table_operation retrieve_operation {table_operation::retrieve_entity(auth_table_userid_partition, paths[1])};
-  table_result retrieve_result {table.execute(retrieve_operation)};
-  cout << "HTTP code: " << retrieve_result.http_status_code() << endl;
-  if (retrieve_result.http_status_code() == status_codes::NotFound) { //COULD BE A DIFFERENT STATUS CODE, something about having security issues if an id isnt on the list/if the password is wrong
+  /*
+    The password is always checked against AuthTable as storage
+    holds it now, never a cached or snapshot copy, so a changed or
+    revoked password takes effect at once
+   */
+  table_entity entity {};
+  status_code code {table->retrieve(auth_table_userid_partition, paths[1], entity)};
+  log_debug() << "HTTP code: " << code;
+  if (code != status_codes::OK) { //COULD BE A DIFFERENT STATUS CODE, something about having security issues if an id isnt on the list/if the password is wrong
     message.reply(status_codes::NotFound);
     return;
-  } 
-  table_entity entity {retrieve_result.entity()};
+  }
   table_entity::properties_type properties {entity.properties()};
   prop_str_vals_t values (get_string_properties(properties));
-  if (json_body[auth_table_password_prop] != std::get<1>(values[0])) {
+  if (json_body[auth_table_password_prop] != get_string_property(values, auth_table_password_prop)) {
     message.reply(status_codes::NotFound); //If the passwords dont match (Dont know what the status code needs to be)
     return;
   }
 
 
-  cloud_table table2 {table_cache.lookup_table(data_table_name)};  
-  if ( ! table2.exists()) {
+  shared_ptr<TableStore> table2 {table_cache.lookup_table(data_table_name, exists)};
+  if ( ! exists) {
     message.reply(status_codes::NotFound);
     return;
   }
@@ -221,8 +228,8 @@ void handle_get(http_request message) {
     return;
   }
   
-  string partition {std::get<1>(values[2])};
-  string row {std::get<1>(values[1])};
+  string partition {get_string_property(values, auth_table_partition_prop)};
+  string row {get_string_property(values, auth_table_row_prop)};
 
   uint8_t permission {};
   if (get_update_token_op == paths[0] || get_update_data_op == paths[0]) {
@@ -238,7 +245,7 @@ void handle_get(http_request message) {
   }
 
   pair<status_code, string> token {
-    do_get_token (table2,
+    do_get_token (*table2,
       partition,
       row,
       permission
@@ -246,6 +253,10 @@ void handle_get(http_request message) {
   };
 
   if (paths[0] == get_update_data_op) {
+    if (token.first != status_codes::OK) {
+      message.reply(token.first);
+      return;
+    }
     message.reply(status_codes::OK, value::object(vector<pair<string,value>> {
       make_pair ("token", value::string (token.second)),
       make_pair ("DataPartition", value::string (partition)),
@@ -257,7 +268,7 @@ void handle_get(http_request message) {
     value v {value::string(token.second)};
    
    
-    cout << "HTTP code: " << token.first << endl;  
+    log_debug() << "HTTP code: " << token.first;  
     if (token.first == status_codes::OK) {
       message.reply(status_codes::OK, v);
       return;
@@ -271,27 +282,21 @@ void handle_get(http_request message) {
 }
 
 /*
-  Top-level routine for processing all HTTP POST requests.
- */
-void handle_post(http_request message) {
-  string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** POST " << path << endl;
-}
-
-/*
-  Top-level routine for processing all HTTP PUT requests.
+  The three token operations take a userid and nothing more is
+  needed; a request for any other operation gets NotFound, as a
+  bad password does, or BadRequest if it has no userid.
  */
-void handle_put(http_request message) {
-  string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** PUT " << path << endl;
-}
+Router router {"AuthServer"};
 
-/*
-  Top-level routine for processing all HTTP DELETE requests.
- */
-void handle_delete(http_request message) {
-  string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** DELETE " << path << endl;
+void add_routes () {
+  router.add(methods::GET, metrics_op, 1, &reply_metrics);
+  router.unlimited(methods::GET, metrics_op);
+  for (const auto& op : vector<string> {get_read_token_op, get_update_token_op, get_update_data_op}) {
+    router.add(methods::GET, op, 2, Router::any_arity, &handle_get_token);
+  }
+  router.fallback(methods::GET, [] (http_request message, const vector<string>& paths) {
+    message.reply(paths.size() < 2 ? status_codes::BadRequest : status_codes::NotFound);
+  });
 }
 
 /*
@@ -301,33 +306,29 @@ void handle_delete(http_request message) {
   which processes each request asynchronously.
 
   Note that, unlike BasicServer, AuthServer only
-  installs the listeners for GET. Any other HTTP
-  method will produce a Method Not Allowed (405)
-  response.
+  has routes for GET. Any other HTTP method will
+  produce a Method Not Allowed (405) response.
 
-  If you want to support other methods, uncomment
-  the call below that hooks in a the appropriate 
-  listener.
-  
-  Wait for a carriage return, then shut the server down.
+  Options set the address, port, threads and drain timeout; see
+  ServerConfig.h. AuthServer caches no entities, so the cache and
+  snapshot options are ignored. The optional positional argument is
+  a connection string to use instead of storage_connection_string;
+  see TableCache::init().
+
+  Serve until told to stop, then drain and shut the server down.
  */
 int main (int argc, char const * argv[]) {
-  cout << "AuthServer: Parsing connection string" << endl;
-  table_cache.init (storage_connection_string);
-
-  cout << "AuthServer: Opening listener" << endl;
-  http_listener listener {def_url};
-  listener.support(methods::GET, &handle_get);
-  //listener.support(methods::POST, &handle_post);
-  //listener.support(methods::PUT, &handle_put);
-  //listener.support(methods::DEL, &handle_delete);
-  listener.open().wait(); // Wait for listener to complete starting
-
-  cout << "Enter carriage return to stop AuthServer." << endl;
-  string line;
-  getline(std::cin, line);
-
-  // Shut it down
-  listener.close().wait();
-  cout << "AuthServer closed" << endl;
+  ServerConfig config {};
+  if ( ! parse_server_config(argc, argv, def_port, config))
+    return 1;
+
+  // A connection string on the command line overrides azure_keys.h
+  string connection {config.arguments.empty() ? storage_connection_string : config.arguments[0]};
+  log_info() << "AuthServer: Parsing connection string";
+  table_cache.init (connection);
+  if ( ! config.snapshot.empty())
+    log_warning() << "AuthServer: Keeps no snapshot; ignoring --snapshot " << config.snapshot;
+
+  add_routes();
+  serve(config, router, "AuthServer");
 }
@@ -0,0 +1,221 @@
+#include "AzureTableStore.h"
+
+#include <string>
+#include <vector>
+
+#include <was/common.h>
+#include <was/table.h>
+
+#include "Logger.h"
+
+using azure::storage::continuation_token;
+using azure::storage::query_comparison_operator;
+using azure::storage::query_logical_operator;
+using azure::storage::storage_exception;
+using azure::storage::table_batch_operation;
+using azure::storage::table_entity;
+using azure::storage::table_operation;
+using azure::storage::table_query;
+using azure::storage::table_query_iterator;
+using azure::storage::table_query_segment;
+using azure::storage::table_result;
+using azure::storage::table_shared_access_policy;
+
+using std::string;
+using std::vector;
+
+using web::http::status_code;
+using web::http::status_codes;
+
+/*
+  Map the status of a completed table operation to the
+  TableStore convention: every success is OK
+ */
+static status_code op_status (int code) {
+  if (code == status_codes::OK || code == status_codes::NoContent ||
+      code == status_codes::Created)
+    return status_codes::OK;
+  return static_cast<status_code> (code);
+}
+
+static status_code error_status (const storage_exception& e) {
+  log_warning() << "Azure Table Storage error: " << e.what();
+  int code {e.result().http_status_code()};
+  if (code == 0)
+    return status_codes::InternalError;
+  return static_cast<status_code> (code);
+}
+
+bool AzureTableStore::exists () {
+  return table.exists();
+}
+
+bool AzureTableStore::create_if_not_exists () {
+  return table.create_if_not_exists();
+}
+
+bool AzureTableStore::delete_table () {
+  return table.delete_table_if_exists();
+}
+
+status_code AzureTableStore::retrieve (const string& partition, const string& row,
+                                       table_entity& entity) {
+  try {
+    table_result result {table.execute(table_operation::retrieve_entity(partition, row))};
+    if (result.http_status_code() == status_codes::NotFound)
+      return status_codes::NotFound;
+    entity = result.entity();
+    return op_status(result.http_status_code());
+  }
+  catch (const storage_exception& e) {
+    return error_status(e);
+  }
+}
+
+/*
+  A point retrieve cannot select properties, so a projected read
+  is a query for the single entity instead
+ */
+status_code AzureTableStore::retrieve (const string& partition, const string& row,
+                                       const vector<string>& columns, table_entity& entity) {
+  if (columns.empty())
+    return retrieve(partition, row, entity);
+  try {
+    table_query q {};
+    q.set_filter_string(table_query::combine_filter_conditions(
+      table_query::generate_filter_condition("PartitionKey", query_comparison_operator::equal, partition),
+      query_logical_operator::op_and,
+      table_query::generate_filter_condition("RowKey", query_comparison_operator::equal, row)));
+    q.set_select_columns(columns);
+    table_query_iterator end;
+    table_query_iterator it {table.execute_query(q)};
+    if (it == end)
+      return status_codes::NotFound;
+    entity = *it;
+    select_properties(entity, columns);
+    return status_codes::OK;
+  }
+  catch (const storage_exception& e) {
+    return error_status(e);
+  }
+}
+
+status_code AzureTableStore::insert_or_merge (const table_entity& entity) {
+  try {
+    table_result result {table.execute(table_operation::insert_or_merge_entity(entity))};
+    return op_status(result.http_status_code());
+  }
+  catch (const storage_exception& e) {
+    return error_status(e);
+  }
+}
+
+/*
+  merge_entity sends entity.etag() as If-Match, or "*" if it is empty
+ */
+status_code AzureTableStore::merge (const table_entity& entity) {
+  try {
+    table_result result {table.execute(table_operation::merge_entity(entity))};
+    return op_status(result.http_status_code());
+  }
+  catch (const storage_exception& e) {
+    return error_status(e);
+  }
+}
+
+status_code AzureTableStore::remove (const string& partition, const string& row) {
+  try {
+    table_entity entity {partition, row};
+    table_result result {table.execute(table_operation::delete_entity(entity))};
+    return op_status(result.http_status_code());
+  }
+  catch (const storage_exception& e) {
+    return error_status(e);
+  }
+}
+
+status_code AzureTableStore::execute_batch (const vector<batch_write>& writes) {
+  try {
+    table_batch_operation batch {};
+    for (const auto& w : writes) {
+      if (w.remove)
+        batch.delete_entity(w.entity);
+      else
+        batch.insert_or_merge_entity(w.entity);
+    }
+    table.execute_batch(batch);
+    return status_codes::OK;
+  }
+  catch (const storage_exception& e) {
+    return error_status(e);
+  }
+}
+
+/*
+  An unlimited read walks a table_query_iterator, which fetches
+  one segment at a time. A limited read fetches segments with a
+  take count of the space left, so it never stops partway through
+  a segment and the storage continuation resumes exactly.
+ */
+string AzureTableStore::query (const table_range& range, const entity_visitor_t& visit) {
+  table_query q {};
+  if ( ! range.columns.empty())
+    q.set_select_columns(range.columns);
+  if ( ! range.partition.empty()) {
+    q.set_filter_string(table_query::generate_filter_condition("PartitionKey",
+                                                               query_comparison_operator::equal,
+                                                               range.partition));
+  }
+  else {
+    string filter {};
+    if ( ! range.first_partition.empty())
+      filter = table_query::generate_filter_condition("PartitionKey",
+                                                      query_comparison_operator::greater_than_or_equal,
+                                                      range.first_partition);
+    if ( ! range.end_partition.empty()) {
+      string end {table_query::generate_filter_condition("PartitionKey",
+                                                         query_comparison_operator::less_than,
+                                                         range.end_partition)};
+      filter = filter.empty() ? end
+                              : table_query::combine_filter_conditions(filter, query_logical_operator::op_and, end);
+    }
+    if ( ! filter.empty())
+      q.set_filter_string(filter);
+  }
+  if (range.take <= 0 && range.continuation.empty()) {
+    table_query_iterator end;
+    for (table_query_iterator it = table.execute_query(q); it != end; ++it) {
+      visit(*it);
+    }
+    return string {};
+  }
+
+  continuation_token token {};
+  if ( ! range.continuation.empty())
+    token = continuation_token {decode_continuation(range.continuation)};
+  int count {0};
+  do {
+    if (range.take > 0)
+      q.set_take_count(range.take - count);
+    table_query_segment segment {table.execute_query_segmented(q, token)};
+    for (const auto& e : segment.results()) {
+      visit(e);
+      ++count;
+    }
+    token = segment.continuation_token();
+  } while ( ! token.empty() && (range.take <= 0 || count < range.take));
+  return token.empty() ? string {} : encode_continuation(token.next_marker());
+}
+
+string AzureTableStore::shared_access_signature (const table_shared_access_policy& policy,
+                                                 const string& partition,
+                                                 const string& row) {
+  return table.get_shared_access_signature(policy,
+                                           string(), // Unnamed policy
+                                           // Start of range (inclusive)
+                                           partition,
+                                           row,
+                                           // End of range (inclusive)
+                                           partition,
+                                           row);
+}
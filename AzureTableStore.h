@@ -0,0 +1,47 @@
+#ifndef AzureTableStore_h
+#define AzureTableStore_h
+
+#include <string>
+#include <vector>
+
+#include <was/table.h>
+
+#include "TableStore.h"
+
+/*
+  A table in Azure Table Storage
+ */
+class AzureTableStore : public TableStore {
+private:
+  azure::storage::cloud_table table;
+public:
+  explicit AzureTableStore (const azure::storage::cloud_table& t) :
+    table {t}
+    {};
+
+  bool exists () override;
+  bool create_if_not_exists () override;
+  bool delete_table () override;
+
+  web::http::status_code retrieve (const std::string& partition,
+                                   const std::string& row,
+                                   azure::storage::table_entity& entity) override;
+  web::http::status_code retrieve (const std::string& partition,
+                                   const std::string& row,
+                                   const std::vector<std::string>& columns,
+                                   azure::storage::table_entity& entity) override;
+  web::http::status_code insert_or_merge (const azure::storage::table_entity& entity) override;
+  web::http::status_code merge (const azure::storage::table_entity& entity) override;
+  web::http::status_code remove (const std::string& partition,
+                                 const std::string& row) override;
+
+  web::http::status_code execute_batch (const std::vector<batch_write>& writes) override;
+
+  std::string query (const table_range& range, const entity_visitor_t& visit) override;
+
+  std::string shared_access_signature (const azure::storage::table_shared_access_policy& policy,
+                                       const std::string& partition,
+                                       const std::string& row) override;
+};
+
+#endif
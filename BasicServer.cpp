@@ -2,16 +2,22 @@
  Basic Server code for CMPT 276, Spring 2016.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
 #include <exception>
-#include <iostream>
 #include <memory>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
 #include <cpprest/base_uri.h>
-#include <cpprest/http_listener.h>
+#include <cpprest/containerstream.h>
 #include <cpprest/json.h>
 
 #include <pplx/pplxtasks.h>
@@ -20,7 +26,20 @@
 #include <was/storage_account.h>
 #include <was/table.h>
 
+#include "Compress.h"
+#include "EntityCache.h"
+#include "EntityCounter.h"
+#include "EntityJson.h"
+#include "JsonStream.h"
+#include "Logger.h"
+#include "ParallelScan.h"
+#include "PropertyIndex.h"
+#include "Router.h"
+#include "ServerConfig.h"
+#include "Snapshot.h"
 #include "TableCache.h"
+#include "TableStore.h"
+#include "WriteCombiner.h"
 #include "make_unique.h"
 #include "ServerUtils.h"
 
@@ -42,18 +61,17 @@ using azure::storage::table_result;
 using pplx::extensibility::critical_section_t;
 using pplx::extensibility::scoped_critical_section_t;
 
-using std::cin;
-using std::cout;
-using std::endl;
-using std::getline;
 using std::make_pair;
 using std::pair;
+using std::shared_ptr;
 using std::string;
+using std::unique_ptr;
 using std::unordered_map;
 using std::vector;
 
 using web::http::http_headers;
 using web::http::http_request;
+using web::http::http_response;
 using web::http::methods;
 using web::http::status_code;
 using web::http::status_codes;
@@ -61,11 +79,10 @@ using web::http::uri;
 
 using web::json::value;
 
-using web::http::experimental::listener::http_listener;
 
 using prop_vals_t = vector<pair<string,value>>;
 
-constexpr const char* def_url = "http://localhost:34568";
+constexpr unsigned def_port {34568};
 
 const string create_table {"CreateTableAdmin"};
 const string delete_table {"DeleteTableAdmin"};
@@ -80,41 +97,111 @@ const string update_auth {"UpdateEntityAuth"};
 const string add_property {"AddPropertyAdmin"};
 const string update_property {"UpdatePropertyAdmin"};
 
+// Writes of many entities in one request
+const string batch_update {"BatchUpdateAdmin"};
+const string batch_delete {"BatchDeleteAdmin"};
+constexpr std::size_t max_batch_transactions {8}; // Transactions written at once
+static_assert(max_batch_transactions <= max_handler_tasks, "see pool_threads_needed()");
+
+// Whole tables moved as newline-delimited JSON, one entity per line
+const string export_table {"ExportTableAdmin"};
+const string import_table {"ImportTableAdmin"};
+constexpr std::size_t import_chunk_bytes {64 * 1024}; // Read from the body at a time
+constexpr std::size_t max_import_batches {8}; // Batches written at once
+static_assert(max_import_batches <= max_handler_tasks, "see pool_threads_needed()");
+constexpr std::size_t max_import_partitions {64}; // Partitions with a batch being filled
+constexpr std::size_t max_import_line_bytes {1024 * 1024}; // Longer lines are Invalid
+
+// Report of entity cache hit and miss counts
+const string cache_stats {"CacheStatsAdmin"};
+
+// Counts of entities by partition and by property
+const string count_entities {"CountEntitiesAdmin"};
+const string recount_param {"$recount"};
+
+// Secondary indexes on one property of a table
+const string create_index {"CreateIndexAdmin"};
+const string delete_index {"DeleteIndexAdmin"};
+const string query_index {"QueryIndexAdmin"};
+constexpr std::size_t max_index_reads {16}; // Entities read from storage at once per query
+static_assert(max_index_reads <= max_handler_tasks, "see pool_threads_needed()");
+
+// Paging of table and partition reads
+const string top_param {"$top"};
+const string continuation_param {"continuation"};
+const string continuation_header {"Continuation"};
+
+// Projection of reads onto named properties, comma separated
+const string select_param {"$select"};
+
+// Full-table reads split into partition ranges read at once
+const string parallel_param {"$parallel"};
+const string split_param {"$split"}; // Partition keys to split at, comma separated
+constexpr std::size_t max_scan_workers {16};
+constexpr int max_page_size {1000}; // Largest take count the table service accepts
+
+/*
+  Page of a table or partition read requested by the query string
+
+  paged is false when neither $top nor continuation is present,
+  in which case the read returns every entity, as before.
+ */
+struct page_request {
+  bool paged;
+  int top;
+  string continuation;
+};
+
 /*
   Cache of opened tables
  */
 TableCache table_cache {};
 
 /*
-  Convert properties represented in Azure Storage type
-  to prop_vals_t type.
+  Cache of single entities read by ReadEntityAdmin and ReadEntityAuth
+
+  Entries live for --cache-ttl and the cache holds at most
+  --cache-bytes, by default entity_cache_bytes. Every write this
+  server makes to an entity invalidates it, so the TTL only bounds
+  staleness from writes made directly to storage by other clients.
+
+  Made by main() from the options, before any request arrives.
  */
-prop_vals_t get_properties (const table_entity::properties_type& properties, prop_vals_t values = prop_vals_t {}) {
-  for (const auto v : properties) {
-    if (v.second.property_type() == edm_type::string) {
-      values.push_back(make_pair(v.first, value::string(v.second.string_value())));
-    }
-    else if (v.second.property_type() == edm_type::datetime) {
-      values.push_back(make_pair(v.first, value::string(v.second.str())));
-    }
-    else if(v.second.property_type() == edm_type::int32) {
-      values.push_back(make_pair(v.first, value::number(v.second.int32_value())));      
-    }
-    else if(v.second.property_type() == edm_type::int64) {
-      values.push_back(make_pair(v.first, value::number(v.second.int64_value())));      
-    }
-    else if(v.second.property_type() == edm_type::double_floating_point) {
-      values.push_back(make_pair(v.first, value::number(v.second.double_value())));      
-    }
-    else if(v.second.property_type() == edm_type::boolean) {
-      values.push_back(make_pair(v.first, value::boolean(v.second.boolean_value())));      
-    }
-    else {
-      values.push_back(make_pair(v.first, value::string(v.second.str())));
-    }
-  }
-  return values;
-}
+constexpr std::size_t entity_cache_bytes {64 * 1024 * 1024};
+unique_ptr<EntityCache> entity_cache {};
+
+/*
+  Indexes created by CreateIndexAdmin, kept current by this
+  server's writes
+ */
+PropertyIndex property_index {};
+
+/*
+  Partitions seen by full-table reads, where $parallel reads split
+  a table
+ */
+PartitionSampler partition_sampler {};
+
+/*
+  Entity counts made by CountEntitiesAdmin, kept current by this
+  server's writes
+ */
+EntityCounter entity_counter {};
+
+/*
+  JSON bodies of at least this many bytes are compressed for
+  clients that accept gzip or deflate. The second command-line
+  argument changes it.
+ */
+size_t compress_threshold {1024};
+
+/*
+  Combines concurrent UpdateEntityAdmin merges to the same entity
+
+  Off unless --write-combine-ms gives it a window, as waiting adds
+  that much latency to every write, contended or not.
+ */
+WriteCombiner write_combiner {std::chrono::milliseconds {0}};
 
 /*
   Return true if an HTTP request has a JSON body
@@ -170,385 +257,1213 @@ unordered_map<string,string> get_json_body(http_request message) {
 }
 
 /*
-  Top-level routine for processing all HTTP GET requests.
+  Given an HTTP message with a JSON body, return the body as a
+  JSON value, or a null value if the message has no JSON body.
 
-  GET is the only request that has no command. All
-  operands specify the value(s) to be retrieved.
+  Like get_json_body(), this can only be called once for a
+  given message.
  */
-void handle_get(http_request message) {
+value get_json_value (http_request message) {
+  const http_headers& headers {message.headers()};
+  auto content_type (headers.find("Content-Type"));
+  if (content_type == headers.end() ||
+      content_type->second != "application/json")
+    return value::null();
 
-  unordered_map<string,string> json_body {get_json_body(message)};
+  value json {};
+  message.extract_json(true)
+    .then([&json](value v) -> bool
+	  {
+            json = v;
+	    return true;
+	  })
+    .wait();
+  return json;
+}
 
-  string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** GET " << path << endl;
-  auto paths = uri::split_path(path);
-  // Need at least a table name
-  if (paths.size() < 2) {
-    message.reply(status_codes::BadRequest);
+/*
+  Split a comma-separated list, dropping empty names
+ */
+vector<string> split_names (const string& names) {
+  vector<string> result {};
+  string::size_type start {0};
+  while (start <= names.size()) {
+    string::size_type comma {names.find(',', start)};
+    if (comma == string::npos)
+      comma = names.size();
+    string name {names.substr(start, comma - start)};
+    if ( ! name.empty())
+      result.push_back(name);
+    start = comma + 1;
+  }
+  return result;
+}
+
+/*
+  Parse the $select query parameter of a request into the names
+  of the properties to return. An empty result returns them all.
+ */
+vector<string> get_select (const http_request& message) {
+  auto query = uri::split_query(message.relative_uri().query());
+  auto select = query.find(select_param);
+  if (select == query.end())
+    return vector<string> {};
+  return split_names(uri::decode(select->second));
+}
+
+/*
+  Parse the $parallel and $split query parameters of a full-table
+  read into the number of ranges to read at once and the partition
+  keys to split the table at
+
+  $parallel=N reads the table as up to N ranges at once, at most
+  max_scan_workers. The ranges are cut at the partition keys listed
+  in $split if it is present, and otherwise where partition_sampler
+  has seen the table's partitions lie. cuts is left empty, for a
+  sequential read, if neither gives a place to cut.
+
+  Returns false if $parallel is present but is not a positive integer.
+ */
+bool get_parallel_scan (const http_request& message, const string& table,
+                        size_t& workers, vector<string>& cuts) {
+  workers = 1;
+  cuts.clear();
+  auto query = uri::split_query(message.relative_uri().query());
+  auto parallel = query.find(parallel_param);
+  if (parallel == query.end())
+    return true;
+  try {
+    int n {std::stoi(uri::decode(parallel->second))};
+    if (n <= 0)
+      return false;
+    workers = std::min(static_cast<size_t> (n), max_scan_workers);
+  }
+  catch (const std::exception&) {
+    return false;
+  }
+  if (workers == 1)
+    return true;
+
+  auto split = query.find(split_param);
+  if (split != query.end()) {
+    cuts = split_names(uri::decode(split->second));
+    std::sort(cuts.begin(), cuts.end());
+    cuts.erase(std::unique(cuts.begin(), cuts.end()), cuts.end());
+  }
+  else {
+    cuts = partition_sampler.boundaries(table, workers);
+  }
+  return true;
+}
+
+/*
+  Parse the $top and continuation query parameters of a request
+
+  Returns false if $top is present but is not a positive integer.
+  A $top larger than max_page_size is clamped.
+ */
+bool get_page_request (const http_request& message, page_request& page) {
+  page = page_request {false, max_page_size, string {}};
+  auto query = uri::split_query(message.relative_uri().query());
+
+  auto top = query.find(top_param);
+  if (top != query.end()) {
+    page.paged = true;
+    try {
+      page.top = std::stoi(uri::decode(top->second));
+    }
+    catch (const std::exception&) {
+      return false;
+    }
+    if (page.top <= 0)
+      return false;
+    if (page.top > max_page_size)
+      page.top = max_page_size;
+  }
+
+  auto cont = query.find(continuation_param);
+  if (cont != query.end()) {
+    page.paged = true;
+    page.continuation = uri::decode(cont->second);
+  }
+  return true;
+}
+
+/*
+  Split the path of a token operation,
+  OPERATION/TABLE/TOKEN/PARTITION/ROW, into its parts.
+
+  As in read_with_token(), the path is split before it is decoded,
+  because the token may contain encoded '/' characters. The token
+  is left encoded; it is only used as an identifier.
+
+  Returns false if the path does not have five parts.
+ */
+bool get_token_path (const http_request& message, string& table, string& token,
+                     string& partition, string& row) {
+  const vector<string> undecoded_paths {uri::split_path(message.relative_uri().path())};
+  if (undecoded_paths.size() != 5)
+    return false;
+  table = uri::decode(undecoded_paths[1]);
+  token = undecoded_paths[2];
+  partition = uri::decode(undecoded_paths[3]);
+  row = uri::decode(undecoded_paths[4]);
+  return true;
+}
+
+/*
+  Reply with the entity cache's counters
+ */
+void reply_cache_stats (http_request message) {
+  EntityCache::stats_t stats {entity_cache->stats()};
+  message.reply(status_codes::OK, value::object(prop_vals_t {
+    make_pair("Hits", value::number(static_cast<int64_t> (stats.hits))),
+    make_pair("SnapshotHits", value::number(static_cast<int64_t> (stats.snapshot_hits))),
+    make_pair("Misses", value::number(static_cast<int64_t> (stats.misses))),
+    make_pair("Evictions", value::number(static_cast<int64_t> (stats.evictions))),
+    make_pair("Invalidations", value::number(static_cast<int64_t> (stats.invalidations))),
+    make_pair("Entries", value::number(static_cast<int64_t> (stats.entries))),
+    make_pair("Bytes", value::number(static_cast<int64_t> (stats.bytes)))
+  }));
+}
+
+/*
+  The coding to use for a response to message, or the empty
+  string for none
+ */
+string response_coding (const http_request& message) {
+  const http_headers& headers {message.headers()};
+  auto accept (headers.find("Accept-Encoding"));
+  if (accept == headers.end())
+    return string {};
+  return choose_coding(accept->second);
+}
+
+/*
+  Set a response body that is already JSON text, compressing it
+  if it is large enough and the client accepts a coding we offer
+ */
+void set_json_body (const http_request& message, http_response& response, const string& body) {
+  response.headers().add("Vary", "Accept-Encoding");
+  if (body.size() >= compress_threshold) {
+    string coding {response_coding(message)};
+    string compressed {};
+    if ( ! coding.empty() && compress_body(body, coding, compressed)) {
+      response.headers().add("Content-Encoding", coding);
+      response.set_body(std::move(compressed), "application/json");
+      return;
+    }
+  }
+  response.set_body(body, "application/json");
+}
+
+/*
+  Reply OK with a body that is already JSON text
+ */
+void reply_json (http_request message, const string& body) {
+  http_response response {status_codes::OK};
+  set_json_body(message, response, body);
+  message.reply(response);
+}
+
+/*
+  Reply with a single entity's properties and its ETag
+
+  If the request's If-None-Match names the entity's ETag, the
+  reply is 304 Not Modified with no body, and the entity is not
+  serialized at all. An entity with no properties gets no body
+  unless always_body is set.
+ */
+void reply_entity (http_request message, const table_entity& entity, bool always_body) {
+  const http_headers& headers {message.headers()};
+  auto if_none_match (headers.find("If-None-Match"));
+  if (if_none_match != headers.end() && etag_matches(if_none_match->second, entity.etag())) {
+    http_response response {status_codes::NotModified};
+    response.headers().add("ETag", entity.etag());
+    message.reply(response);
     return;
   }
 
-  cloud_table table = table_cache.lookup_table(paths[1]);
-  if ( ! table.exists()) {
+  http_response response {status_codes::OK};
+  if ( ! entity.etag().empty())
+    response.headers().add("ETag", entity.etag());
+  if (always_body || entity.properties().size() > 0) {
+    ScopedJsonBuffer body_buffer {};
+    string& body = body_buffer.text();
+    append_entity_json(body, entity, false);
+    set_json_body(message, response, body);
+  }
+  message.reply(response);
+}
+
+/*
+  Reply with one page of entities, the JSON array body, adding the
+  Continuation header if there are more
+ */
+void reply_page (http_request message, const string& body, const string& next) {
+  http_response response {status_codes::OK};
+  if ( ! next.empty())
+    response.headers().add(continuation_header, next);
+  set_json_body(message, response, body);
+  message.reply(response);
+}
+
+/*
+  Read a table or partition, or for a paged request one page of
+  it, appending the entities to body as a JSON array. If columns
+  is not empty, only those properties are read.
+
+  Sets count to the number of entities read and next to the
+  continuation for the following page. Returns false, having
+  replied BadRequest, if the continuation could not be resumed.
+ */
+bool read_page (http_request message, TableStore& table, const string& partition,
+                const page_request& page, const vector<string>& columns,
+                string& body, size_t& count, string& next) {
+  body.push_back('[');
+  count = 0;
+  try {
+    next = table.query(table_range {partition, page.paged ? page.top : 0, page.continuation, columns},
+                       [&body, &count] (const table_entity& e) {
+                         if (count++ > 0)
+                           body.push_back(',');
+                         append_entity_json(body, e, true);
+                       });
+  }
+  catch (const std::exception& e) {
+    log_warning() << "Bad continuation: " << e.what();
+    message.reply(status_codes::BadRequest);
+    return false;
+  }
+  body.push_back(']');
+  return true;
+}
+
+/*
+  Convert a JSON object with string Partition and Row properties,
+  an element of a batch or a line of an import, to an entity. Its
+  other properties become string properties, with non-string
+  values kept as their JSON text, unless keys_only is true.
+
+  Returns false if item is not such an object.
+ */
+bool entity_from_json (const value& item, bool keys_only, table_entity& entity) {
+  if ( ! item.is_object() ||
+       ! item.has_field("Partition") || ! item.at("Partition").is_string() ||
+       ! item.has_field("Row") || ! item.at("Row").is_string())
+    return false;
+  entity = table_entity {item.at("Partition").as_string(), item.at("Row").as_string()};
+  if (keys_only)
+    return true;
+  table_entity::properties_type& properties = entity.properties();
+  for (const auto& v : item.as_object()) {
+    if (v.first == "Partition" || v.first == "Row")
+      continue;
+    properties[v.first] = entity_property {v.second.is_string() ? v.second.as_string()
+                                                                 : v.second.serialize()};
+  }
+  return true;
+}
+
+/*
+  Writes to one partition that storage applies as one transaction
+
+  index holds the position in the request of each write.
+ */
+struct batch_group {
+  vector<batch_write> writes;
+  vector<vector<value>::size_type> index;
+  std::unordered_set<string> rows;
+};
+
+/*
+  BatchUpdateAdmin/TABLE (PUT) and BatchDeleteAdmin/TABLE (DELETE)
+
+  The body is a JSON array of entities, each an object with
+  "Partition" and "Row" and, for an update, the properties to
+  merge. Entities are grouped by partition into transactions of
+  at most TableStore::max_batch_size, and up to
+  max_batch_transactions of them run at once.
+
+  Replies OK with an array giving each entity's Partition, Row and
+  Status, in the order of the request. A transaction succeeds or
+  fails as a whole, so every entity in a failed one gets its
+  status. An entity without a string Partition and Row gets
+  BadRequest and the rest are still written.
+ */
+void handle_batch (http_request message, const string& table_name, bool remove) {
+  bool exists {false};
+  shared_ptr<TableStore> table {table_cache.lookup_table(table_name, exists)};
+  if ( ! exists) {
     message.reply(status_codes::NotFound);
     return;
   }
 
-  // GET all entries in table
-  if (paths.size() == 2) {
-    if (paths[0] != read_entity) {
-      message.reply(status_codes::BadRequest);
-      return;
+  value body {get_json_value(message)};
+  if ( ! body.is_array()) {
+    message.reply(status_codes::BadRequest);
+    return;
+  }
+  const web::json::array& items = body.as_array();
+
+  vector<status_code> statuses (items.size(), status_codes::BadRequest);
+  vector<bool> attempted (items.size(), false); // Sent to storage in some transaction
+  vector<pair<string,string>> keys (items.size());
+  vector<batch_group> groups {};
+  unordered_map<string,vector<batch_group>::size_type> open_group {};
+  for (vector<value>::size_type i {0}; i < items.size(); ++i) {
+    table_entity entity {};
+    if ( ! entity_from_json(items.at(i), remove, entity))
+      continue;
+    keys[i] = make_pair(entity.partition_key(), entity.row_key());
+    attempted[i] = true;
+    const string& partition = keys[i].first;
+    const string& row = keys[i].second;
+
+    // A transaction may not name the same entity twice
+    auto g = open_group.find(partition);
+    if (g == open_group.end() ||
+        groups[g->second].writes.size() == TableStore::max_batch_size ||
+        groups[g->second].rows.count(row) > 0) {
+      groups.push_back(batch_group {});
+      open_group[partition] = groups.size() - 1;
     }
+    batch_group& group = groups[open_group[partition]];
+    group.writes.push_back(batch_write {remove, entity});
+    group.index.push_back(i);
+    group.rows.insert(row);
+  }
 
-    table_query query {};
-    table_query_iterator end;
-    table_query_iterator it = table.execute_query(query);
-    vector<value> key_vec;
-
-    if (json_body.size() == 0) {
-      cout << "**** No JSON body found" << endl;
-      while (it != end) {
-        cout << "Key: " << it->partition_key() << " / " << it->row_key() << endl;
-        
-        prop_vals_t keys {
-          make_pair("Partition",value::string(it->partition_key())),
-          make_pair("Row", value::string(it->row_key()))
-        };
-        
-        keys = get_properties(it->properties(), keys);
-
-      /*cout << std::get<0>(keys[2]) << endl;      
-      cout << value::object(keys) << endl;
-        cout << it->partition_key() << endl;
-        cout << keys.size() << endl;*/
-
-        key_vec.push_back(value::object(keys));
-        ++it;
+  log_info() << "Batch of " << items.size() << " in " << groups.size() << " transactions";
+  std::deque<pplx::task<void>> writing {};
+  for (const auto& group : groups) {
+    if (writing.size() == max_batch_transactions) {
+      writing.front().wait();
+      writing.pop_front();
+    }
+    writing.push_back(pplx::create_task([&table, &table_name, &group, &statuses] () {
+      status_code code {table->execute_batch(group.writes)};
+      for (auto i : group.index) {
+        statuses[i] = code;
       }
-      message.reply(status_codes::OK, value::array(key_vec));
-      return;
-  }
-  else if (json_body.size() > 0) {
-    cout << "**** JSON Body found" << endl;
-
-    bool entityExists = false;
-    while (it != end) {
-      int count = 0;
-      bool outputKey = false;
-      for(const auto& n : json_body) {
-          
-          prop_vals_t keys {
-            make_pair("Partition",value::string(it->partition_key())),
-            make_pair("Row", value::string(it->row_key()))
-        };
-          
-          keys = get_properties(it->properties(), keys);
-          //cout << value::object(keys) << endl;
-          //cout << it->partition_key() << endl;
-          
-          for (int i = 2; i < keys.size(); i = i + 2) {
-            ///cout << "for loop" << endl;
-            //cout << n.first << "    " << std::get<0>(keys[i]) << endl;
-            if (n.first == std::get<0>(keys[i])) {
-              //cout << "if statement" << endl;
-              count++;
-              if (!outputKey) {
-                cout << "Key: " << it->partition_key() << " / " << it->row_key() << endl;
-                outputKey = true;
-              }
-          }
-        }
-        //cout << count << "          " << keys.size() << endl;
-        if(count == keys.size() - 2) {
-          key_vec.push_back(value::object(keys));
-          entityExists = true;
-        }
+      if (code == status_codes::OK) {
+        for (const auto& w : group.writes) {
+          if (w.remove)
+            property_index.removed(table_name, w.entity.partition_key(), w.entity.row_key());
+          else
+            property_index.merged(table_name, w.entity);
         }
-    ++it;
+      }
+    }));
+  }
+  for (auto& t : writing) {
+    t.wait();
+  }
 
+  vector<value> results {};
+  results.reserve(items.size());
+  for (vector<value>::size_type i {0}; i < items.size(); ++i) {
+    if (attempted[i]) {
+      entity_cache->invalidate(table_name, keys[i].first, keys[i].second);
+      entity_counter.changed(table_name, keys[i].first);
     }
-    if (entityExists) {
-        message.reply(status_codes::OK, value::array(key_vec));
-        return;
-    }
-    else {
-      message.reply(status_codes::BadRequest);
-    }
+    results.push_back(value::object(prop_vals_t {
+      make_pair("Partition", value::string(keys[i].first)),
+      make_pair("Row", value::string(keys[i].second)),
+      make_pair("Status", value::number(statuses[i]))
+    }));
   }
-  
+  message.reply(status_codes::OK, value::array(results));
+}
+
+/*
+  QueryIndexAdmin/TABLE/PROPERTY/VALUE (GET)
+
+  Replies OK with a JSON array of the entities of TABLE whose
+  PROPERTY is VALUE, in (partition, row) order, NotFound if there
+  is no such index, or BadRequest if TABLE is not a valid table
+  name. VALUE may contain an encoded '/', which splits it into
+  further segments that are joined again here.
+
+  The index supplies the keys; each entity is then read, from the
+  entity cache when it can be, and dropped if its PROPERTY no
+  longer has VALUE because another process changed it. Up to
+  max_index_reads entities are read from storage at once, so the
+  request costs O(matches) rather than a scan of the table.
+ */
+void handle_index_query (http_request message, const vector<string>& paths) {
+  const string& table_name {paths[1]};
+  const string& property {paths[2]};
+  string property_value {paths[3]};
+  for (vector<string>::size_type i {4}; i < paths.size(); ++i) {
+    property_value += "/" + paths[i];
   }
-  // GET specific entry: Partition == paths[2], Row == paths[3]
-  if (paths.size() < 4)
-  {
+  // The name reaches the table cache, and a local store's file name
+  if ( ! TableCache::valid_table_name(table_name)) {
     message.reply(status_codes::BadRequest);
     return;
   }
-  
-  if (paths[3] == "*") {
-    if (paths[0] != read_entity) {
-      message.reply(status_codes::BadRequest);
-      return;
-    }
 
-    table_query query2 {};
-    query2.set_filter_string(azure::storage::table_query::generate_filter_condition(U("PartitionKey"), azure::storage::query_comparison_operator::equal, U(paths[2])));
-    table_query_iterator it = table.execute_query(query2);
-    table_query_iterator end;
-    vector<value> values2_vec {};
-    bool partition_exists = false;
-    while (it != end) {
-        if (it->partition_key() == paths[2]) {
-          partition_exists = true;
-        prop_vals_t values2 {
-          make_pair("Partition", value::string(it->partition_key())),
-          make_pair("Row", value::string(it->row_key()))
-        };
-        values2 = get_properties(it->properties(), values2);
-        values2_vec.push_back(value::object(values2));
-        ++it;
-      }
-    }
-    if (partition_exists) {
-      message.reply(status_codes::OK, value::array(values2_vec));
-      return;
-    }
-    else {
-      message.reply(status_codes::BadRequest);
-      return;
+  bool exists {false};
+  shared_ptr<TableStore> table {table_cache.lookup_table(table_name, exists)};
+  vector<PropertyIndex::key_t> keys {};
+  if ( ! exists || ! property_index.lookup(table_name, property, property_value, keys)) {
+    message.reply(status_codes::NotFound);
+    return;
+  }
+
+  const vector<string> columns {get_select(message)};
+  // The indexed property must be read to confirm the match, though not returned
+  vector<string> read_columns {columns};
+  if ( ! read_columns.empty())
+    read_columns.push_back(property);
+
+  vector<table_entity> entities (keys.size());
+  vector<char> found (keys.size(), false); // Not vector<bool>, which tasks could not set concurrently
+  // The cache misses, with their tickets, to read from storage
+  vector<pair<vector<PropertyIndex::key_t>::size_type,uint64_t>> misses {};
+  for (vector<PropertyIndex::key_t>::size_type i {0}; i < keys.size(); ++i) {
+    uint64_t ticket {0};
+    if (entity_cache->lookup(table_name, keys[i].first, keys[i].second, entities[i], ticket))
+      found[i] = true;
+    else
+      misses.push_back(make_pair(i, ticket));
+  }
+
+  // Each reader takes the next miss until none are left
+  std::atomic<size_t> next_miss {0};
+  auto read_misses = [&] () {
+    for (size_t m {next_miss++}; m < misses.size(); m = next_miss++) {
+      const auto i = misses[m].first;
+      if (table->retrieve(keys[i].first, keys[i].second, read_columns, entities[i]) != status_codes::OK)
+        continue;
+      found[i] = true;
+      if (read_columns.empty())
+        entity_cache->insert(table_name, keys[i].first, keys[i].second, entities[i], misses[m].second);
     }
+  };
+  vector<pplx::task<void>> tasks {};
+  for (size_t r {0}; r < std::min(misses.size(), max_index_reads); ++r) {
+    tasks.push_back(pplx::create_task(read_misses));
+  }
+  pplx::when_all(tasks.begin(), tasks.end()).wait();
+
+  ScopedJsonBuffer body_buffer {};
+  string& body = body_buffer.text();
+  size_t count {0};
+  body.push_back('[');
+  for (vector<table_entity>::size_type i {0}; i < entities.size(); ++i) {
+    if ( ! found[i])
+      continue;
+    table_entity& e = entities[i];
+    auto p = e.properties().find(property);
+    if (p == e.properties().end() || PropertyIndex::index_value(p->second) != property_value)
+      continue;
+    select_properties(e, columns);
+    if (count++ > 0)
+      body.push_back(',');
+    append_entity_json(body, e, true);
   }
+  body.push_back(']');
+  log_info() << "Index matched " << count << " of " << keys.size();
+  reply_json(message, body);
+}
+
+/*
+  Return the store for table_name, or reply NotFound and return
+  null if the table does not exist
+ */
+shared_ptr<TableStore> open_table (http_request message, const string& table_name) {
+  bool exists {false};
+  shared_ptr<TableStore> table {table_cache.lookup_table(table_name, exists)};
+  if ( ! exists) {
+    message.reply(status_codes::NotFound);
+    return nullptr;
+  }
+  return table;
+}
+
+/*
+  Visit every entity of table_name: as ranges read at once if cuts
+  is not empty, and otherwise in key order, noting each partition
+  in partition_sampler. Throws as TableStore::query() does.
+ */
+void scan_table (const string& table_name, TableStore& table, const vector<string>& columns,
+                 size_t workers, const vector<string>& cuts, const entity_visitor_t& visit) {
+  if ( ! cuts.empty()) {
+    // Entities of different ranges are interleaved rather than in key order
+    parallel_query(table, cuts, columns, workers, visit);
+    return;
+  }
+  string last_partition {};
+  table.query(table_range {string {}, 0, string {}, columns},
+              [&table_name, &last_partition, &visit] (const table_entity& e) {
+                if (e.partition_key() != last_partition) {
+                  last_partition = e.partition_key();
+                  partition_sampler.saw(table_name, last_partition);
+                }
+                visit(e);
+              });
+}
+
+/*
+  ReadEntityAdmin/TABLE (GET)
 
-  //GET specific entity 
-  if (paths.size() == 4) { 
-    if (paths[0] != read_entity) {
+  Read every entity in the table, a page of them, or, if the
+  request has a JSON body, those having the properties it names.
+  A read of every entity may be split into partition ranges read
+  at once; see get_parallel_scan().
+ */
+void read_table (http_request message, const vector<string>& paths) {
+  unordered_map<string,string> json_body {get_json_body(message)};
+  shared_ptr<TableStore> table {open_table(message, paths[1])};
+  if ( ! table)
+    return;
+  page_request page {};
+  if ( ! get_page_request(message, page)) {
+    message.reply(status_codes::BadRequest);
+    return;
+  }
+  const vector<string> columns {get_select(message)};
+
+  if (page.paged && json_body.size() == 0) {
+    ScopedJsonBuffer body_buffer {};
+    string& body = body_buffer.text();
+    size_t count {0};
+    string next {};
+    if (read_page(message, *table, string {}, page, columns, body, count, next))
+      reply_page(message, body, next);
+    return;
+  }
+
+  if (json_body.size() == 0) {
+    log_debug() << "**** No JSON body found";
+    /*
+      Stream the table as the store reads it, rather than
+      collecting every entity before replying. Only the current
+      storage page is held in memory.
+     */
+    size_t workers {1};
+    vector<string> cuts {};
+    if ( ! get_parallel_scan(message, paths[1], workers, cuts)) {
       message.reply(status_codes::BadRequest);
       return;
     }
-    table_operation retrieve_operation {table_operation::retrieve_entity(paths[2],paths[3])};
-    table_result retrieve_result {table.execute(retrieve_operation)};
-    cout << "HTTP code: " << retrieve_result.http_status_code() << endl;
-    if (retrieve_result.http_status_code() == status_codes::NotFound)
-    {
-      message.reply(status_codes::NotFound);
-      return;
+    JsonArrayStream stream {message, status_codes::OK, response_coding(message)};
+    ScopedJsonBuffer element_buffer {};
+    string& element = element_buffer.text();
+    try {
+      scan_table(paths[1], *table, columns, workers, cuts,
+                 [&stream, &element] (const table_entity& e) {
+                   log_debug() << "Key: " << e.partition_key() << " / " << e.row_key();
+                   element.clear();
+                   append_entity_json(element, e, true);
+                   stream.write_json(element);
+                 });
     }
-
-    table_entity entity {retrieve_result.entity()};
-    table_entity::properties_type properties {entity.properties()};
-    
-    // If the entity has any properties, return them as JSON
-    prop_vals_t values (get_properties(properties));
-    vector<pair<string,value>> entityvals 
-    {
-      ///make_pair("Partition", value::string(paths[2])),
-      //make_pair("Row", value::string(paths[3]))
-    };
-    entityvals.insert(entityvals.end(), values.begin(), values.end());
-    if (values.size() > 0)
-    {
-      message.reply(status_codes::OK, value::object(entityvals));
-      return;
+    catch (const std::exception& e) {
+      // Status has already been sent; all we can do is end the body
+      log_error() << "Table read error: " << e.what();
     }
-    else
-    {
-      message.reply(status_codes::OK);
-      return;
+    stream.close();
+    return;
+  }
+
+  log_debug() << "**** JSON Body found";
+  /*
+    Compile the body once, then test each entity in a single pass
+    over its property map. Properties are only converted to JSON
+    for entities that match.
+   */
+  const PropertyFilter filter {json_body};
+  // The filter's properties must be read too, though not returned
+  vector<string> read_columns {columns};
+  if ( ! read_columns.empty()) {
+    for (const auto& p : json_body) {
+      read_columns.push_back(p.first);
     }
   }
-  
-  //Get with read_auth and token
-  if (paths.size() >= 5) {
-    cout << "**** GET using token" << endl;
-    if (paths[0] != read_auth) {
-      message.reply(status_codes::BadRequest);
+  ScopedJsonBuffer body_buffer {};
+  string& body = body_buffer.text();
+  size_t count {0};
+  body.push_back('[');
+  table->query(table_range {string {}, 0, string {}, read_columns},
+               [&filter, &columns, &body, &count] (const table_entity& e) {
+                 if (filter.matches(e.properties())) {
+                   log_debug() << "Key: " << e.partition_key() << " / " << e.row_key();
+                   if (count++ > 0)
+                     body.push_back(',');
+                   if (columns.empty()) {
+                     append_entity_json(body, e, true);
+                   }
+                   else {
+                     table_entity selected {e};
+                     select_properties(selected, columns);
+                     append_entity_json(body, selected, true);
+                   }
+                 }
+               });
+  body.push_back(']');
+  if (count > 0)
+    reply_json(message, body);
+  else
+    message.reply(status_codes::BadRequest);
+}
+
+/*
+  ExportTableAdmin/TABLE (GET)
+
+  Stream every entity of TABLE as newline-delimited JSON, one
+  entity per line in the form ReadEntityAdmin returns it. As for a
+  full-table read, only the current storage page is held in memory,
+  and $select and $parallel apply.
+ */
+void export_table_admin (http_request message, const vector<string>& paths) {
+  shared_ptr<TableStore> table {open_table(message, paths[1])};
+  if ( ! table)
+    return;
+  size_t workers {1};
+  vector<string> cuts {};
+  if ( ! get_parallel_scan(message, paths[1], workers, cuts)) {
+    message.reply(status_codes::BadRequest);
+    return;
+  }
+  const vector<string> columns {get_select(message)};
+
+  NdjsonStream stream {message, status_codes::OK, response_coding(message)};
+  ScopedJsonBuffer line_buffer {};
+  string& line = line_buffer.text();
+  size_t count {0};
+  try {
+    scan_table(paths[1], *table, columns, workers, cuts,
+               [&stream, &line, &count] (const table_entity& e) {
+                 line.clear();
+                 append_entity_json(line, e, true);
+                 stream.write_json(line);
+                 ++count;
+               });
+  }
+  catch (const std::exception& e) {
+    // Status has already been sent; all we can do is end the body
+    log_error() << "Table export error: " << e.what();
+  }
+  stream.close();
+  log_info() << "Exported " << count << " entities of " << paths[1];
+}
+
+/*
+  ReadEntityAdmin/TABLE/PARTITION/ROW (GET)
+
+  Read one entity or, if ROW is "*", every entity in PARTITION.
+ */
+void read_entity_admin (http_request message, const vector<string>& paths) {
+  shared_ptr<TableStore> table {open_table(message, paths[1])};
+  if ( ! table)
+    return;
+  page_request page {};
+  if ( ! get_page_request(message, page)) {
+    message.reply(status_codes::BadRequest);
+    return;
+  }
+  const vector<string> columns {get_select(message)};
+
+  if (paths[3] == "*") {
+    ScopedJsonBuffer body_buffer {};
+    string& body = body_buffer.text();
+    size_t count {0};
+    string next {};
+    if ( ! read_page(message, *table, paths[2], page, columns, body, count, next))
       return;
-    }
-    pair<status_code, table_entity> reader {
-      read_with_token (message,
-        tables_endpoint
-      )
-    };
-    cout << "HTTP code: " << reader.first << endl;
-    if (reader.first == status_codes::OK) {
-      ///value v {value::table_entity(reader.second)};
-      table_entity::properties_type properties {reader.second.properties()};
-  
-      // If the entity has any properties, return them as JSON
-      prop_vals_t values (get_properties(properties));
-      //cout << std::get<1>(values[0]) << endl;
-      vector<pair<string,value>> entityvals 
-      {
-        ///make_pair("Partition", value::string(paths[2])),
-        //make_pair("Row", value::string(paths[3]))
-      };
-      entityvals.insert(entityvals.end(), values.begin(), values.end());
-
-      message.reply(status_codes::OK, value::object(entityvals));
+    // A partition with no entities is an error, except on a later page
+    if (count == 0 && next.empty() && page.continuation.empty()) {
+      message.reply(status_codes::BadRequest);
       return;
     }
-    else {
-      message.reply(reader.first);
+    reply_page(message, body, next);
+    return;
+  }
+
+  table_entity entity {};
+  uint64_t ticket {0};
+  if (entity_cache->lookup(paths[1], paths[2], paths[3], entity, ticket)) {
+    select_properties(entity, columns);
+  }
+  else {
+    status_code code {table->retrieve(paths[2], paths[3], columns, entity)};
+    log_debug() << "HTTP code: " << code;
+    if (code != status_codes::OK) {
+      message.reply(code);
       return;
     }
+    // Only whole entities are cached
+    if (columns.empty())
+      entity_cache->insert(paths[1], paths[2], paths[3], entity, ticket);
+  }
+
+  // If the entity has any properties, return them as JSON
+  reply_entity(message, entity, false);
+}
 
+/*
+  ReadEntityAuth/TABLE/TOKEN/PARTITION/ROW (GET)
+ */
+void read_entity_auth (http_request message, const vector<string>& paths) {
+  if ( ! open_table(message, paths[1]))
+    return;
+  page_request page {};
+  if ( ! get_page_request(message, page)) {
+    message.reply(status_codes::BadRequest);
+    return;
   }
-  else if (paths[0] == read_auth) {
+  const vector<string> columns {get_select(message)};
+
+  string tname, token, partition, row;
+  if ( ! get_token_path(message, tname, token, partition, row)) {
     message.reply(status_codes::BadRequest);
     return;
   }
+  pair<status_code, table_entity> reader {status_codes::OK, table_entity {}};
+  uint64_t ticket {0};
+  if (entity_cache->lookup(tname, partition, row, token, reader.second, ticket)) {
+    select_properties(reader.second, columns);
+  }
+  else {
+    reader = read_with_token (message,
+      tables_endpoint,
+      columns
+    );
+    log_debug() << "HTTP code: " << reader.first;
+    if (reader.first == status_codes::OK && columns.empty())
+      entity_cache->insert(tname, partition, row, token, reader.second, ticket);
+  }
+  if (reader.first == status_codes::OK)
+    reply_entity(message, reader.second, true);
+  else
+    message.reply(reader.first);
+}
 
-  message.reply(status_codes::BadRequest);
+/*
+  CreateTableAdmin/TABLE (POST), idempotent if the table exists
+ */
+void create_table_admin (http_request message, const vector<string>& paths) {
+  const string& table_name = paths[1];
+  shared_ptr<TableStore> table {table_cache.lookup_table(table_name)};
+  log_info() << "Create " << table_name;
+  bool created {table->create_if_not_exists()};
+  table_cache.table_created(table_name);
+  if (created)
+    message.reply(status_codes::Created);
+  else
+    message.reply(status_codes::Accepted);
 }
 
 /*
-  Top-level routine for processing all HTTP POST requests.
+  CreateIndexAdmin/TABLE/PROPERTY (POST), which also rebuilds an
+  existing index
+
+  Replies OK with the number of entities indexed, or Conflict if
+  the index is already being built.
  */
-void handle_post(http_request message) {
-  string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** POST " << path << endl;
-  auto paths = uri::split_path(path);
-  // Need at least an operation and a table name
-  if (paths.size() < 2) {
-    message.reply(status_codes::BadRequest);
+void create_index_admin (http_request message, const vector<string>& paths) {
+  shared_ptr<TableStore> table {open_table(message, paths[1])};
+  if ( ! table)
+    return;
+  log_info() << "Index " << paths[1] << " / " << paths[2];
+  size_t count {0};
+  try {
+    if ( ! property_index.build(paths[1], paths[2], *table, count)) {
+      message.reply(status_codes::Conflict);
+      return;
+    }
+  }
+  catch (const std::exception& e) {
+    log_error() << "Index build error: " << e.what();
+    message.reply(status_codes::InternalError);
     return;
   }
+  message.reply(status_codes::OK, value::object(prop_vals_t {
+    make_pair("Entities", value::number(static_cast<int64_t> (count)))
+  }));
+}
+
+/*
+  CountEntitiesAdmin/TABLE[/PARTITION] (GET)
+
+  Count the entities of a table, or of one of its partitions,
+  reading only their keys. The reply is
+
+    {"Entities": N, "Partitions": {"P": N, ...}, "Properties": {"Name": N, ...}}
 
-  string table_name {paths[1]};
-  cloud_table table {table_cache.lookup_table(table_name)};
-  
-  // Create table (idempotent if table exists)
-  if (paths[0] == create_table) {
-    cout << "Create " << table_name << endl;
-    bool created {table.create_if_not_exists()};
-    cout << "Administrative table URI " << table.uri().primary_uri().to_string() << endl;
-    if (created)
-      message.reply(status_codes::Created);
+  where Properties counts, for each property named in $select, the
+  entities having it. A table's counts are kept and brought up to
+  date by recounting only the partitions written since; see
+  EntityCounter. $recount=true recounts the whole table, which
+  $parallel splits as it does a full-table read.
+ */
+void count_entities_admin (http_request message, const vector<string>& paths) {
+  shared_ptr<TableStore> table {open_table(message, paths[1])};
+  if ( ! table)
+    return;
+  const vector<string> properties {get_select(message)};
+  size_t workers {1};
+  vector<string> cuts {};
+  if ( ! get_parallel_scan(message, paths[1], workers, cuts)) {
+    message.reply(status_codes::BadRequest);
+    return;
+  }
+  auto query = uri::split_query(message.relative_uri().query());
+  auto recount = query.find(recount_param);
+  const bool whole {recount != query.end() && uri::decode(recount->second) == "true"};
+
+  EntityCounter::counts_t counts {};
+  try {
+    if (paths.size() > 2)
+      counts = entity_counter.count_partition(*table, paths[2], properties);
     else
-      message.reply(status_codes::Accepted);
+      counts = entity_counter.count_table(paths[1], *table, properties, whole, cuts, workers);
   }
-  else {
-    message.reply(status_codes::BadRequest);
+  catch (const std::exception& e) {
+    log_error() << "Count error: " << e.what();
+    message.reply(status_codes::InternalError);
+    return;
+  }
+
+  value partitions {value::object()};
+  for (const auto& p : counts.partitions) {
+    partitions[p.first] = value::number(static_cast<int64_t> (p.second));
+  }
+  value present {value::object()};
+  for (const auto& p : counts.properties) {
+    present[p.first] = value::number(static_cast<int64_t> (p.second));
   }
+  message.reply(status_codes::OK, value::object(prop_vals_t {
+    make_pair("Entities", value::number(static_cast<int64_t> (counts.entities))),
+    make_pair("Partitions", partitions),
+    make_pair("Properties", present)
+  }));
 }
 
 /*
-  Top-level routine for processing all HTTP PUT requests.
+  UpdateEntityAdmin/TABLE/PARTITION/ROW (PUT)
  */
-void handle_put(http_request message) {
-  string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** PUT " << path << endl;
-  auto paths = uri::split_path(path);
-  
-  if (paths[0] == add_property || paths[0] == update_property) //optional operations that weren't implemented
-  {
-    message.reply(status_codes::NotImplemented); 
+void update_entity_admin (http_request message, const vector<string>& paths) {
+  shared_ptr<TableStore> table {open_table(message, paths[1])};
+  if ( ! table)
     return;
+  table_entity entity {paths[2], paths[3]};
+  log_info() << "Update " << entity.partition_key() << " / " << entity.row_key();
+  table_entity::properties_type& properties = entity.properties();
+  for (const auto v : get_json_body(message)) {
+    properties[v.first] = entity_property {v.second};
   }
 
-  // Need at least an operation, table name, partition, and row
-  if (paths.size() < 4) {
+  /*
+    A conditional update must see the ETag of the entity as it is
+    now, so it is not combined with other writes, and waits for any
+    combined writes to the entity already pending to land first
+   */
+  status_code code {};
+  auto if_match (message.headers().find("If-Match"));
+  if (if_match != message.headers().end()) {
+    entity.set_etag(if_match->second);
+    write_combiner.wait_for(paths[1], paths[2], paths[3]);
+    code = table->merge(entity);
+  }
+  else {
+    code = write_combiner.insert_or_merge(paths[1], *table, entity);
+  }
+  entity_cache->invalidate(paths[1], paths[2], paths[3]);
+  entity_counter.changed(paths[1], paths[2]);
+  if (code == status_codes::OK)
+    property_index.merged(paths[1], entity);
+  message.reply(code);
+}
+
+/*
+  UpdateEntityAuth/TABLE/TOKEN/PARTITION/ROW (PUT)
+ */
+void update_entity_auth (http_request message, const vector<string>& paths) {
+  if ( ! open_table(message, paths[1]))
+    return;
+  string tname, token, partition, row;
+  if ( ! get_token_path(message, tname, token, partition, row)) {
     message.reply(status_codes::BadRequest);
     return;
   }
+  unordered_map<string,string> json_body {get_json_body(message)};
+  status_code code {update_with_token(message, tables_endpoint, json_body)};
+  entity_cache->invalidate(tname, partition, row);
+  entity_counter.changed(tname, partition);
+  if (code == status_codes::OK) {
+    table_entity entity {partition, row};
+    for (const auto& v : json_body) {
+      entity.properties()[v.first] = entity_property {v.second};
+    }
+    property_index.merged(tname, entity);
+  }
+  message.reply(code);
+}
 
-  if (paths.size() == 4)
-  {
-    if (paths[0] == update_entity)
-    {
-      table_cache.init(storage_connection_string);
-      cloud_table table {table_cache.lookup_table(paths[1])};
-      if ( ! table.exists()) {
-        message.reply(status_codes::NotFound);
+/*
+  ImportTableAdmin/TABLE (PUT)
+
+  Insert or merge into TABLE every entity of a newline-delimited
+  JSON body, one object per line as ExportTableAdmin writes them.
+  The body is read import_chunk_bytes at a time. Entities are
+  gathered into a batch per partition, which is written once it is
+  full, and at most max_import_batches are written at once, so the
+  memory used is the same however large the body is. A partition's
+  batch is not written until its previous batch has been, so a
+  later line for an entity always overwrites an earlier one.
+
+  Replies OK with the number of entities Imported, the number
+  Failed because storage rejected their batch, and the number of
+  Invalid lines, those that are not JSON objects with string
+  Partition and Row or are longer than max_import_line_bytes.
+  Blank lines are skipped. Replies NotFound if the table does not
+  exist, and UnsupportedMediaType if the body is compressed.
+ */
+void import_table_admin (http_request message, const vector<string>& paths) {
+  const string& table_name = paths[1];
+  shared_ptr<TableStore> table {open_table(message, table_name)};
+  if ( ! table)
+    return;
+  const http_headers& headers {message.headers()};
+  auto coding (headers.find("Content-Encoding"));
+  if (coding != headers.end() && coding->second != "identity") {
+    message.reply(status_codes::UnsupportedMediaType);
+    return;
+  }
+
+  std::atomic<size_t> imported {0};
+  std::atomic<size_t> failed {0};
+  size_t invalid {0};
+  // Batches being written, with their partitions, oldest first
+  std::deque<pair<string,pplx::task<void>>> writing {};
+  // The latest of those for each partition, which its next batch follows
+  unordered_map<string,pplx::task<void>> last_written {};
+  unordered_map<string,batch_group> filling {};
+
+  auto send_batch = [&table, &table_name, &imported, &failed, &writing, &last_written]
+    (const string& partition, batch_group& group) {
+    if (group.writes.empty())
       return;
+    if (writing.size() == max_import_batches) {
+      writing.front().second.wait();
+      auto last = last_written.find(writing.front().first);
+      if (last != last_written.end() && last->second == writing.front().second)
+        last_written.erase(last);
+      writing.pop_front();
+    }
+    auto writes = std::make_shared<vector<batch_write>> (std::move(group.writes));
+    group.writes.clear();
+    group.rows.clear();
+    auto write = [&table, &table_name, &imported, &failed, writes] () {
+      status_code code {table->execute_batch(*writes)};
+      for (const auto& w : *writes) {
+        entity_cache->invalidate(table_name, w.entity.partition_key(), w.entity.row_key());
+        entity_counter.changed(table_name, w.entity.partition_key());
+        if (code == status_codes::OK)
+          property_index.merged(table_name, w.entity);
       }
-      table_entity entity {paths[2], paths[3]};
-      cout << "Update " << entity.partition_key() << " / " << entity.row_key() << endl;
-      table_entity::properties_type& properties = entity.properties();
-      for (const auto v : get_json_body(message)) {
-        properties[v.first] = entity_property {v.second};
+      (code == status_codes::OK ? imported : failed) += writes->size();
+    };
+    auto last = last_written.find(partition);
+    pplx::task<void> task {last == last_written.end()
+                           ? pplx::create_task(write)
+                           : last->second.then([write] (pplx::task<void>) { write(); })};
+    last_written[partition] = task;
+    writing.push_back(make_pair(partition, task));
+  };
+
+  auto add_line = [&filling, &invalid, &send_batch] (string line) {
+    if ( ! line.empty() && line.back() == '\r')
+      line.pop_back();
+    if (line.find_first_not_of(" \t") == string::npos)
+      return;
+    table_entity entity {};
+    try {
+      if ( ! entity_from_json(value::parse(line), false, entity)) {
+        ++invalid;
+        return;
       }
+    }
+    catch (const web::json::json_exception&) {
+      ++invalid;
+      return;
+    }
 
-      table_operation operation {table_operation::insert_or_merge_entity(entity)};
-      table_result op_result {table.execute(operation)};
-
-      message.reply(status_codes::OK);
+    batch_group& group = filling[entity.partition_key()];
+    // A transaction may not name the same entity twice
+    if (group.rows.count(entity.row_key()) > 0)
+      send_batch(entity.partition_key(), group);
+    group.rows.insert(entity.row_key());
+    group.writes.push_back(batch_write {false, entity});
+    if (group.writes.size() == TableStore::max_batch_size) {
+      send_batch(entity.partition_key(), group);
+      filling.erase(entity.partition_key());
     }
-    else 
-    {
-      message.reply(status_codes::BadRequest);
+    else if (filling.size() > max_import_partitions) {
+      // Too many partitions open at once; send what they have
+      for (auto& g : filling) {
+        send_batch(g.first, g.second);
+      }
+      filling.clear();
+    }
+  };
+
+  bool complete {true};
+  try {
+    concurrency::streams::istream body {message.body()};
+    string pending {};
+    bool skipping {false}; // Dropping the rest of an overlong line
+    for (;;) {
+      concurrency::streams::container_buffer<string> chunk {};
+      if (body.read(chunk, import_chunk_bytes).get() == 0)
+        break;
+      pending += chunk.collection();
+      string::size_type start {0};
+      for (string::size_type end; (end = pending.find('\n', start)) != string::npos; start = end + 1) {
+        if (skipping)
+          skipping = false;
+        else if (end - start > max_import_line_bytes)
+          ++invalid;
+        else
+          add_line(pending.substr(start, end - start));
+      }
+      pending.erase(0, start);
+      if (pending.size() > max_import_line_bytes) {
+        if ( ! skipping)
+          ++invalid;
+        skipping = true;
+        pending.clear();
+      }
     }
+    if ( ! skipping)
+      add_line(pending);
   }
-
-  cloud_table table = table_cache.lookup_table(paths[1]);
-  if ( ! table.exists()) {
-    message.reply(status_codes::NotFound);
-    return;
+  catch (const std::exception& e) {
+    log_error() << "Import body error: " << e.what();
+    complete = false;
   }
-
-  if (paths[0] == update_auth) {
-    message.reply(update_with_token(message, tables_endpoint, get_json_body(message)));
-    return;
+  for (auto& g : filling) {
+    send_batch(g.first, g.second);
   }
-  else if (paths[0] == read_auth) {
-    message.reply(status_codes::Forbidden);
-    return;
+  for (auto& t : writing) {
+    t.second.wait();
   }
-  else {
-    message.reply(status_codes::NotFound);
+
+  log_info() << "Imported " << imported << " entities into " << table_name
+             << ", " << failed << " failed, " << invalid << " invalid";
+  if ( ! complete) {
+    message.reply(status_codes::BadRequest);
     return;
   }
+  message.reply(status_codes::OK, value::object(prop_vals_t {
+    make_pair("Imported", value::number(static_cast<int64_t> (imported.load()))),
+    make_pair("Failed", value::number(static_cast<int64_t> (failed.load()))),
+    make_pair("Invalid", value::number(static_cast<int64_t> (invalid)))
+  }));
 }
 
 /*
-  Top-level routine for processing all HTTP DELETE requests.
+  DeleteTableAdmin/TABLE (DELETE)
  */
-void handle_delete(http_request message) {
-  string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** DELETE " << path << endl;
-  auto paths = uri::split_path(path);
-  // Need at least an operation and table name
-  if (paths.size() < 2) {
-	message.reply(status_codes::BadRequest);
-	return;
+void delete_table_admin (http_request message, const vector<string>& paths) {
+  const string& table_name = paths[1];
+  shared_ptr<TableStore> table {table_cache.lookup_table(table_name)};
+  log_info() << "Delete " << table_name;
+  bool deleted {table->delete_table()};
+  table_cache.table_deleted(table_name);
+  if ( ! deleted) {
+    message.reply(status_codes::NotFound);
+    return;
   }
+  entity_cache->invalidate_table(table_name);
+  entity_counter.drop_table(table_name);
+  property_index.drop_table(table_name);
+  partition_sampler.drop_table(table_name);
+  message.reply(status_codes::OK);
+}
 
-  string table_name {paths[1]};
-  cloud_table table {table_cache.lookup_table(table_name)};
+/*
+  DeleteEntityAdmin/TABLE/PARTITION/ROW (DELETE)
+ */
+void delete_entity_admin (http_request message, const vector<string>& paths) {
+  const string& table_name = paths[1];
+  shared_ptr<TableStore> table {table_cache.lookup_table(table_name)};
+  log_info() << "Delete " << paths[2] << " / " << paths[3];
+  status_code code {table->remove(paths[2], paths[3])};
+  entity_cache->invalidate(table_name, paths[2], paths[3]);
+  entity_counter.changed(table_name, paths[2]);
+  if (code == status_codes::OK)
+    property_index.removed(table_name, paths[2], paths[3]);
+  message.reply(code);
+}
 
-  // Delete table
-  if (paths[0] == delete_table) {
-    cout << "Delete " << table_name << endl;
-    if ( ! table.exists()) {
-      message.reply(status_codes::NotFound);
-    }
-    table.delete_table();
-    table_cache.delete_entry(table_name);
+/*
+  DeleteIndexAdmin/TABLE/PROPERTY (DELETE)
+ */
+void delete_index_admin (http_request message, const vector<string>& paths) {
+  if (property_index.drop(paths[1], paths[2]))
     message.reply(status_codes::OK);
-  }
-  // Delete entity
-  else if (paths[0] == delete_entity) {
-    // For delete entity, also need partition and row
-    if (paths.size() < 4) {
-	message.reply(status_codes::BadRequest);
-	return;
-    }
-    table_entity entity {paths[2], paths[3]};
-    cout << "Delete " << entity.partition_key() << " / " << entity.row_key()<< endl;
+  else
+    message.reply(status_codes::NotFound);
+}
 
-    table_operation operation {table_operation::delete_entity(entity)};
-    table_result op_result {table.execute(operation)};
+/*
+  The operations of this server and the path lengths they take
 
-    int code {op_result.http_status_code()};
-    if (code == status_codes::OK || 
-	code == status_codes::NoContent)
-      message.reply(status_codes::OK);
-    else
-      message.reply(code);
-  }
-  else {
-    message.reply(status_codes::BadRequest);
-  }
+  Requests that match no route get BadRequest, except that a PUT
+  with a token's five or more segments gets NotFound, and the two
+  optional operations from Assignment 1 get NotImplemented.
+ */
+Router router {};
+
+void add_routes () {
+  router.add(methods::GET, metrics_op, 1, &reply_metrics);
+  router.unlimited(methods::GET, metrics_op);
+  router.add(methods::GET, cache_stats, 1,
+             [] (http_request message, const vector<string>&) { reply_cache_stats(message); });
+  router.add(methods::GET, query_index, 4, Router::any_arity, &handle_index_query);
+  router.add(methods::GET, read_entity, 2, &read_table);
+  router.add(methods::GET, read_entity, 4, &read_entity_admin);
+  router.add(methods::GET, export_table, 2, &export_table_admin);
+  router.add(methods::GET, count_entities, 2, 3, &count_entities_admin);
+  router.add(methods::GET, read_auth, 5, Router::any_arity, &read_entity_auth);
+
+  router.add(methods::POST, create_table, 2, Router::any_arity, &create_table_admin);
+  router.add(methods::POST, create_index, 3, &create_index_admin);
+
+  auto not_implemented = [] (http_request message, const vector<string>&) {
+    message.reply(status_codes::NotImplemented);
+  };
+  router.add(methods::PUT, add_property, 0, Router::any_arity, not_implemented);
+  router.add(methods::PUT, update_property, 0, Router::any_arity, not_implemented);
+  router.add(methods::PUT, batch_update, 2,
+             [] (http_request message, const vector<string>& paths) {
+               handle_batch(message, paths[1], false);
+             });
+  router.add(methods::PUT, update_entity, 4, &update_entity_admin);
+  router.add(methods::PUT, import_table, 2, &import_table_admin);
+  router.add(methods::PUT, update_auth, 5, Router::any_arity, &update_entity_auth);
+  // A token can only read
+  router.add(methods::PUT, read_auth, 5, Router::any_arity,
+             [] (http_request message, const vector<string>& paths) {
+               if (open_table(message, paths[1]))
+                 message.reply(status_codes::Forbidden);
+             });
+  router.fallback(methods::PUT, [] (http_request message, const vector<string>& paths) {
+    message.reply(paths.size() >= 5 ? status_codes::NotFound : status_codes::BadRequest);
+  });
+
+  router.add(methods::DEL, batch_delete, 2, Router::any_arity,
+             [] (http_request message, const vector<string>& paths) {
+               handle_batch(message, paths[1], true);
+             });
+  router.add(methods::DEL, delete_table, 2, Router::any_arity, &delete_table_admin);
+  router.add(methods::DEL, delete_entity, 4, Router::any_arity, &delete_entity_admin);
+  router.add(methods::DEL, delete_index, 3, &delete_index_admin);
 }
 
 /*
@@ -556,26 +1471,50 @@ void handle_delete(http_request message) {
 
   Install handlers for the HTTP requests and open the listener,
   which processes each request asynchronously.
-  
-  Wait for a carriage return, then shut the server down.
+
+  Options set the address, port, threads, drain timeout, write
+  combining window, and the size, TTL and snapshot of the entity
+  cache; see ServerConfig.h. The optional first
+  positional argument is a connection string to use instead of
+  storage_connection_string; see TableCache::init(). The optional
+  second is the size in bytes above which JSON bodies are
+  compressed.
+
+  Serve until told to stop, then drain and shut the server down.
  */
 int main (int argc, char const * argv[]) {
-  cout << "Parsing connection string" << endl;
-  table_cache.init (storage_connection_string);
-
-  cout << "Opening listener" << endl;
-  http_listener listener {def_url};
-  listener.support(methods::GET, &handle_get);
-  listener.support(methods::POST, &handle_post);
-  listener.support(methods::PUT, &handle_put);
-  listener.support(methods::DEL, &handle_delete);
-  listener.open().wait(); // Wait for listener to complete starting
-
-  cout << "Enter carriage return to stop server." << endl;
-  string line;
-  getline(std::cin, line);
-
-  // Shut it down
-  listener.close().wait();
-  cout << "Closed" << endl;
+  ServerConfig config {};
+  if ( ! parse_server_config(argc, argv, def_port, config))
+    return 1;
+  const vector<string>& args = config.arguments;
+
+  // A connection string on the command line overrides azure_keys.h
+  string connection {args.size() > 0 ? args[0] : storage_connection_string};
+  log_info() << "Parsing connection string";
+  table_cache.init (connection);
+  write_combiner.set_window(config.write_combine_window);
+  entity_cache = std::make_unique<EntityCache> (config.cache_ttl, config.cache_bytes > 0
+                                                ? config.cache_bytes : entity_cache_bytes);
+  if (args.size() > 1) {
+    try {
+      compress_threshold = std::stoul(args[1]);
+    }
+    catch (const std::exception&) {
+      log_error() << "Bad compression threshold: " << args[1];
+      return 1;
+    }
+  }
+
+  // Start warm from the last run's snapshot, and keep one for the next
+  unique_ptr<CacheSnapshotter> snapshotter {};
+  if ( ! config.snapshot.empty())
+    snapshotter = std::make_unique<CacheSnapshotter> (*entity_cache, config.snapshot,
+                                                      config.snapshot_interval,
+                                                      [] (const string& table_name, const string& partition,
+                                                          const string& row, table_entity& entity) {
+                                                        return table_cache.retrieve(table_name, partition, row, entity);
+                                                      });
+
+  add_routes();
+  serve(config, router, "BasicServer");
 }
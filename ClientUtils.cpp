@@ -18,6 +18,9 @@
 
 #include <pplx/pplxtasks.h>
 
+#include "Compress.h"
+#include "Metrics.h"
+
 using std::make_pair;
 using std::pair;
 using std::string;
@@ -30,12 +33,81 @@ using web::http::http_response;
 using web::http::method;
 using web::http::status_code;
 using web::http::status_codes;
+using web::http::uri;
 
 using web::http::client::http_client;
 
 using web::json::object;
 using web::json::value;
 
+namespace {
+  /*
+    Decompress a JSON body sent with a Content-Encoding and parse it
+
+    A body that cannot be decompressed or parsed yields value::object (),
+    as a response with no JSON body does.
+   */
+  value decode_json_body (const vector<unsigned char>& bytes, const string& coding) {
+    string json {};
+    if ( ! decompress_body(string (bytes.begin(), bytes.end()), coding, json))
+      return value::object ();
+    try {
+      return value::parse(json);
+    }
+    catch (const web::json::json_exception&) {
+      return value::object ();
+    }
+  }
+
+  // Build and send the request, waiting for its response
+  pair<status_code,value> send_request (const method& http_method, const string& uri_string, const value& req_body,
+                                        const vector<pair<string,string>>& req_headers,
+                                        http_headers& resp_headers) {
+    http_request request {http_method};
+    // Large responses may come back compressed; see decode_json_body()
+    request.headers().add("Accept-Encoding", "gzip, deflate");
+    for (const auto& h : req_headers) {
+      request.headers().add(h.first, h.second);
+    }
+    if (req_body != value {}) {
+      http_headers& headers (request.headers());
+      headers.add("Content-Type", "application/json");
+      request.set_body(req_body);
+    }
+
+    status_code code;
+    value resp_body;
+    http_client client {uri_string};
+    client.request (request)
+      .then([&code, &resp_headers](http_response response)
+            {
+              code = response.status_code();
+              resp_headers = response.headers();
+              const http_headers& headers {response.headers()};
+              auto content_type (headers.find("Content-Type"));
+              if (content_type == headers.end() ||
+                  content_type->second != "application/json")
+                return pplx::task<value> ([] { return value::object ();});
+              auto content_encoding (headers.find("Content-Encoding"));
+              if (content_encoding == headers.end())
+                return response.extract_json();
+              string coding {content_encoding->second};
+              return response.extract_vector()
+                .then([coding](const vector<unsigned char>& bytes)
+                      {
+                        return decode_json_body(bytes, coding);
+                      });
+            })
+      .then([&resp_body](value v) -> void
+            {
+              resp_body = v;
+              return;
+            })
+      .wait();
+    return make_pair(code, resp_body);
+  }
+}
+
 /*
   Make an HTTP request, returning the status code and any JSON value in the body
 
@@ -45,9 +117,20 @@ using web::json::value;
 
   If the response has a body with Content-Type: application/json,
   the second part of the result is the json::value of the body.
+  The request accepts gzip and deflate, and a compressed body is
+  decompressed before it is parsed.
   If the response does not have that Content-Type, the second part
   of the result is simply json::value {}.
 
+  The fullest version also takes headers to add to the request, such
+  as If-Match, and sets resp_headers to the headers of the response,
+  such as ETag.
+
+  A server shedding load replies ServiceUnavailable with Retry-After.
+  That is returned at once, never retried here: a server calling
+  do_request() from a handler would otherwise wait while holding
+  its own admission slot. See reply_unavailable().
+
   If the URI denotes an address/port combination that cannot be
   located (say because the server is not running or the port 
   number is incorrect), the routine throws a web::uri_exception().
@@ -67,37 +150,34 @@ using web::json::value;
   attending to its internals, if you prefer.
  */
 
+// Version that adds request headers and returns the response headers
+pair<status_code,value> do_request (const method& http_method, const string& uri_string, const value& req_body,
+                                    const vector<pair<string,string>>& req_headers,
+                                    http_headers& resp_headers) {
+  // Timed by the operation called, the first segment of the path
+  const vector<string> target {uri::split_path(uri {uri_string}.path())};
+  ScopedTimer timer {server_metrics().dependency("downstream", target.empty() ? string {} : target[0])};
+
+  return send_request(http_method, uri_string, req_body, req_headers, resp_headers);
+}
+
+/*
+  Reply to message with the ServiceUnavailable a downstream server
+  gave, passing on its Retry-After, so that the client backs off
+  rather than the server waiting in its handler
+ */
+void reply_unavailable (http_request message, const http_headers& downstream) {
+  http_response response {status_codes::ServiceUnavailable};
+  auto retry_after (downstream.find("Retry-After"));
+  if (retry_after != downstream.end())
+    response.headers().add("Retry-After", retry_after->second);
+  message.reply(response);
+}
+
 // Version with explicit third argument
 pair<status_code,value> do_request (const method& http_method, const string& uri_string, const value& req_body) {
-  http_request request {http_method};
-  if (req_body != value {}) {
-    http_headers& headers (request.headers());
-    headers.add("Content-Type", "application/json");
-    request.set_body(req_body);
-  }
-
-  status_code code;
-  value resp_body;
-  http_client client {uri_string};
-  client.request (request)
-    .then([&code](http_response response)
-          {
-            code = response.status_code();
-            const http_headers& headers {response.headers()};
-            auto content_type (headers.find("Content-Type"));
-            if (content_type == headers.end() ||
-                content_type->second != "application/json")
-              return pplx::task<value> ([] { return value::object ();});
-            else
-              return response.extract_json();
-          })
-    .then([&resp_body](value v) -> void
-          {
-            resp_body = v;
-            return;
-          })
-    .wait();
-  return make_pair(code, resp_body);
+  http_headers resp_headers {};
+  return do_request (http_method, uri_string, req_body, vector<pair<string,string>> {}, resp_headers);
 }
 
 // Version that defaults third argument
@@ -24,6 +24,14 @@ do_request (const web::http::method& http_method, const std::string& uri_string,
 req_res_t
 do_request (const web::http::method& http_method, const std::string& uri_string);
 
+req_res_t
+do_request (const web::http::method& http_method, const std::string& uri_string, const web::json::value& req_body,
+            const std::vector<std::pair<std::string,std::string>>& req_headers,
+            web::http::http_headers& resp_headers);
+
+void
+reply_unavailable (web::http::http_request message, const web::http::http_headers& downstream);
+
 web::json::value
 build_json_value (const std::vector<std::pair<std::string,std::string>>& props);
 
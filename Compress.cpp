@@ -0,0 +1,169 @@
+/*
+ HTTP body compression, CMPT 276, Spring 2016.
+ */
+
+#include "Compress.h"
+
+#include <cctype>
+#include <cstddef>
+#include <cstdlib>
+#include <string>
+
+#include <zlib.h>
+
+using std::string;
+
+const string gzip_coding {"gzip"};
+const string deflate_coding {"deflate"};
+
+namespace {
+  // zlib window bits: 15 for the zlib format, +16 for gzip, +32 to detect either
+  constexpr int zlib_window {15};
+  constexpr int gzip_window {15 + 16};
+  constexpr int detect_window {15 + 32};
+  constexpr int memory_level {8};
+  constexpr size_t chunk_size {16 * 1024};
+
+  int window_bits (const string& coding) {
+    return coding == gzip_coding ? gzip_window : zlib_window;
+  }
+
+  string trim_lower (const string& s) {
+    string::size_type b {s.find_first_not_of(" \t")};
+    if (b == string::npos)
+      return string {};
+    string::size_type e {s.find_last_not_of(" \t")};
+    string t {s.substr(b, e - b + 1)};
+    for (auto& c : t) {
+      c = static_cast<char> (std::tolower(static_cast<unsigned char> (c)));
+    }
+    return t;
+  }
+}
+
+string choose_coding (const string& accept_encoding) {
+  double gzip_q {0};
+  double deflate_q {0};
+  double any_q {0};
+  bool gzip_named {false};
+  bool deflate_named {false};
+  string::size_type start {0};
+  while (start < accept_encoding.size()) {
+    string::size_type comma {accept_encoding.find(',', start)};
+    if (comma == string::npos)
+      comma = accept_encoding.size();
+    string item {accept_encoding.substr(start, comma - start)};
+    start = comma + 1;
+
+    double q {1};
+    string::size_type semi {item.find(';')};
+    string name {trim_lower(item.substr(0, semi))};
+    if (semi != string::npos) {
+      string param {trim_lower(item.substr(semi + 1))};
+      if (param.compare(0, 2, "q=") == 0)
+        q = std::atof(param.c_str() + 2);
+    }
+    if (name == gzip_coding || name == "x-gzip") {
+      gzip_q = q;
+      gzip_named = true;
+    }
+    else if (name == deflate_coding) {
+      deflate_q = q;
+      deflate_named = true;
+    }
+    else if (name == "*") {
+      any_q = q;
+    }
+  }
+  // "*" covers the codings not named
+  if ( ! gzip_named)
+    gzip_q = any_q;
+  if ( ! deflate_named)
+    deflate_q = any_q;
+
+  if (gzip_q > 0 && gzip_q >= deflate_q)
+    return gzip_coding;
+  if (deflate_q > 0)
+    return deflate_coding;
+  return string {};
+}
+
+bool compress_body (const string& data, const string& coding, string& out, int level) {
+  z_stream zs {};
+  if (deflateInit2(&zs, level, Z_DEFLATED, window_bits(coding), memory_level,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+    return false;
+  out.resize(deflateBound(&zs, static_cast<uLong> (data.size())));
+  zs.next_in = reinterpret_cast<Bytef*> (const_cast<char*> (data.data()));
+  zs.avail_in = static_cast<uInt> (data.size());
+  zs.next_out = reinterpret_cast<Bytef*> (&out[0]);
+  zs.avail_out = static_cast<uInt> (out.size());
+  int rc {deflate(&zs, Z_FINISH)};
+  out.resize(zs.total_out);
+  deflateEnd(&zs);
+  return rc == Z_STREAM_END;
+}
+
+bool decompress_body (const string& data, const string& coding, string& out) {
+  if (coding != gzip_coding && coding != deflate_coding)
+    return false;
+  z_stream zs {};
+  if (inflateInit2(&zs, detect_window) != Z_OK)
+    return false;
+  zs.next_in = reinterpret_cast<Bytef*> (const_cast<char*> (data.data()));
+  zs.avail_in = static_cast<uInt> (data.size());
+  out.clear();
+  char buf[chunk_size];
+  int rc {Z_OK};
+  while (rc == Z_OK) {
+    zs.next_out = reinterpret_cast<Bytef*> (buf);
+    zs.avail_out = sizeof buf;
+    rc = inflate(&zs, Z_NO_FLUSH);
+    out.append(buf, sizeof buf - zs.avail_out);
+    if (rc == Z_BUF_ERROR && zs.avail_in == 0)
+      break; // Truncated input
+  }
+  inflateEnd(&zs);
+  return rc == Z_STREAM_END;
+}
+
+BodyCompressor::BodyCompressor (const string& coding, int level) :
+  zs {},
+  ok {false}
+{
+  ok = deflateInit2(&zs, level, Z_DEFLATED, window_bits(coding), memory_level,
+                    Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+BodyCompressor::~BodyCompressor () {
+  if (ok)
+    deflateEnd(&zs);
+}
+
+string BodyCompressor::run (const string& data, int flush) {
+  string out {};
+  if ( ! ok)
+    return out;
+  zs.next_in = reinterpret_cast<Bytef*> (const_cast<char*> (data.data()));
+  zs.avail_in = static_cast<uInt> (data.size());
+  char buf[chunk_size];
+  do {
+    zs.next_out = reinterpret_cast<Bytef*> (buf);
+    zs.avail_out = sizeof buf;
+    deflate(&zs, flush);
+    out.append(buf, sizeof buf - zs.avail_out);
+  } while (zs.avail_out == 0);
+  return out;
+}
+
+string BodyCompressor::write (const string& data) {
+  return run(data, Z_NO_FLUSH);
+}
+
+string BodyCompressor::flush () {
+  return run(string {}, Z_SYNC_FLUSH);
+}
+
+string BodyCompressor::finish () {
+  return run(string {}, Z_FINISH);
+}
@@ -0,0 +1,67 @@
+#ifndef Compress_h
+#define Compress_h
+
+#include <string>
+
+#include <zlib.h>
+
+/*
+  HTTP content codings, using zlib
+
+  "gzip" is the gzip format and "deflate" the zlib format, as
+  HTTP defines them (RFC 7230 4.2).
+ */
+extern const std::string gzip_coding;
+extern const std::string deflate_coding;
+
+/*
+  Choose a coding from an Accept-Encoding header value
+
+  Returns gzip_coding or deflate_coding, preferring the one with the
+  higher q-value and gzip on a tie, or the empty string if the
+  header accepts neither.
+ */
+std::string choose_coding (const std::string& accept_encoding);
+
+/*
+  Compress data with coding, which must be gzip_coding or
+  deflate_coding. Returns false if zlib fails.
+ */
+bool compress_body (const std::string& data, const std::string& coding, std::string& out,
+                    int level = Z_DEFAULT_COMPRESSION);
+
+/*
+  Decompress a body sent with coding. Returns false if coding is
+  not one of ours or the data is corrupt.
+ */
+bool decompress_body (const std::string& data, const std::string& coding, std::string& out);
+
+/*
+  Incremental compression, for bodies sent as they are produced
+
+  write() returns whatever compressed bytes zlib has ready, which
+  may be none. flush() returns the rest of what has been written,
+  so the client can decode all of it; flushing often costs some
+  compression. finish() returns the remainder and the format's
+  trailer.
+ */
+class BodyCompressor {
+private:
+  z_stream zs;
+  bool ok;
+
+  std::string run (const std::string& data, int flush);
+
+public:
+  explicit BodyCompressor (const std::string& coding, int level = Z_DEFAULT_COMPRESSION);
+  ~BodyCompressor ();
+
+  BodyCompressor (const BodyCompressor&) = delete;
+  BodyCompressor& operator= (const BodyCompressor&) = delete;
+
+  std::string write (const std::string& data);
+  std::string flush ();
+  std::string finish ();
+};
+
+#endif
@@ -0,0 +1,338 @@
+/*
+ Entity cache, CMPT 276, Spring 2016.
+ */
+
+#include "EntityCache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <was/table.h>
+
+#include "Logger.h"
+#include "Snapshot.h"
+
+using azure::storage::table_entity;
+
+using pplx::extensibility::scoped_critical_section_t;
+
+using std::shared_ptr;
+using std::size_t;
+using std::string;
+using std::vector;
+
+using web::http::status_code;
+using web::http::status_codes;
+
+namespace {
+  // Rough per-entry cost of the list node, map node and bookkeeping
+  constexpr size_t entry_overhead {160};
+  constexpr size_t property_overhead {48};
+
+  size_t entry_bytes (const string& key, const table_entity& entity,
+                      const vector<string>& tokens) {
+    size_t bytes {entry_overhead + key.size() + entity.etag().size()};
+    for (const auto& p : entity.properties()) {
+      bytes += property_overhead + p.first.size() + p.second.str().size();
+    }
+    for (const auto& t : tokens) {
+      bytes += t.size();
+    }
+    return bytes;
+  }
+
+  // The table, partition and row of a key made by make_key()
+  void split_key (const string& key, string& table, string& partition, string& row) {
+    const size_t first {key.find('\0')};
+    const size_t second {key.find('\0', first + 1)};
+    table = key.substr(0, first);
+    partition = key.substr(first + 1, second - first - 1);
+    row = key.substr(second + 1);
+  }
+}
+
+EntityCache::EntityCache (clock_t::duration time_to_live, size_t max_bytes, size_t shard_count) :
+  ttl {time_to_live},
+  shard_budget {max_bytes / std::max<size_t> (shard_count, 1)},
+  shards {},
+  snapshot {},
+  hits {0},
+  snapshot_hits {0},
+  misses {0},
+  evictions {0},
+  invalidations {0}
+{
+  for (size_t i {0}; i < std::max<size_t> (shard_count, 1); ++i) {
+    shards.emplace_back(new shard_t {});
+  }
+}
+
+string EntityCache::make_key (const string& table, const string& partition, const string& row) {
+  string key {table};
+  key += '\0';
+  key += partition;
+  key += '\0';
+  key += row;
+  return key;
+}
+
+EntityCache::shard_t& EntityCache::shard_for (const string& key) {
+  return *shards[std::hash<string> {} (key) % shards.size()];
+}
+
+/*
+  Caller must hold shard.lock
+ */
+void EntityCache::erase (shard_t& shard, lru_t::iterator it) {
+  shard.bytes -= it->bytes;
+  shard.map.erase(it->key);
+  shard.lru.erase(it);
+}
+
+bool EntityCache::find (const string& key, const string* token,
+                        table_entity& entity, uint64_t& ticket) {
+  shard_t& shard (shard_for(key));
+  scoped_critical_section_t lock {shard.lock};
+  ticket = shard.version;
+
+  auto found = shard.map.find(key);
+  if (found != shard.map.end() && clock_t::now() >= found->second->expires) {
+    erase(shard, found->second);
+    found = shard.map.end();
+  }
+  if (found == shard.map.end()) {
+    if (token == nullptr && from_snapshot(shard, key, entity)) {
+      ++hits;
+      ++snapshot_hits;
+      return true;
+    }
+    ++misses;
+    return false;
+  }
+  lru_t::iterator it {found->second};
+  if (token != nullptr &&
+      std::find(it->tokens.begin(), it->tokens.end(), *token) == it->tokens.end()) {
+    ++misses;
+    return false;
+  }
+  shard.lru.splice(shard.lru.begin(), shard.lru, it);
+  entity = it->entity;
+  ++hits;
+  return true;
+}
+
+bool EntityCache::lookup (const string& table, const string& partition, const string& row,
+                          table_entity& entity, uint64_t& ticket) {
+  return find(make_key(table, partition, row), nullptr, entity, ticket);
+}
+
+bool EntityCache::lookup (const string& table, const string& partition, const string& row,
+                          const string& token, table_entity& entity, uint64_t& ticket) {
+  return find(make_key(table, partition, row), &token, entity, ticket);
+}
+
+void EntityCache::insert (const string& table, const string& partition, const string& row,
+                          const table_entity& entity, uint64_t ticket) {
+  fill(make_key(table, partition, row), nullptr, entity, ticket);
+}
+
+void EntityCache::insert (const string& table, const string& partition, const string& row,
+                          const string& token, const table_entity& entity, uint64_t ticket) {
+  fill(make_key(table, partition, row), &token, entity, ticket);
+}
+
+void EntityCache::fill (const string& key, const string* token,
+                        const table_entity& entity, uint64_t ticket) {
+  shard_t& shard (shard_for(key));
+  scoped_critical_section_t lock {shard.lock};
+  if (shard.version != ticket)
+    return; // Invalidated while this entity was being read
+
+  // The fill renews the TTL, so earlier tokens are not carried over
+  auto found = shard.map.find(key);
+  if (found != shard.map.end())
+    erase(shard, found->second);
+  vector<string> tokens {};
+  if (token != nullptr)
+    tokens.push_back(*token);
+  store(shard, key, std::move(tokens), entity);
+}
+
+/*
+  Add entity as the most recently used entry, evicting as needed;
+  any entry for key must already have been erased. The cache's
+  copy is now newer than any snapshot's.
+
+  Caller must hold shard.lock
+ */
+void EntityCache::store (shard_t& shard, const string& key, vector<string> tokens,
+                         const table_entity& entity) {
+  if (std::atomic_load(&snapshot))
+    shard.shadowed.insert(key);
+
+  size_t bytes {entry_bytes(key, entity, tokens)};
+  if (bytes > shard_budget)
+    return;
+
+  shard.lru.push_front(entry_t {key, entity, std::move(tokens), clock_t::now() + ttl, bytes});
+  shard.map[key] = shard.lru.begin();
+  shard.bytes += bytes;
+
+  while (shard.bytes > shard_budget) {
+    erase(shard, std::prev(shard.lru.end()));
+    ++evictions;
+  }
+}
+
+/*
+  Whether the snapshot's copy of key is out of date
+
+  Caller must hold shard.lock
+ */
+bool EntityCache::shadowed (shard_t& shard, const string& key) {
+  return shard.shadowed.count(key) > 0 ||
+    shard.shadowed_tables.count(key.substr(0, key.find('\0'))) > 0;
+}
+
+/*
+  Answer a miss from the snapshot, if there is one and its copy
+  is current, moving the entity into the cache
+
+  Caller must hold shard.lock
+ */
+bool EntityCache::from_snapshot (shard_t& shard, const string& key, table_entity& entity) {
+  shared_ptr<const EntitySnapshot> s {std::atomic_load(&snapshot)};
+  if ( ! s || shadowed(shard, key) || ! s->find(key, entity))
+    return false;
+  store(shard, key, vector<string> {}, entity);
+  return true;
+}
+
+void EntityCache::invalidate (const string& table, const string& partition, const string& row) {
+  const string key {make_key(table, partition, row)};
+  shard_t& shard (shard_for(key));
+  scoped_critical_section_t lock {shard.lock};
+  ++shard.version;
+  ++invalidations;
+  if (std::atomic_load(&snapshot))
+    shard.shadowed.insert(key);
+  auto found = shard.map.find(key);
+  if (found != shard.map.end())
+    erase(shard, found->second);
+}
+
+void EntityCache::invalidate_table (const string& table) {
+  string prefix {table};
+  prefix += '\0';
+  for (auto& s : shards) {
+    scoped_critical_section_t lock {s->lock};
+    ++s->version;
+    if (std::atomic_load(&snapshot))
+      s->shadowed_tables.insert(table);
+    for (auto it = s->lru.begin(); it != s->lru.end();) {
+      auto next = std::next(it);
+      if (it->key.compare(0, prefix.size(), prefix) == 0)
+        erase(*s, it);
+      it = next;
+    }
+  }
+  ++invalidations;
+}
+
+EntityCache::stats_t EntityCache::stats () {
+  stats_t result {hits.load(), snapshot_hits.load(), misses.load(), evictions.load(), invalidations.load(), 0, 0};
+  for (auto& s : shards) {
+    scoped_critical_section_t lock {s->lock};
+    result.entries += s->map.size();
+    result.bytes += s->bytes;
+  }
+  return result;
+}
+
+bool EntityCache::write_snapshot (const string& path) {
+  vector<EntitySnapshot::entry_t> entries {};
+  const clock_t::time_point now {clock_t::now()};
+  for (auto& s : shards) {
+    scoped_critical_section_t lock {s->lock};
+    for (const auto& e : s->lru) {
+      if (now < e.expires)
+        entries.emplace_back(e.key, e.entity);
+    }
+  }
+  const size_t count {entries.size()};
+  if ( ! EntitySnapshot::write(path, std::move(entries)))
+    return false;
+  log_info() << "Wrote " << count << " cached entities to " << path;
+  return true;
+}
+
+bool EntityCache::load_snapshot (const string& path, std::chrono::system_clock::duration max_age) {
+  shared_ptr<const EntitySnapshot> s {EntitySnapshot::open(path)};
+  if ( ! s)
+    return false;
+  if (std::chrono::system_clock::now() - s->written() > max_age) {
+    log_info() << "Snapshot " << path << " is too old to use";
+    return false;
+  }
+  std::atomic_store(&snapshot, s);
+  log_info() << "Serving " << s->size() << " entities from " << path << " until revalidated";
+  return true;
+}
+
+bool EntityCache::revalidate_snapshot (const reader_t& read, const std::atomic<bool>& stop) {
+  shared_ptr<const EntitySnapshot> s {std::atomic_load(&snapshot)};
+  if ( ! s)
+    return true;
+
+  for (size_t i {0}; i < s->size(); ++i) {
+    if (stop)
+      return false;
+    const string key {s->key(i)};
+    shard_t& shard (shard_for(key));
+    uint64_t ticket {0};
+    {
+      scoped_critical_section_t lock {shard.lock};
+      if (shadowed(shard, key))
+        continue;
+      ticket = shard.version;
+    }
+
+    string table {}, partition {}, row {};
+    split_key(key, table, partition, row);
+    table_entity entity {};
+    status_code code {status_codes::InternalError};
+    try {
+      code = read(table, partition, row, entity);
+    }
+    catch (const std::exception& e) {
+      log_error() << "Revalidating " << table << "/" << partition << "/" << row << ": " << e.what();
+    }
+
+    scoped_critical_section_t lock {shard.lock};
+    if (code == status_codes::OK && shard.version == ticket && ! shadowed(shard, key)) {
+      auto found = shard.map.find(key);
+      if (found != shard.map.end())
+        erase(shard, found->second);
+      store(shard, key, vector<string> {}, entity);
+    }
+    // Whatever storage said, the snapshot's copy is no longer wanted
+    shard.shadowed.insert(key);
+  }
+
+  std::atomic_store(&snapshot, shared_ptr<const EntitySnapshot> {});
+  for (auto& sh : shards) {
+    scoped_critical_section_t lock {sh->lock};
+    sh->shadowed.clear();
+    sh->shadowed_tables.clear();
+  }
+  log_info() << "Revalidated " << s->size() << " snapshot entities";
+  return true;
+}
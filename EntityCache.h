@@ -0,0 +1,170 @@
+#ifndef EntityCache_h
+#define EntityCache_h
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <cpprest/http_msg.h>
+
+#include <pplx/pplxtasks.h>
+
+#include <was/table.h>
+
+/*
+  Bounded in-process cache of entities, keyed by (table, partition, row)
+
+  The cache is split into shards, each with its own lock, LRU list
+  and share of the memory budget, so concurrent handlers rarely
+  contend. Entries expire ttl after they were filled.
+
+  Entities read with a SAS token are only returned to a later
+  request bearing a token that has read that entity from storage
+  since the entry was last filled; entities read by admin
+  operations need no token. Each fill starts the list of tokens
+  afresh, so a token storage has stopped accepting cannot keep
+  reading an entry whose TTL another read renewed.
+
+  Filling races with invalidation: a read that started before a
+  write must not put the old entity back after the write has
+  invalidated it. lookup() therefore returns a ticket, and insert()
+  drops the entity if its shard was invalidated since the ticket
+  was issued.
+
+  A snapshot of the cache written by an earlier run (see
+  Snapshot.h) can stand behind it while the cache warms up: an
+  admin lookup that misses is answered from the snapshot, unless
+  this run has since written, invalidated or read that entity,
+  when the snapshot's copy is out of date. revalidate_snapshot()
+  re-reads every entity in the snapshot from storage into the
+  cache and then lets the snapshot go. Lookups with a token never
+  use the snapshot, as it does not record which tokens may read
+  an entity.
+ */
+class EntitySnapshot;
+
+class EntityCache {
+public:
+  using clock_t = std::chrono::steady_clock;
+
+  // Read an entity from storage, for revalidate_snapshot()
+  using reader_t = std::function<web::http::status_code (const std::string& table,
+                                                         const std::string& partition,
+                                                         const std::string& row,
+                                                         azure::storage::table_entity& entity)>;
+
+  struct stats_t {
+    uint64_t hits;
+    uint64_t snapshot_hits; // Included in hits
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+    std::size_t entries;
+    std::size_t bytes;
+  };
+
+private:
+  struct entry_t {
+    std::string key;
+    azure::storage::table_entity entity;
+    std::vector<std::string> tokens;
+    clock_t::time_point expires;
+    std::size_t bytes;
+  };
+
+  using lru_t = std::list<entry_t>;
+
+  struct shard_t {
+    pplx::extensibility::critical_section_t lock;
+    lru_t lru; // Most recently used first
+    std::unordered_map<std::string,lru_t::iterator> map;
+    std::size_t bytes;
+    uint64_t version;
+    // Keys and tables whose snapshot entities are out of date
+    std::unordered_set<std::string> shadowed;
+    std::unordered_set<std::string> shadowed_tables;
+  };
+
+  const clock_t::duration ttl;
+  const std::size_t shard_budget;
+  std::vector<std::unique_ptr<shard_t>> shards;
+  std::shared_ptr<const EntitySnapshot> snapshot; // Only through std::atomic_load/atomic_store
+
+  std::atomic<uint64_t> hits;
+  std::atomic<uint64_t> snapshot_hits;
+  std::atomic<uint64_t> misses;
+  std::atomic<uint64_t> evictions;
+  std::atomic<uint64_t> invalidations;
+
+  static std::string make_key (const std::string& table, const std::string& partition,
+                               const std::string& row);
+  shard_t& shard_for (const std::string& key);
+  bool find (const std::string& key, const std::string* token,
+             azure::storage::table_entity& entity, uint64_t& ticket);
+  void fill (const std::string& key, const std::string* token,
+             const azure::storage::table_entity& entity, uint64_t ticket);
+  void erase (shard_t& shard, lru_t::iterator it);
+  void store (shard_t& shard, const std::string& key, std::vector<std::string> tokens,
+              const azure::storage::table_entity& entity);
+  bool shadowed (shard_t& shard, const std::string& key);
+  bool from_snapshot (shard_t& shard, const std::string& key, azure::storage::table_entity& entity);
+
+public:
+  EntityCache (clock_t::duration time_to_live, std::size_t max_bytes, std::size_t shard_count = 16);
+
+  EntityCache (const EntityCache&) = delete;
+  EntityCache& operator= (const EntityCache&) = delete;
+
+  /*
+    Look up an entity for an admin read, or for a read with token
+
+    Returns true and sets entity on a hit. Either way, sets ticket
+    for a subsequent insert().
+   */
+  bool lookup (const std::string& table, const std::string& partition, const std::string& row,
+               azure::storage::table_entity& entity, uint64_t& ticket);
+  bool lookup (const std::string& table, const std::string& partition, const std::string& row,
+               const std::string& token,
+               azure::storage::table_entity& entity, uint64_t& ticket);
+
+  /*
+    Fill the cache with an entity just read from storage, and
+    for the second form, record that only token may read it
+   */
+  void insert (const std::string& table, const std::string& partition, const std::string& row,
+               const azure::storage::table_entity& entity, uint64_t ticket);
+  void insert (const std::string& table, const std::string& partition, const std::string& row,
+               const std::string& token,
+               const azure::storage::table_entity& entity, uint64_t ticket);
+
+  void invalidate (const std::string& table, const std::string& partition, const std::string& row);
+  void invalidate_table (const std::string& table);
+
+  stats_t stats ();
+
+  /*
+    Write the entities in the cache to a snapshot at path, or
+    stand the snapshot at path behind the cache if it was written
+    no longer than max_age ago. Both return false, having logged
+    why, if they fail.
+   */
+  bool write_snapshot (const std::string& path);
+  bool load_snapshot (const std::string& path, std::chrono::system_clock::duration max_age);
+
+  /*
+    Re-read each entity in the snapshot that may still be answered
+    from it, using read, then drop the snapshot. Returns false,
+    keeping the snapshot, if stop became true first.
+   */
+  bool revalidate_snapshot (const reader_t& read, const std::atomic<bool>& stop);
+};
+
+#endif
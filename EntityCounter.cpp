@@ -0,0 +1,174 @@
+/*
+ Entity counts, CMPT 276, Spring 2016.
+ */
+
+#include "EntityCounter.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <pplx/pplxtasks.h>
+
+#include <was/table.h>
+
+#include "ParallelScan.h"
+#include "TableStore.h"
+
+using azure::storage::table_entity;
+
+using pplx::extensibility::scoped_critical_section_t;
+
+using std::size_t;
+using std::string;
+using std::vector;
+
+constexpr std::chrono::minutes EntityCounter::max_age;
+
+namespace {
+  /*
+    The columns to read for counting properties: just those, or
+    if none, only the keys
+   */
+  vector<string> count_columns (const vector<string>& properties) {
+    return properties.empty() ? vector<string> {"PartitionKey"} : properties;
+  }
+
+  string join_names (const vector<string>& names) {
+    string joined {};
+    for (const auto& n : names) {
+      if ( ! joined.empty())
+        joined += ',';
+      joined += n;
+    }
+    return joined;
+  }
+}
+
+void EntityCounter::add (const table_entity& entity, const vector<string>& properties,
+                         partitions_t& partitions) {
+  partition_t& p = partitions[entity.partition_key()];
+  ++p.entities;
+  for (const auto& name : properties) {
+    // A selected property an entity lacks may come back null
+    auto found = entity.properties().find(name);
+    if (found != entity.properties().end() && ! found->second.is_null())
+      ++p.properties[name];
+  }
+}
+
+EntityCounter::counts_t EntityCounter::total (const partitions_t& partitions,
+                                              const vector<string>& properties) {
+  counts_t counts {0, {}, {}};
+  for (const auto& name : properties) {
+    counts.properties[name] = 0;
+  }
+  for (const auto& p : partitions) {
+    counts.entities += p.second.entities;
+    counts.partitions[p.first] = p.second.entities;
+    for (const auto& prop : p.second.properties) {
+      counts.properties[prop.first] += prop.second;
+    }
+  }
+  return counts;
+}
+
+EntityCounter::counts_t EntityCounter::count_table (const string& table, TableStore& store,
+                                                    const vector<string>& requested, bool recount,
+                                                    const vector<string>& cuts, size_t workers) {
+  vector<string> properties {requested};
+  std::sort(properties.begin(), properties.end());
+  properties.erase(std::unique(properties.begin(), properties.end()), properties.end());
+  const string counted_key {join_names(properties)};
+  const vector<string> columns {count_columns(properties)};
+
+  const clock_t::time_point started {clock_t::now()};
+  bool whole {false};
+  std::set<string> dirty {};
+  {
+    scoped_critical_section_t l {lock};
+    tally_t& t = tallies[table][counted_key];
+    whole = recount || ! t.counted || started - t.counted_at > max_age;
+    // Writes from now on are counted next time
+    if (whole)
+      t.dirty.clear();
+    else
+      dirty.swap(t.dirty);
+  }
+
+  partitions_t fresh {};
+  auto visit = [&properties, &fresh] (const table_entity& e) { add(e, properties, fresh); };
+  try {
+    if (whole) {
+      parallel_query(store, cuts, columns, workers, visit);
+    }
+    else {
+      for (const auto& p : dirty) {
+        store.query(table_range {p, 0, string {}, columns}, visit);
+      }
+    }
+  }
+  catch (...) {
+    if ( ! whole) {
+      scoped_critical_section_t l {lock};
+      auto found = tallies.find(table);
+      if (found != tallies.end())
+        found->second[counted_key].dirty.insert(dirty.begin(), dirty.end());
+    }
+    throw;
+  }
+
+  scoped_critical_section_t l {lock};
+  auto found = tallies.find(table);
+  if (found == tallies.end()) {
+    // Deleted while being counted; keep nothing
+    return total(fresh, properties);
+  }
+  tally_t& t = found->second[counted_key];
+  if (whole) {
+    t.partitions = std::move(fresh);
+    t.counted = true;
+    t.counted_at = started;
+  }
+  else {
+    for (const auto& p : dirty) {
+      auto counted = fresh.find(p);
+      if (counted == fresh.end())
+        t.partitions.erase(p);
+      else
+        t.partitions[p] = counted->second;
+    }
+  }
+  return total(t.partitions, properties);
+}
+
+EntityCounter::counts_t EntityCounter::count_partition (TableStore& store, const string& partition,
+                                                        const vector<string>& requested) {
+  vector<string> properties {requested};
+  std::sort(properties.begin(), properties.end());
+  properties.erase(std::unique(properties.begin(), properties.end()), properties.end());
+
+  partitions_t counted {};
+  store.query(table_range {partition, 0, string {}, count_columns(properties)},
+              [&properties, &counted] (const table_entity& e) { add(e, properties, counted); });
+  return total(counted, properties);
+}
+
+void EntityCounter::changed (const string& table, const string& partition) {
+  scoped_critical_section_t l {lock};
+  auto found = tallies.find(table);
+  if (found == tallies.end())
+    return;
+  for (auto& t : found->second) {
+    t.second.dirty.insert(partition);
+  }
+}
+
+void EntityCounter::drop_table (const string& table) {
+  scoped_critical_section_t l {lock};
+  tallies.erase(table);
+}
@@ -0,0 +1,101 @@
+#ifndef EntityCounter_h
+#define EntityCounter_h
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <pplx/pplxtasks.h>
+
+#include <was/table.h>
+
+#include "TableStore.h"
+
+/*
+  Counts of the entities in tables, by partition and by which
+  properties they have
+
+  Counting reads only keys, plus the properties whose presence is
+  counted, never whole entities. A table's counts are kept once
+  made: this server's writes mark the partitions they touch, and
+  the next count re-reads only those partitions. Writes made
+  directly to storage by other clients are not seen, so the whole
+  table is recounted once its counts are max_age old.
+
+  Counts are kept separately for each set of properties counted,
+  which is expected to be one or two sets per table, such as a
+  dashboard polls for.
+ */
+class EntityCounter {
+public:
+  using clock_t = std::chrono::steady_clock;
+
+  static constexpr std::chrono::minutes max_age {5};
+
+  struct counts_t {
+    uint64_t entities;
+    std::map<std::string,uint64_t> partitions; // Entities in each partition
+    std::map<std::string,uint64_t> properties; // Entities having each property
+  };
+
+private:
+  struct partition_t {
+    uint64_t entities;
+    std::map<std::string,uint64_t> properties;
+  };
+
+  using partitions_t = std::map<std::string,partition_t>;
+
+  struct tally_t {
+    bool counted; // False until the first count of the whole table finishes
+    clock_t::time_point counted_at;
+    partitions_t partitions;
+    std::set<std::string> dirty; // Partitions written since they were counted
+  };
+
+  // Table to properties counted, comma separated, to the counts
+  std::unordered_map<std::string,std::map<std::string,tally_t>> tallies;
+  pplx::extensibility::critical_section_t lock;
+
+  static void add (const azure::storage::table_entity& entity,
+                   const std::vector<std::string>& properties, partitions_t& partitions);
+  static counts_t total (const partitions_t& partitions, const std::vector<std::string>& properties);
+
+public:
+  EntityCounter () :
+    tallies {},
+    lock {}
+    {};
+
+  EntityCounter (const EntityCounter&) = delete;
+  EntityCounter& operator= (const EntityCounter&) = delete;
+
+  /*
+    Count the entities of table, which is in store, and how many
+    have each of properties, recounting it all if recount is true
+    or its counts are too old. A recount of the whole table reads
+    the ranges between cuts, workers at a time; see
+    parallel_query().
+
+    Throws std::exception if reading store fails.
+   */
+  counts_t count_table (const std::string& table, TableStore& store,
+                        const std::vector<std::string>& properties, bool recount,
+                        const std::vector<std::string>& cuts, std::size_t workers);
+
+  // Count one partition, always from store
+  counts_t count_partition (TableStore& store, const std::string& partition,
+                            const std::vector<std::string>& properties);
+
+  // This server has written to partition of table
+  void changed (const std::string& table, const std::string& partition);
+  // Forget the counts of a table that has been deleted
+  void drop_table (const std::string& table);
+};
+
+#endif
@@ -0,0 +1,162 @@
+/*
+ Entity JSON serialization, CMPT 276, Spring 2016.
+ */
+
+#include "EntityJson.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <was/table.h>
+
+using azure::storage::edm_type;
+using azure::storage::entity_property;
+using azure::storage::table_entity;
+
+using std::string;
+using std::vector;
+
+namespace {
+  const string partition_name {"Partition"};
+  const string row_name {"Row"};
+
+  /*
+    A member of the output object: its name, and either a property
+    or a key string (for Partition and Row)
+   */
+  struct member_t {
+    const string* name;
+    const entity_property* property;
+    const string* key;
+  };
+
+  void append_int (string& out, int64_t n) {
+    char digits[24];
+    int len {std::snprintf(digits, sizeof digits, "%lld", static_cast<long long> (n))};
+    out.append(digits, static_cast<string::size_type> (len));
+  }
+
+  /*
+    Doubles are written with enough digits to read back exactly,
+    as web::json::value does
+   */
+  void append_double (string& out, double d) {
+    if ( ! std::isfinite(d)) {
+      out += "null";
+      return;
+    }
+    char digits[32];
+    int len {std::snprintf(digits, sizeof digits, "%.17g", d)};
+    out.append(digits, static_cast<string::size_type> (len));
+  }
+
+  void append_property (string& out, const entity_property& p) {
+    switch (p.property_type()) {
+    case edm_type::string:
+      append_json_string(out, p.string_value());
+      break;
+    case edm_type::int32:
+      append_int(out, p.int32_value());
+      break;
+    case edm_type::int64:
+      append_int(out, p.int64_value());
+      break;
+    case edm_type::double_floating_point:
+      append_double(out, p.double_value());
+      break;
+    case edm_type::boolean:
+      out += p.boolean_value() ? "true" : "false";
+      break;
+    default:
+      // Dates, GUIDs and binary are returned as their string form
+      append_json_string(out, p.str());
+      break;
+    }
+  }
+}
+
+void append_json_string (string& out, const string& s) {
+  static const char hex[] {"0123456789ABCDEF"};
+  out.push_back('"');
+  string::size_type run {0}; // Start of characters not yet copied
+  for (string::size_type i {0}; i < s.size(); ++i) {
+    unsigned char c {static_cast<unsigned char> (s[i])};
+    if (c >= 0x20 && c != '"' && c != '\\')
+      continue;
+    out.append(s, run, i - run);
+    run = i + 1;
+    out.push_back('\\');
+    switch (c) {
+    case '"': out.push_back('"'); break;
+    case '\\': out.push_back('\\'); break;
+    case '\b': out.push_back('b'); break;
+    case '\f': out.push_back('f'); break;
+    case '\n': out.push_back('n'); break;
+    case '\r': out.push_back('r'); break;
+    case '\t': out.push_back('t'); break;
+    default:
+      out += "u00";
+      out.push_back(hex[c >> 4]);
+      out.push_back(hex[c & 0xf]);
+      break;
+    }
+  }
+  out.append(s, run, string::npos);
+  out.push_back('"');
+}
+
+void append_entity_json (string& out, const table_entity& entity, bool with_keys) {
+  // Reused so that sorting the members does not allocate
+  thread_local vector<member_t> members {};
+  members.clear();
+  if (with_keys) {
+    members.push_back(member_t {&partition_name, nullptr, &entity.partition_key()});
+    members.push_back(member_t {&row_name, nullptr, &entity.row_key()});
+  }
+  for (const auto& p : entity.properties()) {
+    members.push_back(member_t {&p.first, &p.second, nullptr});
+  }
+  std::sort(members.begin(), members.end(),
+            [] (const member_t& a, const member_t& b) { return *a.name < *b.name; });
+
+  out.push_back('{');
+  bool first {true};
+  for (const auto& m : members) {
+    if ( ! first)
+      out.push_back(',');
+    first = false;
+    append_json_string(out, *m.name);
+    out.push_back(':');
+    if (m.property)
+      append_property(out, *m.property);
+    else
+      append_json_string(out, *m.key);
+  }
+  out.push_back('}');
+}
+
+namespace {
+  string& thread_json_buffer () {
+    thread_local string buffer {};
+    return buffer;
+  }
+}
+
+constexpr std::size_t ScopedJsonBuffer::max_kept_bytes;
+
+ScopedJsonBuffer::ScopedJsonBuffer () :
+  buffer (thread_json_buffer())
+{
+  buffer.clear();
+}
+
+ScopedJsonBuffer::~ScopedJsonBuffer () {
+  if (buffer.capacity() > max_kept_bytes)
+    string {}.swap(buffer);
+}
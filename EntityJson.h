@@ -0,0 +1,54 @@
+#ifndef EntityJson_h
+#define EntityJson_h
+
+#include <cstddef>
+#include <string>
+
+#include <was/table.h>
+
+/*
+  Table entities written straight to JSON text
+
+  This produces the same text as converting an entity to a
+  web::json::value object and serializing it, property by property
+  and with keys in the same (sorted) order, but without building
+  the value tree. Strings are escaped as the JSON grammar requires.
+
+  Output is appended to out, so a caller can reuse one buffer for
+  a whole response, or across responses via ScopedJsonBuffer.
+ */
+void append_json_string (std::string& out, const std::string& s);
+
+/*
+  with_keys adds the entity's "Partition" and "Row", as table and
+  partition reads return them
+ */
+void append_entity_json (std::string& out, const azure::storage::table_entity& entity,
+                         bool with_keys);
+
+/*
+  The calling thread's JSON buffer, empty, while this is in scope
+
+  Its capacity is kept from one use to the next, so once it has
+  grown to fit a typical response no further allocation is needed.
+  A buffer grown past max_kept_bytes by an unusually large response
+  is freed when the scope ends, rather than held by an idle thread.
+  Do not nest two on one thread; both would be the same buffer.
+ */
+class ScopedJsonBuffer {
+private:
+  std::string& buffer;
+
+public:
+  static constexpr std::size_t max_kept_bytes {1024 * 1024};
+
+  ScopedJsonBuffer ();
+  ~ScopedJsonBuffer ();
+
+  ScopedJsonBuffer (const ScopedJsonBuffer&) = delete;
+  ScopedJsonBuffer& operator= (const ScopedJsonBuffer&) = delete;
+
+  std::string& text () { return buffer; }
+};
+
+#endif
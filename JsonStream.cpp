@@ -0,0 +1,220 @@
+/*
+ Chunked JSON response bodies, CMPT 276, Spring 2016.
+ */
+
+#include "JsonStream.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <ios>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+#include <cpprest/http_listener.h>
+#include <cpprest/json.h>
+#include <cpprest/producerconsumerstream.h>
+
+#include "Logger.h"
+
+using std::size_t;
+using std::string;
+
+constexpr std::size_t ChunkedBody::high_water;
+constexpr std::size_t ChunkedBody::flush_bytes;
+constexpr std::chrono::seconds ChunkedBody::stall_timeout;
+
+using web::http::http_request;
+using web::http::http_response;
+using web::http::status_code;
+
+using web::json::value;
+
+class ChunkedBody::Buffer : public concurrency::streams::details::basic_producer_consumer_buffer<uint8_t> {
+private:
+  std::mutex lock;
+  std::condition_variable read;
+
+  // Taking the lock orders this after a waiter's check of in_avail()
+  void notify () {
+    {
+      std::lock_guard<std::mutex> l {lock};
+    }
+    read.notify_all();
+  }
+
+protected:
+  pplx::task<size_t> _getn (uint8_t* ptr, size_t count) override {
+    return basic_producer_consumer_buffer::_getn(ptr, count).then([this] (size_t n) {
+        notify();
+        return n;
+      });
+  }
+
+  size_t _sgetn (uint8_t* ptr, size_t count) override {
+    const size_t n {basic_producer_consumer_buffer::_sgetn(ptr, count)};
+    notify();
+    return n;
+  }
+
+public:
+  Buffer () :
+    basic_producer_consumer_buffer {512},
+    lock {},
+    read {}
+  {}
+
+  void release (uint8_t* ptr, size_t count) override {
+    basic_producer_consumer_buffer::release(ptr, count);
+    notify();
+  }
+
+  // Wait until fewer than waiting bytes are unread, or until deadline; return those unread
+  size_t wait_for_read (size_t waiting, std::chrono::steady_clock::time_point deadline) {
+    std::unique_lock<std::mutex> l {lock};
+    read.wait_until(l, deadline, [this, waiting] () { return in_avail() < waiting; });
+    return in_avail();
+  }
+};
+
+ChunkedBody::ChunkedBody (http_request message, status_code code,
+                          const string& content_type, const string& coding) :
+  reads {std::make_shared<Buffer> ()},
+  buf {reads},
+  closed {false},
+  stalled {false},
+  compressor {},
+  unflushed {0}
+{
+  http_response response {code};
+  response.set_body(buf.create_istream(), content_type);
+  response.headers().add("Vary", "Accept-Encoding");
+  if ( ! coding.empty()) {
+    compressor.reset(new BodyCompressor {coding});
+    response.headers().add("Content-Encoding", coding);
+  }
+  message.reply(response);
+}
+
+ChunkedBody::~ChunkedBody () {
+  close();
+}
+
+/*
+  Append bytes to the body
+
+  The buffer copies the bytes before the returned task completes,
+  so waiting on it makes the nocopy call safe for a local string.
+  If the client has fallen behind, wait for it to drain before
+  adding more, which bounds the memory held per response, but
+  give up once it has read nothing for stall_timeout. The buffer
+  wakes us on each read, so there is no polling.
+ */
+void ChunkedBody::send(const string& bytes) {
+  if (bytes.empty())
+    return;
+  std::size_t waiting {buf.in_avail()};
+  auto deadline = std::chrono::steady_clock::now() + stall_timeout;
+  while (waiting > high_water) {
+    std::size_t now_waiting {reads->wait_for_read(waiting, deadline)};
+    if (now_waiting < waiting)
+      deadline = std::chrono::steady_clock::now() + stall_timeout;
+    else if (std::chrono::steady_clock::now() > deadline) {
+      stalled = true;
+      closed = true;
+      buf.close(std::ios_base::out).wait();
+      throw std::runtime_error("Client stopped reading the response body");
+    }
+    waiting = now_waiting;
+  }
+  buf.putn_nocopy(reinterpret_cast<const uint8_t*>(bytes.data()), bytes.size()).wait();
+}
+
+/*
+  Append text to the body, compressing it if required
+ */
+void ChunkedBody::put(const string& s) {
+  if (stalled)
+    throw std::runtime_error("Client stopped reading the response body");
+  if (closed)
+    return;
+  if ( ! compressor) {
+    send(s);
+    return;
+  }
+  string out {compressor->write(s)};
+  unflushed += s.size();
+  if (unflushed >= flush_bytes) {
+    out += compressor->flush();
+    unflushed = 0;
+  }
+  send(out);
+}
+
+/*
+  End the body. The status has already gone out, so a failure here
+  cannot be reported to the client except by cutting the body
+  short; log it rather than throw from a destructor.
+ */
+void ChunkedBody::close() {
+  if (closed)
+    return;
+  closed = true;
+  try {
+    if (compressor)
+      send(compressor->finish());
+    if ( ! stalled)
+      buf.close(std::ios_base::out).wait();
+  }
+  catch (const std::exception& e) {
+    log_error() << "Could not finish response body: " << e.what();
+  }
+}
+
+JsonArrayStream::JsonArrayStream (http_request message, status_code code, const string& coding) :
+  body {message, code, "application/json", coding},
+  first {true}
+{
+  body.put("[");
+}
+
+JsonArrayStream::~JsonArrayStream () {
+  close();
+}
+
+void JsonArrayStream::write(const value& v) {
+  string s {first ? "" : ","};
+  s += v.serialize();
+  first = false;
+  body.put(s);
+}
+
+void JsonArrayStream::write_json(const string& element) {
+  if ( ! first)
+    body.put(",");
+  first = false;
+  body.put(element);
+}
+
+void JsonArrayStream::close() {
+  if (body.is_closed())
+    return;
+  body.put("]");
+  body.close();
+}
+
+NdjsonStream::NdjsonStream (http_request message, status_code code, const string& coding) :
+  body {message, code, "application/x-ndjson", coding}
+{}
+
+void NdjsonStream::write_json(const string& line) {
+  body.put(line);
+  body.put("\n");
+}
+
+void NdjsonStream::close() {
+  body.close();
+}
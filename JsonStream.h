@@ -0,0 +1,111 @@
+#ifndef JsonStream_h
+#define JsonStream_h
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <cpprest/http_listener.h>
+#include <cpprest/json.h>
+#include <cpprest/producerconsumerstream.h>
+
+#include "Compress.h"
+
+/*
+  A chunked HTTP response body written a piece at a time.
+
+  The constructor replies to the message immediately with the
+  given status code and a body that has no Content-Length, so the
+  listener sends it with chunked transfer encoding.  Each call to
+  put() appends text, blocking while the client is more than
+  high_water bytes behind.  close() ends the body; the destructor
+  calls it if the caller did not.
+
+  A client that stops reading, or has gone, would block put()
+  forever, so if the client reads nothing for stall_timeout, put()
+  ends the body and throws std::runtime_error, which stops the
+  scan feeding it. Every later put() throws too. close() never
+  throws, as the reply has already started; it logs instead.
+
+  If coding is gzip_coding or deflate_coding, the body is compressed
+  as it is written and sent with that Content-Encoding. The
+  compressor is flushed every flush_bytes of text, so a slow scan
+  still reaches the client steadily.
+ */
+class ChunkedBody {
+private:
+  // A producer_consumer_buffer that wakes put() each time the client reads
+  class Buffer;
+
+  std::shared_ptr<Buffer> reads;
+  concurrency::streams::streambuf<uint8_t> buf;
+  bool closed;
+  bool stalled;
+  std::unique_ptr<BodyCompressor> compressor;
+  std::size_t unflushed;
+
+  void send(const std::string& bytes);
+
+public:
+  static constexpr std::size_t high_water {256 * 1024};
+  static constexpr std::size_t flush_bytes {64 * 1024};
+  static constexpr std::chrono::seconds stall_timeout {30};
+
+  ChunkedBody (web::http::http_request message, web::http::status_code code,
+               const std::string& content_type, const std::string& coding);
+  ~ChunkedBody ();
+
+  ChunkedBody (const ChunkedBody&) = delete;
+  ChunkedBody& operator= (const ChunkedBody&) = delete;
+
+  bool is_closed() const { return closed; }
+  void put(const std::string& s);
+  void close();
+};
+
+/*
+  A JSON array written to a chunked response body one element at
+  a time. close() writes the closing ']'.
+ */
+class JsonArrayStream {
+private:
+  ChunkedBody body;
+  bool first;
+
+public:
+  JsonArrayStream (web::http::http_request message,
+                   web::http::status_code code = web::http::status_codes::OK,
+                   const std::string& coding = std::string {});
+  ~JsonArrayStream ();
+
+  JsonArrayStream (const JsonArrayStream&) = delete;
+  JsonArrayStream& operator= (const JsonArrayStream&) = delete;
+
+  void write(const web::json::value& v);
+  // Write an element that is already JSON text
+  void write_json(const std::string& element);
+  void close();
+};
+
+/*
+  Newline-delimited JSON (application/x-ndjson) written to a
+  chunked response body: one JSON value per line, with no
+  enclosing array, so a reader can handle each line as it arrives.
+ */
+class NdjsonStream {
+private:
+  ChunkedBody body;
+
+public:
+  NdjsonStream (web::http::http_request message,
+                web::http::status_code code = web::http::status_codes::OK,
+                const std::string& coding = std::string {});
+
+  // Write a line that is already JSON text, without its newline
+  void write_json(const std::string& line);
+  void close();
+};
+
+#endif
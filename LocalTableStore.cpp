@@ -0,0 +1,593 @@
+/*
+ Embedded table storage, CMPT 276, Spring 2016.
+ */
+
+#include "LocalTableStore.h"
+
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <was/table.h>
+
+#include "Logger.h"
+
+using azure::storage::table_entity;
+using azure::storage::table_shared_access_policy;
+
+using pplx::extensibility::scoped_critical_section_t;
+
+using std::string;
+using std::vector;
+
+using web::http::status_code;
+using web::http::status_codes;
+
+/*
+  Log format
+
+  The log starts with the 8 bytes of log_magic and the table's
+  8-byte generation, then holds a sequence of records, each a 4-byte little-endian payload length,
+  the 4-byte CRC-32 of the payload, then the payload:
+
+    op         1 byte: 'M' (merge, creating if absent) or 'D' (delete)
+    partition  string
+    row        string
+    count      4 bytes, number of properties ('M' only)
+    then count times:
+      name     string
+      type     1 byte, see property_type_code()
+      value    string, as property_text() prints it
+
+  where a string is a 4-byte length followed by its bytes.
+
+  A record at the end of the file that runs past it or fails its
+  CRC is a write still in progress, or one torn by a crash or a
+  full disk, and is not applied. Appenders hold an exclusive flock()
+  on the log while they write, so a process holding it knows such
+  a tail is torn and cuts it off before appending. A record that
+  fails its CRC or cannot be parsed anywhere else means the log is
+  damaged: the table is marked failed and refuses every operation
+  rather than serve part of its contents.
+ */
+namespace {
+  const string log_magic {"TLOG0003"};
+  constexpr off_t header_size {16};
+  constexpr off_t record_header_size {8};
+
+  constexpr char merge_op {'M'};
+  constexpr char delete_op {'D'};
+
+  uint32_t crc32 (const char* data, std::size_t n) {
+    static const vector<uint32_t> table = [] () {
+      vector<uint32_t> t (256);
+      for (uint32_t i {0}; i < 256; ++i) {
+        uint32_t c {i};
+        for (int k {0}; k < 8; ++k) {
+          c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+        t[i] = c;
+      }
+      return t;
+    } ();
+    uint32_t c {0xffffffff};
+    for (std::size_t i {0}; i < n; ++i) {
+      c = table[(c ^ static_cast<unsigned char> (data[i])) & 0xff] ^ (c >> 8);
+    }
+    return c ^ 0xffffffff;
+  }
+
+  // Holds the flock() that serializes appenders across processes
+  class log_lock {
+  private:
+    int fd;
+
+  public:
+    explicit log_lock (int log_fd) :
+      fd {log_fd}
+    {
+      while (::flock(fd, LOCK_EX) != 0 && errno == EINTR) {}
+    }
+
+    ~log_lock () {
+      ::flock(fd, LOCK_UN);
+    }
+
+    log_lock (const log_lock&) = delete;
+    log_lock& operator= (const log_lock&) = delete;
+  };
+
+  void put_u32 (string& out, uint32_t n) {
+    for (int i {0}; i < 4; ++i) {
+      out.push_back(static_cast<char> ((n >> (8 * i)) & 0xff));
+    }
+  }
+
+  /*
+    Write the header to a new log, with a new generation, unless
+    another process already has. Returns false if it could not be
+    written.
+   */
+  bool write_header (int fd) {
+    log_lock l {fd};
+    struct stat st;
+    if (::fstat(fd, &st) != 0)
+      return false;
+    if (st.st_size >= header_size)
+      return true;
+    std::random_device random {};
+    string header {log_magic};
+    put_u32(header, random());
+    put_u32(header, random());
+    if (::ftruncate(fd, 0) != 0 ||
+        ::write(fd, header.data(), header.size()) != static_cast<ssize_t> (header.size()))
+      return false;
+    ::fdatasync(fd);
+    return true;
+  }
+
+  void put_str (string& out, const string& s) {
+    put_u32(out, static_cast<uint32_t> (s.size()));
+    out += s;
+  }
+
+  uint32_t get_u32 (const string& in, string::size_type& pos) {
+    if (in.size() - pos < 4)
+      throw std::runtime_error("Truncated table log record");
+    uint32_t n {0};
+    for (int i {0}; i < 4; ++i) {
+      n |= static_cast<uint32_t> (static_cast<unsigned char> (in[pos + i])) << (8 * i);
+    }
+    pos += 4;
+    return n;
+  }
+
+  string get_str (const string& in, string::size_type& pos) {
+    uint32_t len {get_u32(in, pos)};
+    if (in.size() - pos < len)
+      throw std::runtime_error("Truncated table log record");
+    string s {in.substr(pos, len)};
+    pos += len;
+    return s;
+  }
+
+  string merge_record (const table_entity& entity) {
+    string payload {merge_op};
+    put_str(payload, entity.partition_key());
+    put_str(payload, entity.row_key());
+    put_u32(payload, static_cast<uint32_t> (entity.properties().size()));
+    for (const auto& p : entity.properties()) {
+      put_str(payload, p.first);
+      payload.push_back(property_type_code(p.second.property_type()));
+      put_str(payload, property_text(p.second));
+    }
+    return payload;
+  }
+
+  string delete_record (const string& partition, const string& row) {
+    string payload {delete_op};
+    put_str(payload, partition);
+    put_str(payload, row);
+    return payload;
+  }
+}
+
+LocalTableStore::LocalTableStore (const string& log_path) :
+  path {log_path},
+  fd {-1},
+  inode {0},
+  generation {},
+  applied {0},
+  failed {false},
+  index {},
+  lock {}
+{}
+
+LocalTableStore::~LocalTableStore () {
+  if (fd >= 0)
+    ::close(fd);
+}
+
+/*
+  Forget everything: the table does not exist
+ */
+void LocalTableStore::reset () {
+  if (fd >= 0)
+    ::close(fd);
+  fd = -1;
+  inode = 0;
+  generation.clear();
+  applied = 0;
+  failed = false;
+  index.clear();
+}
+
+/*
+  (Re)open the log and prepare to replay it from the start
+
+  Returns false if the log does not exist. A log that is not in
+  this format marks the table failed.
+ */
+bool LocalTableStore::reopen () {
+  reset();
+  fd = ::open(path.c_str(), O_RDWR | O_APPEND);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (::fstat(fd, &st) != 0) {
+    reset();
+    return false;
+  }
+  inode = st.st_ino;
+
+  // A creator that crashed before writing the header leaves it short
+  string header (static_cast<string::size_type> (header_size), '\0');
+  if ( ! write_header(fd) ||
+       ::pread(fd, &header[0], header.size(), 0) != static_cast<ssize_t> (header.size()) ||
+       header.compare(0, log_magic.size(), log_magic) != 0) {
+    log_error() << "Not a table log: " << path;
+    failed = true;
+    return true;
+  }
+  string::size_type pos {log_magic.size()};
+  const uint32_t low {get_u32(header, pos)};
+  const uint32_t high {get_u32(header, pos)};
+  generation = std::to_string((static_cast<uint64_t> (high) << 32) | low);
+  applied = header_size;
+  return true;
+}
+
+/*
+  Apply every record appended since the last call and, if the log
+  has just been opened, cut off a torn tail
+
+  Caller must hold lock.
+ */
+void LocalTableStore::catch_up () {
+  struct stat st;
+  if (::stat(path.c_str(), &st) != 0) {
+    reset();
+    return;
+  }
+  bool reopened {false};
+  if (fd < 0 || st.st_ino != inode || st.st_size < applied) {
+    if ( ! reopen())
+      return;
+    reopened = true;
+  }
+  if ( ! failed && replay() && reopened)
+    cut_torn_tail();
+}
+
+/*
+  Apply every complete, intact record past applied
+
+  Returns true if bytes follow the last record applied that are not
+  yet a complete record: a write in progress, or a torn one. Marks
+  the table failed if a record before the last is damaged.
+
+  Caller must hold lock.
+ */
+bool LocalTableStore::replay () {
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || st.st_size <= applied)
+    return false;
+
+  string buf (static_cast<string::size_type> (st.st_size - applied), '\0');
+  ssize_t n {::pread(fd, &buf[0], buf.size(), applied)};
+  if (n < 0) {
+    log_error() << "Table log read error " << path << ": " << errno;
+    return false;
+  }
+  buf.resize(static_cast<string::size_type> (n));
+
+  string::size_type pos {0};
+  try {
+    while (buf.size() - pos >= static_cast<string::size_type> (record_header_size)) {
+      string::size_type start {pos};
+      string::size_type body {pos};
+      uint32_t len {get_u32(buf, body)};
+      uint32_t crc {get_u32(buf, body)};
+      if (buf.size() - body < len)
+        break;
+      if (crc32(buf.data() + body, len) != crc) {
+        if (body + len == buf.size())
+          break; // The last record may still be being written
+        throw std::runtime_error("Table log record fails its CRC");
+      }
+      apply(buf.substr(body, len), applied + static_cast<off_t> (start));
+      pos = body + len;
+    }
+  }
+  catch (const std::exception& e) {
+    log_error() << "Table log " << path << " is damaged at offset "
+                << applied + static_cast<off_t> (pos) << ": " << e.what();
+    failed = true;
+    return false;
+  }
+  applied += static_cast<off_t> (pos);
+  return pos < buf.size();
+}
+
+/*
+  Truncate the log after the last record applied, once sure that
+  what follows is torn rather than being written
+
+  Caller must hold lock.
+ */
+void LocalTableStore::cut_torn_tail () {
+  log_lock l {fd};
+  // Finish replaying any write that completed while waiting
+  if ( ! replay() || failed)
+    return;
+  log_warning() << "Cutting torn tail off table log " << path << " at offset " << applied;
+  if (::ftruncate(fd, applied) != 0)
+    log_error() << "Table log truncate error " << path << ": " << errno;
+}
+
+/*
+  Apply one record to the index
+
+  Caller must hold lock.
+ */
+void LocalTableStore::apply (const string& record, off_t offset) {
+  string::size_type pos {1};
+  if (record.empty())
+    return;
+  string partition {get_str(record, pos)};
+  string row {get_str(record, pos)};
+  key_t key {partition, row};
+
+  if (record[0] == delete_op) {
+    index.erase(key);
+    return;
+  }
+
+  auto entry = index.find(key);
+  if (entry == index.end())
+    entry = index.emplace(key, table_entity {partition, row}).first;
+  table_entity::properties_type& properties = entry->second.properties();
+  uint32_t count {get_u32(record, pos)};
+  for (uint32_t i {0}; i < count; ++i) {
+    string name {get_str(record, pos)};
+    if (pos >= record.size())
+      throw std::runtime_error("Truncated table log record");
+    char code {record[pos++]};
+    string v {get_str(record, pos)};
+    properties[name] = make_property(code, v);
+  }
+  entry->second.set_etag("W/\"" + generation + "." + std::to_string(offset) + "\"");
+}
+
+/*
+  Append records to the log with a single write, sync them, then
+  replay them into the index
+
+  Returns OK only once the records have been applied. A write that
+  fails part way is truncated away, so it cannot leave a partial
+  record for later appends to land behind.
+
+  Caller must hold lock and must have called catch_up().
+ */
+status_code LocalTableStore::append (const vector<string>& payloads) {
+  if (fd < 0)
+    return status_codes::NotFound;
+  if (failed)
+    return status_codes::InternalError;
+
+  string records {};
+  for (const auto& payload : payloads) {
+    put_u32(records, static_cast<uint32_t> (payload.size()));
+    put_u32(records, crc32(payload.data(), payload.size()));
+    records += payload;
+  }
+
+  off_t end {0};
+  {
+    log_lock l {fd};
+    // No other appender is writing, so anything past the last record is torn
+    if (replay() && ! failed && ::ftruncate(fd, applied) != 0) {
+      log_error() << "Table log truncate error " << path << ": " << errno;
+      return status_codes::InternalError;
+    }
+    if (failed)
+      return status_codes::InternalError;
+
+    const off_t start {applied};
+    ssize_t n {::write(fd, records.data(), records.size())};
+    if (n != static_cast<ssize_t> (records.size())) {
+      log_error() << "Table log write error " << path << ": " << errno;
+      if (n > 0 && ::ftruncate(fd, start) != 0)
+        log_error() << "Table log truncate error " << path << ": " << errno;
+      return status_codes::InternalError;
+    }
+    if (::fdatasync(fd) != 0) {
+      log_error() << "Table log sync error " << path << ": " << errno;
+      if (::ftruncate(fd, start) != 0)
+        log_error() << "Table log truncate error " << path << ": " << errno;
+      return status_codes::InternalError;
+    }
+    end = start + static_cast<off_t> (records.size());
+  }
+  catch_up();
+  if (failed || fd < 0 || applied < end)
+    return status_codes::InternalError;
+  return status_codes::OK;
+}
+
+bool LocalTableStore::exists () {
+  scoped_critical_section_t l {lock};
+  catch_up();
+  return fd >= 0;
+}
+
+bool LocalTableStore::create_if_not_exists () {
+  scoped_critical_section_t l {lock};
+  catch_up();
+  if (fd >= 0)
+    return false;
+  int created {::open(path.c_str(), O_RDWR | O_APPEND | O_CREAT | O_EXCL, 0644)};
+  if (created < 0) {
+    // Another process may have just created it
+    catch_up();
+    return false;
+  }
+  if ( ! write_header(created))
+    log_error() << "Table log header write error " << path << ": " << errno;
+  ::close(created);
+  reopen();
+  return true;
+}
+
+bool LocalTableStore::delete_table () {
+  scoped_critical_section_t l {lock};
+  catch_up();
+  if (fd < 0)
+    return false;
+  ::unlink(path.c_str());
+  reset();
+  return true;
+}
+
+status_code LocalTableStore::retrieve (const string& partition, const string& row,
+                                       table_entity& entity) {
+  scoped_critical_section_t l {lock};
+  catch_up();
+  if (failed)
+    return status_codes::InternalError;
+  auto entry = index.find(key_t {partition, row});
+  if (fd < 0 || entry == index.end())
+    return status_codes::NotFound;
+  entity = entry->second;
+  return status_codes::OK;
+}
+
+status_code LocalTableStore::retrieve (const string& partition, const string& row,
+                                       const vector<string>& columns, table_entity& entity) {
+  status_code code {retrieve(partition, row, entity)};
+  if (code == status_codes::OK)
+    select_properties(entity, columns);
+  return code;
+}
+
+status_code LocalTableStore::insert_or_merge (const table_entity& entity) {
+  scoped_critical_section_t l {lock};
+  catch_up();
+  return append({merge_record(entity)});
+}
+
+status_code LocalTableStore::merge (const table_entity& entity) {
+  scoped_critical_section_t l {lock};
+  catch_up();
+  if (failed)
+    return status_codes::InternalError;
+  auto entry = index.find(key_t {entity.partition_key(), entity.row_key()});
+  if (entry == index.end())
+    return status_codes::NotFound;
+  if ( ! entity.etag().empty() && entity.etag() != "*" &&
+       entity.etag() != entry->second.etag())
+    return status_codes::PreconditionFailed;
+  return append({merge_record(entity)});
+}
+
+status_code LocalTableStore::remove (const string& partition, const string& row) {
+  scoped_critical_section_t l {lock};
+  catch_up();
+  if (failed)
+    return status_codes::InternalError;
+  if (index.find(key_t {partition, row}) == index.end())
+    return status_codes::NotFound;
+  return append({delete_record(partition, row)});
+}
+
+status_code LocalTableStore::execute_batch (const vector<batch_write>& writes) {
+  scoped_critical_section_t l {lock};
+  catch_up();
+  if (failed)
+    return status_codes::InternalError;
+  vector<string> payloads {};
+  payloads.reserve(writes.size());
+  for (const auto& w : writes) {
+    if (w.remove) {
+      if (index.find(key_t {w.entity.partition_key(), w.entity.row_key()}) == index.end())
+        return status_codes::NotFound;
+      payloads.push_back(delete_record(w.entity.partition_key(), w.entity.row_key()));
+    }
+    else {
+      payloads.push_back(merge_record(w.entity));
+    }
+  }
+  return append(payloads);
+}
+
+/*
+  Entities are copied out of the index a page at a time and visited
+  after the lock is released, so a slow visitor (for example, one
+  streaming to a slow client) does not hold up writers.
+
+  The continuation is the key of the next entity to visit.
+ */
+string LocalTableStore::query (const table_range& range, const entity_visitor_t& visit) {
+  key_t from {range.partition.empty() ? range.first_partition : range.partition, string {}};
+  if ( ! range.continuation.empty()) {
+    string k {decode_continuation(range.continuation)};
+    string::size_type sep {k.find('\0')};
+    if (sep == string::npos)
+      throw std::invalid_argument("Malformed continuation");
+    from = key_t {k.substr(0, sep), k.substr(sep + 1)};
+    if ( ! range.partition.empty() && from.first != range.partition)
+      throw std::invalid_argument("Continuation is for a different partition");
+  }
+
+  const int limit {range.take > 0 ? range.take : INT_MAX};
+  int count {0};
+  vector<table_entity> page {};
+  for (;;) {
+    page.clear();
+    bool more {false};
+    key_t next {};
+    {
+      scoped_critical_section_t l {lock};
+      catch_up();
+      if (failed)
+        throw std::runtime_error("Table log is damaged: " + path);
+      for (auto it = index.lower_bound(from);
+           it != index.end() && (range.partition.empty() ? range.end_partition.empty() || it->first.first < range.end_partition
+                                                         : it->first.first == range.partition);
+           ++it) {
+        if (page.size() == page_size || count + static_cast<int> (page.size()) == limit) {
+          more = true;
+          next = it->first;
+          break;
+        }
+        page.push_back(it->second);
+        select_properties(page.back(), range.columns);
+      }
+    }
+    for (const auto& e : page) {
+      visit(e);
+    }
+    count += static_cast<int> (page.size());
+    if ( ! more)
+      return string {};
+    if (count >= limit)
+      return encode_continuation(next.first + '\0' + next.second);
+    from = next;
+  }
+}
+
+string LocalTableStore::shared_access_signature (const table_shared_access_policy& policy,
+                                                 const string& partition,
+                                                 const string& row) {
+  // Tokens are validated by Azure Storage itself; there is no local equivalent
+  return string {};
+}
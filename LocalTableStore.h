@@ -0,0 +1,100 @@
+#ifndef LocalTableStore_h
+#define LocalTableStore_h
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+#include <utility>
+
+#include <sys/types.h>
+
+#include <pplx/pplxtasks.h>
+
+#include <was/table.h>
+
+#include "TableStore.h"
+
+/*
+  A table kept on this machine
+
+  The table is a write-ahead log file, path, together with an
+  in-memory index of its entities sorted by (partition, row). Every
+  write is appended to the log and synced before it is visible;
+  the index is only ever built by replaying the log.
+
+  A batch is appended with a single write, so it is replayed as a
+  whole or not at all. Each record carries a CRC, so a write torn
+  by a crash or a full disk is found and cut off rather than
+  replayed; a log damaged anywhere else marks the table failed, and
+  every operation on it then returns InternalError or throws.
+
+  Several processes may open the same table. Before each operation
+  the store replays whatever other processes have appended since,
+  so a reader such as AuthServer sees BasicServer's writes. A table
+  that is deleted and re-created is detected by its inode changing.
+
+  An entity's ETag is the table's generation, chosen at random
+  when its log is created, and the log offset of its latest write.
+  A re-created table reuses offsets but not the generation, so an
+  ETag read before the table was deleted never matches after.
+
+  The log is never compacted: it grows with every write, deletes
+  included, and a process opening the table replays all of it.
+ */
+class LocalTableStore : public TableStore {
+private:
+  using key_t = std::pair<std::string,std::string>;
+
+  static constexpr std::size_t page_size {1000};
+
+  const std::string path;
+  int fd;
+  ino_t inode;
+  std::string generation; // From the log header, the first part of every ETag
+  off_t applied;
+  bool failed; // The log is damaged
+  std::map<key_t,azure::storage::table_entity> index;
+  pplx::extensibility::critical_section_t lock;
+
+  void reset ();
+  bool reopen ();
+  void catch_up ();
+  bool replay ();
+  void cut_torn_tail ();
+  void apply (const std::string& record, off_t offset);
+  web::http::status_code append (const std::vector<std::string>& payloads);
+
+public:
+  explicit LocalTableStore (const std::string& log_path);
+  ~LocalTableStore ();
+
+  LocalTableStore (const LocalTableStore&) = delete;
+  LocalTableStore& operator= (const LocalTableStore&) = delete;
+
+  bool exists () override;
+  bool create_if_not_exists () override;
+  bool delete_table () override;
+
+  web::http::status_code retrieve (const std::string& partition,
+                                   const std::string& row,
+                                   azure::storage::table_entity& entity) override;
+  web::http::status_code retrieve (const std::string& partition,
+                                   const std::string& row,
+                                   const std::vector<std::string>& columns,
+                                   azure::storage::table_entity& entity) override;
+  web::http::status_code insert_or_merge (const azure::storage::table_entity& entity) override;
+  web::http::status_code merge (const azure::storage::table_entity& entity) override;
+  web::http::status_code remove (const std::string& partition,
+                                 const std::string& row) override;
+
+  web::http::status_code execute_batch (const std::vector<batch_write>& writes) override;
+
+  std::string query (const table_range& range, const entity_visitor_t& visit) override;
+
+  std::string shared_access_signature (const azure::storage::table_shared_access_policy& policy,
+                                       const std::string& partition,
+                                       const std::string& row) override;
+};
+
+#endif
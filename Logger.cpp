@@ -0,0 +1,249 @@
+/*
+ Asynchronous logging, CMPT 276, Spring 2016.
+ */
+
+#include "Logger.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+using std::size_t;
+using std::string;
+
+namespace {
+  constexpr size_t queue_capacity {16384};
+  // The writer wakes this often when no one asks it to flush
+  constexpr std::chrono::milliseconds writer_interval {5};
+
+  std::atomic<int> min_level {static_cast<int> (log_level::info)};
+  std::atomic<unsigned> sample_every {1};
+
+  size_t round_up_power_of_two (size_t n) {
+    size_t p {1};
+    while (p < n)
+      p <<= 1;
+    return p;
+  }
+
+  log_level parse_level (const char* name, log_level fallback) {
+    if (name == nullptr)
+      return fallback;
+    if (std::strcmp(name, "debug") == 0)
+      return log_level::debug;
+    if (std::strcmp(name, "info") == 0)
+      return log_level::info;
+    if (std::strcmp(name, "warning") == 0)
+      return log_level::warning;
+    if (std::strcmp(name, "error") == 0)
+      return log_level::error;
+    if (std::strcmp(name, "off") == 0)
+      return log_level::off;
+    return fallback;
+  }
+
+  // The writer, created on first use
+  LogWriter& log_writer () {
+    static LogWriter writer {queue_capacity};
+    return writer;
+  }
+
+  /*
+    Read LOG_LEVEL and LOG_SAMPLE once, before the first line is
+    logged or the first explicit setting, which overrides them
+   */
+  void configure_from_environment () {
+    static std::once_flag once;
+    std::call_once(once, [] () {
+      min_level.store(static_cast<int> (parse_level(std::getenv("LOG_LEVEL"), log_level::info)));
+      const char* sample {std::getenv("LOG_SAMPLE")};
+      if (sample != nullptr && std::atoi(sample) > 0)
+        sample_every.store(static_cast<unsigned> (std::atoi(sample)));
+    });
+  }
+
+  bool enabled (log_level level) {
+    configure_from_environment();
+    if (static_cast<int> (level) < min_level.load(std::memory_order_relaxed))
+      return false;
+    if (level >= log_level::warning)
+      return true;
+    unsigned every {sample_every.load(std::memory_order_relaxed)};
+    if (every <= 1)
+      return true;
+    thread_local unsigned count {0};
+    return count++ % every == 0;
+  }
+
+  // Each thread formats into its own buffer, reused from line to line
+  thread_local std::ostringstream thread_buffer {};
+  thread_local bool thread_buffer_busy {false};
+}
+
+LogWriter::LogWriter (size_t capacity) :
+  mask {round_up_power_of_two(capacity) - 1},
+  cells {new cell_t[mask + 1]},
+  enqueue_pos {0},
+  dequeue_pos {0},
+  written_pos {0},
+  dropped {0},
+  stopping {false},
+  wake_lock {},
+  wake {},
+  writer {}
+{
+  for (size_t i {0}; i <= mask; ++i) {
+    cells[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  writer = std::thread {[this] () { run(); }};
+}
+
+LogWriter::~LogWriter () {
+  stopping.store(true);
+  {
+    std::lock_guard<std::mutex> l {wake_lock};
+    wake.notify_one();
+  }
+  writer.join();
+}
+
+bool LogWriter::push (const string& line) {
+  size_t pos {enqueue_pos.load(std::memory_order_relaxed)};
+  cell_t* cell {nullptr};
+  for (;;) {
+    cell = &cells[pos & mask];
+    size_t sequence {cell->sequence.load(std::memory_order_acquire)};
+    std::ptrdiff_t diff {static_cast<std::ptrdiff_t> (sequence) - static_cast<std::ptrdiff_t> (pos)};
+    if (diff == 0) {
+      if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        break;
+    }
+    else if (diff < 0) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    else {
+      pos = enqueue_pos.load(std::memory_order_relaxed);
+    }
+  }
+  cell->text.assign(line);
+  cell->sequence.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+bool LogWriter::pop (string& out) {
+  cell_t& cell = cells[dequeue_pos & mask];
+  if (cell.sequence.load(std::memory_order_acquire) != dequeue_pos + 1)
+    return false; // Empty, or the producer has not finished the line
+  out.append(cell.text);
+  out.push_back('\n');
+  cell.sequence.store(dequeue_pos + mask + 1, std::memory_order_release);
+  ++dequeue_pos;
+  return true;
+}
+
+void LogWriter::drain (string& batch) {
+  batch.clear();
+  while (pop(batch)) {
+  }
+  uint64_t lost {dropped.exchange(0, std::memory_order_relaxed)};
+  if (lost > 0)
+    batch += "(" + std::to_string(lost) + " log lines dropped)\n";
+  if ( ! batch.empty()) {
+    std::fwrite(batch.data(), 1, batch.size(), stdout);
+    std::fflush(stdout);
+  }
+  written_pos.store(dequeue_pos, std::memory_order_release);
+}
+
+void LogWriter::run () {
+  string batch {};
+  while ( ! stopping.load()) {
+    drain(batch);
+    std::unique_lock<std::mutex> l {wake_lock};
+    wake.wait_for(l, writer_interval);
+  }
+  drain(batch);
+}
+
+void LogWriter::flush () {
+  size_t target {enqueue_pos.load()};
+  {
+    std::lock_guard<std::mutex> l {wake_lock};
+    wake.notify_one();
+  }
+  while (written_pos.load(std::memory_order_acquire) < target) {
+    std::this_thread::sleep_for(std::chrono::milliseconds {1});
+  }
+}
+
+LogLine::LogLine (bool active) :
+  out {nullptr},
+  owned {false}
+{
+  if ( ! active)
+    return;
+  if (thread_buffer_busy) {
+    // A line logged while formatting another, as in log_info() << f()
+    out = new std::ostringstream {};
+    owned = true;
+  }
+  else {
+    thread_buffer_busy = true;
+    thread_buffer.str(string {});
+    thread_buffer.clear();
+    out = &thread_buffer;
+  }
+}
+
+LogLine::~LogLine () {
+  if ( ! out)
+    return;
+  log_writer().push(out->str());
+  if (owned)
+    delete out;
+  else
+    thread_buffer_busy = false;
+}
+
+LogLine log_debug () {
+  return LogLine {enabled(log_level::debug)};
+}
+
+LogLine log_info () {
+  return LogLine {enabled(log_level::info)};
+}
+
+LogLine log_warning () {
+  LogLine line {enabled(log_level::warning)};
+  line << "Warning: ";
+  return line;
+}
+
+LogLine log_error () {
+  LogLine line {enabled(log_level::error)};
+  line << "Error: ";
+  return line;
+}
+
+void set_log_level (log_level level) {
+  configure_from_environment();
+  min_level.store(static_cast<int> (level));
+}
+
+void set_log_sample (unsigned every) {
+  configure_from_environment();
+  sample_every.store(every == 0 ? 1 : every);
+}
+
+void flush_log () {
+  log_writer().flush();
+}
@@ -0,0 +1,134 @@
+#ifndef Logger_h
+#define Logger_h
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+/*
+  Asynchronous logging shared by the servers
+
+  A handler formats each line into a buffer belonging to its
+  thread and hands the finished line to a background writer
+  through a bounded lock-free queue, so logging never takes a lock
+  or makes a system call on the request path. The writer drains
+  the queue in batches and flushes stdout once per batch rather
+  than once per line.
+
+  If the queue is full the line is dropped, and the writer reports
+  how many were lost once there is room. A slow terminal therefore
+  costs lines rather than request latency.
+
+  Lines below the level set by set_log_level() are discarded
+  before they are formatted. Debug and info lines may also be
+  sampled: with set_log_sample(n), each thread keeps only one in n
+  of them. Warnings and errors are always written.
+
+  The LOG_LEVEL (debug, info, warning, error or off) and
+  LOG_SAMPLE environment variables set the initial level and
+  sampling.
+
+  Usage, as for std::cout but without std::endl:
+
+    log_info() << "**** GET " << path;
+ */
+enum class log_level {debug, info, warning, error, off};
+
+/*
+  The bounded multi-producer, single-consumer queue of lines and
+  the thread that writes them
+
+  The queue is a ring of cells, each with a sequence number that
+  says whether the cell is free for the producer at a given
+  position or filled for the consumer (Vyukov's bounded queue).
+  Producers claim positions with a compare-and-swap; each cell's
+  string keeps its capacity, so once the ring is warm, queueing a
+  line does not allocate.
+ */
+class LogWriter {
+private:
+  struct cell_t {
+    std::atomic<std::size_t> sequence;
+    std::string text;
+  };
+
+  const std::size_t mask;
+  std::unique_ptr<cell_t[]> cells;
+  std::atomic<std::size_t> enqueue_pos;
+  std::size_t dequeue_pos; // Only the writer thread uses this
+  std::atomic<std::size_t> written_pos; // Lines before this have been written
+  std::atomic<uint64_t> dropped;
+
+  std::atomic<bool> stopping;
+  std::mutex wake_lock;
+  std::condition_variable wake;
+  std::thread writer;
+
+  bool pop (std::string& out);
+  void run ();
+  void drain (std::string& batch);
+
+public:
+  // capacity is rounded up to a power of two
+  explicit LogWriter (std::size_t capacity);
+  ~LogWriter ();
+
+  LogWriter (const LogWriter&) = delete;
+  LogWriter& operator= (const LogWriter&) = delete;
+
+  // Queue one line, without its newline; returns false if the queue is full
+  bool push (const std::string& line);
+
+  // Wait until every line queued so far has been written
+  void flush ();
+};
+
+/*
+  One line being formatted, queued when it is destroyed
+
+  An inactive line, one below the level or sampled out, ignores
+  everything written to it.
+ */
+class LogLine {
+private:
+  std::ostringstream* out; // Null if inactive
+  bool owned; // out is not the thread's buffer, which was already in use
+
+public:
+  explicit LogLine (bool active);
+  ~LogLine ();
+
+  LogLine (LogLine&& other) : out {other.out}, owned {other.owned} { other.out = nullptr; }
+  LogLine (const LogLine&) = delete;
+  LogLine& operator= (const LogLine&) = delete;
+
+  template <typename T>
+  LogLine& operator<< (const T& value) {
+    if (out)
+      *out << value;
+    return *this;
+  }
+};
+
+LogLine log_debug ();
+LogLine log_info ();
+LogLine log_warning ();
+LogLine log_error ();
+
+void set_log_level (log_level level);
+// Keep one in every `every` debug and info lines per thread; 1 keeps them all
+void set_log_sample (unsigned every);
+
+/*
+  Write everything logged so far before returning, for messages
+  that must appear before the process waits or exits
+ */
+void flush_log ();
+
+#endif
@@ -0,0 +1,245 @@
+/*
+ Request metrics, CMPT 276, Spring 2016.
+ */
+
+#include "Metrics.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cpprest/http_msg.h>
+
+#include "make_unique.h"
+
+using pplx::extensibility::scoped_critical_section_t;
+
+using std::pair;
+using std::size_t;
+using std::string;
+using std::vector;
+
+using web::http::http_request;
+using web::http::http_response;
+using web::http::status_code;
+using web::http::status_codes;
+
+const string metrics_op {"Metrics"};
+
+namespace {
+  const vector<pair<double,string>> quantiles {
+    {0.5, "0.5"}, {0.99, "0.99"}, {0.999, "0.999"}
+  };
+
+  int highest_bit (uint64_t v) {
+    int bit {0};
+    while (v >>= 1)
+      ++bit;
+    return bit;
+  }
+
+  // Label values are quoted, with '\' and '"' escaped
+  string label (const string& value) {
+    string out {"\""};
+    for (char c : value) {
+      if (c == '\\' || c == '"')
+        out.push_back('\\');
+      if (c == '\n')
+        out += "\\n";
+      else
+        out.push_back(c);
+    }
+    out.push_back('"');
+    return out;
+  }
+
+  string seconds (uint64_t us) {
+    char text[32];
+    std::snprintf(text, sizeof text, "%.6f", static_cast<double> (us) / 1e6);
+    return text;
+  }
+
+  void append_summary (string& out, const string& name, const string& labels, const Histogram& h) {
+    for (const auto& q : quantiles) {
+      out += name + "{" + labels + ",quantile=\"" + q.second + "\"} " + seconds(h.quantile(q.first)) + "\n";
+    }
+    out += name + "_sum{" + labels + "} " + seconds(h.sum()) + "\n";
+    out += name + "_count{" + labels + "} " + std::to_string(h.count()) + "\n";
+  }
+}
+
+Histogram::Histogram () :
+  total {0},
+  sum_us {0}
+{
+  for (auto& b : buckets) {
+    b.store(0, std::memory_order_relaxed);
+  }
+}
+
+size_t Histogram::bucket_of (uint64_t us) {
+  if (us < sub_buckets)
+    return static_cast<size_t> (us);
+  int bit {highest_bit(us)};
+  if (bit >= max_bits)
+    return bucket_count - 1;
+  int shift {bit - sub_bucket_bits};
+  return static_cast<size_t> (sub_buckets + shift * sub_buckets + ((us >> shift) & (sub_buckets - 1)));
+}
+
+/*
+  The middle of a bucket's range, which is within half a bucket of
+  every value counted in it
+ */
+uint64_t Histogram::bucket_value (size_t bucket) {
+  if (bucket < sub_buckets)
+    return bucket;
+  int shift {static_cast<int> ((bucket - sub_buckets) / sub_buckets)};
+  uint64_t sub {(bucket - sub_buckets) % sub_buckets};
+  uint64_t low {(sub_buckets + sub) << shift};
+  return low + ((uint64_t {1} << shift) >> 1);
+}
+
+void Histogram::record (std::chrono::microseconds elapsed) {
+  uint64_t us {elapsed.count() < 0 ? 0 : static_cast<uint64_t> (elapsed.count())};
+  buckets[bucket_of(us)].fetch_add(1, std::memory_order_relaxed);
+  total.fetch_add(1, std::memory_order_relaxed);
+  sum_us.fetch_add(us, std::memory_order_relaxed);
+}
+
+uint64_t Histogram::count () const {
+  return total.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::sum () const {
+  return sum_us.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::quantile (double q) const {
+  /*
+    Buckets are read one at a time while others record, so the
+    total is taken from the buckets themselves
+   */
+  vector<uint64_t> counts (bucket_count);
+  uint64_t n {0};
+  for (size_t i {0}; i < bucket_count; ++i) {
+    counts[i] = buckets[i].load(std::memory_order_relaxed);
+    n += counts[i];
+  }
+  if (n == 0)
+    return 0;
+  uint64_t rank {static_cast<uint64_t> (q * n)};
+  if (rank >= n)
+    rank = n - 1;
+  uint64_t seen {0};
+  for (size_t i {0}; i < bucket_count; ++i) {
+    seen += counts[i];
+    if (seen > rank)
+      return bucket_value(i);
+  }
+  return bucket_value(bucket_count - 1);
+}
+
+OperationMetrics::OperationMetrics () :
+  requests {0},
+  latency {}
+{
+  for (auto& s : statuses) {
+    s.store(0, std::memory_order_relaxed);
+  }
+}
+
+void OperationMetrics::status (status_code code) {
+  if (code < max_status)
+    statuses[code].fetch_add(1, std::memory_order_relaxed);
+}
+
+vector<pair<int,uint64_t>> OperationMetrics::status_counts () const {
+  vector<pair<int,uint64_t>> counts {};
+  for (int code {0}; code < max_status; ++code) {
+    uint64_t n {statuses[code].load(std::memory_order_relaxed)};
+    if (n > 0)
+      counts.push_back(std::make_pair(code, n));
+  }
+  return counts;
+}
+
+OperationMetrics& Metrics::operation (const string& method, const string& name) {
+  scoped_critical_section_t l {lock};
+  std::unique_ptr<OperationMetrics>& m = operations[key_t {method, name}];
+  if ( ! m)
+    m = std::make_unique<OperationMetrics>();
+  return *m;
+}
+
+Histogram& Metrics::dependency (const string& kind, const string& call) {
+  scoped_critical_section_t l {lock};
+  std::unique_ptr<Histogram>& h = dependencies[key_t {kind, call}];
+  if ( ! h)
+    h = std::make_unique<Histogram>();
+  return *h;
+}
+
+string Metrics::prometheus_text () {
+  // Sorted, so that scrapes list the series in the same order
+  std::map<key_t,const OperationMetrics*> ops {};
+  std::map<key_t,const Histogram*> deps {};
+  {
+    scoped_critical_section_t l {lock};
+    for (const auto& o : operations) {
+      ops[o.first] = o.second.get();
+    }
+    for (const auto& d : dependencies) {
+      deps[d.first] = d.second.get();
+    }
+  }
+
+  string out {};
+  out += "# HELP requests_total Requests received, by operation.\n";
+  out += "# TYPE requests_total counter\n";
+  for (const auto& o : ops) {
+    out += "requests_total{method=" + label(o.first.first) + ",operation=" + label(o.first.second)
+      + "} " + std::to_string(o.second->request_count()) + "\n";
+  }
+  out += "# HELP responses_total Responses sent, by operation and status code.\n";
+  out += "# TYPE responses_total counter\n";
+  for (const auto& o : ops) {
+    for (const auto& s : o.second->status_counts()) {
+      out += "responses_total{method=" + label(o.first.first) + ",operation=" + label(o.first.second)
+        + ",status=\"" + std::to_string(s.first) + "\"} " + std::to_string(s.second) + "\n";
+    }
+  }
+  out += "# HELP request_duration_seconds Time to handle a request, by operation.\n";
+  out += "# TYPE request_duration_seconds summary\n";
+  for (const auto& o : ops) {
+    append_summary(out, "request_duration_seconds",
+                   "method=" + label(o.first.first) + ",operation=" + label(o.first.second),
+                   o.second->latency);
+  }
+  out += "# HELP dependency_duration_seconds Time spent waiting on storage and other servers.\n";
+  out += "# TYPE dependency_duration_seconds summary\n";
+  for (const auto& d : deps) {
+    append_summary(out, "dependency_duration_seconds",
+                   "kind=" + label(d.first.first) + ",call=" + label(d.first.second),
+                   *d.second);
+  }
+  return out;
+}
+
+Metrics& server_metrics () {
+  static Metrics metrics {};
+  return metrics;
+}
+
+void reply_metrics (http_request message, const vector<string>&) {
+  http_response response {status_codes::OK};
+  response.set_body(server_metrics().prometheus_text(), "text/plain; version=0.0.4");
+  message.reply(response);
+}
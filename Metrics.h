@@ -0,0 +1,166 @@
+#ifndef Metrics_h
+#define Metrics_h
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <cpprest/http_msg.h>
+
+#include <pplx/pplxtasks.h>
+
+/*
+  Latency histogram with bounded relative error, as in HdrHistogram
+
+  Values are microseconds. Below sub_buckets they are counted
+  exactly; above, each power of two is split into sub_buckets
+  equal buckets, so a reported quantile is within 1/sub_buckets
+  (about 3%) of the true value. Recording is one atomic increment
+  of a bucket, the count and the sum, with no lock.
+ */
+class Histogram {
+public:
+  static constexpr int sub_bucket_bits {5};
+  static constexpr uint64_t sub_buckets {uint64_t {1} << sub_bucket_bits};
+  static constexpr int max_bits {40}; // About 12 days, far past any timeout
+  static constexpr std::size_t bucket_count {sub_buckets * (max_bits - sub_bucket_bits + 1)};
+
+private:
+  std::array<std::atomic<uint64_t>,bucket_count> buckets;
+  std::atomic<uint64_t> total;
+  std::atomic<uint64_t> sum_us;
+
+  static std::size_t bucket_of (uint64_t us);
+  static uint64_t bucket_value (std::size_t bucket);
+
+public:
+  Histogram ();
+
+  Histogram (const Histogram&) = delete;
+  Histogram& operator= (const Histogram&) = delete;
+
+  void record (std::chrono::microseconds elapsed);
+
+  uint64_t count () const;
+  uint64_t sum () const; // In microseconds
+  // The value below which fraction q of the recorded values fall, in microseconds
+  uint64_t quantile (double q) const;
+};
+
+/*
+  Records the time from its construction to its destruction
+ */
+class ScopedTimer {
+private:
+  Histogram& histogram;
+  std::chrono::steady_clock::time_point start;
+
+public:
+  explicit ScopedTimer (Histogram& h) :
+    histogram (h),
+    start {std::chrono::steady_clock::now()}
+    {}
+  ~ScopedTimer () {
+    histogram.record(std::chrono::duration_cast<std::chrono::microseconds> (
+                       std::chrono::steady_clock::now() - start));
+  }
+
+  ScopedTimer (const ScopedTimer&) = delete;
+  ScopedTimer& operator= (const ScopedTimer&) = delete;
+};
+
+/*
+  Counts and latency of one operation: requests, replies by status
+  code, and the time the handler took
+ */
+class OperationMetrics {
+public:
+  static constexpr int max_status {600};
+
+private:
+  std::atomic<uint64_t> requests;
+  std::array<std::atomic<uint64_t>,max_status> statuses;
+
+public:
+  Histogram latency;
+
+  OperationMetrics ();
+
+  OperationMetrics (const OperationMetrics&) = delete;
+  OperationMetrics& operator= (const OperationMetrics&) = delete;
+
+  void request () { requests.fetch_add(1, std::memory_order_relaxed); }
+  void status (web::http::status_code code);
+
+  uint64_t request_count () const { return requests.load(std::memory_order_relaxed); }
+  // (code, count) for every status code replied at least once
+  std::vector<std::pair<int,uint64_t>> status_counts () const;
+};
+
+/*
+  Every metric of this process
+
+  Operations are labelled by method and operation name, and are
+  registered as the router's routes are added. Dependencies are
+  the calls a handler makes and waits for: kind is "storage" or
+  "downstream", and call names the storage call or the remote
+  operation.
+
+  Looking a metric up takes a lock, so callers on hot paths keep
+  the reference, which stays valid for the life of the process.
+ */
+class Metrics {
+private:
+  using key_t = std::pair<std::string,std::string>;
+
+  struct key_hash {
+    std::size_t operator() (const key_t& k) const {
+      return std::hash<std::string> {} (k.first) * 31 + std::hash<std::string> {} (k.second);
+    }
+  };
+
+  std::unordered_map<key_t,std::unique_ptr<OperationMetrics>,key_hash> operations;
+  std::unordered_map<key_t,std::unique_ptr<Histogram>,key_hash> dependencies;
+  pplx::extensibility::critical_section_t lock;
+
+public:
+  Metrics () :
+    operations {},
+    dependencies {},
+    lock {}
+    {};
+
+  Metrics (const Metrics&) = delete;
+  Metrics& operator= (const Metrics&) = delete;
+
+  OperationMetrics& operation (const std::string& method, const std::string& name);
+  Histogram& dependency (const std::string& kind, const std::string& call);
+
+  /*
+    All metrics in the Prometheus text exposition format: counters
+    of requests by status, and summaries with the 0.5, 0.99 and
+    0.999 quantiles of latency in seconds
+   */
+  std::string prometheus_text ();
+};
+
+// The metrics of this process
+Metrics& server_metrics ();
+
+// Name of the operation that replies with the metrics
+extern const std::string metrics_op;
+
+/*
+  Metrics (GET): reply with server_metrics().prometheus_text()
+ */
+void reply_metrics (web::http::http_request message, const std::vector<std::string>& paths);
+
+#endif
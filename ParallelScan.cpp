@@ -0,0 +1,141 @@
+/*
+ Parallel table scans, CMPT 276, Spring 2016.
+ */
+
+#include "ParallelScan.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <set>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <pplx/pplxtasks.h>
+
+#include <was/table.h>
+
+#include "TableStore.h"
+
+using azure::storage::table_entity;
+
+using pplx::extensibility::scoped_critical_section_t;
+
+using std::size_t;
+using std::string;
+using std::vector;
+
+constexpr size_t PartitionSampler::max_sample;
+
+namespace {
+  // Extra scan threads running now, across every parallel_query()
+  std::atomic<size_t> scan_threads {0};
+
+  // Take up to wanted of the free scan threads, returning how many were taken
+  size_t take_scan_threads (size_t wanted) {
+    size_t running {scan_threads.load()};
+    size_t taken {0};
+    do {
+      taken = running < max_scan_threads ? std::min(wanted, max_scan_threads - running) : 0;
+      if (taken == 0)
+        return 0;
+    } while ( ! scan_threads.compare_exchange_weak(running, running + taken));
+    return taken;
+  }
+}
+
+void PartitionSampler::saw (const string& table, const string& partition) {
+  scoped_critical_section_t l {lock};
+  std::set<string>& sample = samples[table];
+  if ( ! sample.insert(partition).second || sample.size() <= max_sample)
+    return;
+  // Thin to every other key
+  bool keep {true};
+  for (auto it = sample.begin(); it != sample.end(); keep = ! keep) {
+    if (keep)
+      ++it;
+    else
+      it = sample.erase(it);
+  }
+}
+
+void PartitionSampler::drop_table (const string& table) {
+  scoped_critical_section_t l {lock};
+  samples.erase(table);
+}
+
+vector<string> PartitionSampler::boundaries (const string& table, size_t ranges) {
+  vector<string> sorted {};
+  {
+    scoped_critical_section_t l {lock};
+    auto found = samples.find(table);
+    if (found == samples.end())
+      return sorted;
+    sorted.assign(found->second.begin(), found->second.end());
+  }
+  if (ranges > sorted.size())
+    ranges = sorted.size();
+  vector<string> cuts {};
+  for (size_t i {1}; i < ranges; ++i) {
+    const string& cut = sorted[i * sorted.size() / ranges];
+    if (cuts.empty() || cuts.back() != cut)
+      cuts.push_back(cut);
+  }
+  return cuts;
+}
+
+void parallel_query (TableStore& store, const vector<string>& boundaries,
+                     const vector<string>& columns, size_t workers,
+                     const entity_visitor_t& visit) {
+  const size_t range_count {boundaries.size() + 1};
+  std::atomic<size_t> next_range {0};
+  std::mutex visit_lock {};
+  std::mutex error_lock {};
+  std::exception_ptr error {};
+
+  auto scan = [&] () {
+    for (size_t r {next_range++}; r < range_count; r = next_range++) {
+      table_range range {string {}, 0, string {}, columns};
+      if (r > 0)
+        range.first_partition = boundaries[r - 1];
+      if (r < boundaries.size())
+        range.end_partition = boundaries[r];
+      try {
+        store.query(range, [&visit, &visit_lock] (const table_entity& e) {
+            std::lock_guard<std::mutex> l {visit_lock};
+            visit(e);
+          });
+      }
+      catch (...) {
+        std::lock_guard<std::mutex> l {error_lock};
+        if ( ! error)
+          error = std::current_exception();
+        next_range = range_count; // Start no more ranges
+      }
+    }
+  };
+
+  if (workers > range_count)
+    workers = range_count;
+  const size_t extra {workers > 1 ? take_scan_threads(workers - 1) : 0};
+  vector<std::thread> threads {};
+  try {
+    for (size_t i {0}; i < extra; ++i) {
+      threads.emplace_back(scan);
+    }
+  }
+  catch (const std::system_error&) {
+    // Too few threads to be had; scan with those that started
+  }
+  scan(); // This thread is one of the workers
+  for (auto& t : threads) {
+    t.join();
+  }
+  scan_threads -= extra;
+  if (error)
+    std::rethrow_exception(error);
+}
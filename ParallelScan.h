@@ -0,0 +1,78 @@
+#ifndef ParallelScan_h
+#define ParallelScan_h
+
+#include <cstddef>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <pplx/pplxtasks.h>
+
+#include "TableStore.h"
+
+/*
+  Partition keys seen in each table, from which to split a scan
+
+  A sequential scan of a table reports each partition it passes
+  through, and the sample keeps up to max_sample of them in key
+  order. Once a table has more, every other one is discarded, so
+  the sample stays spread evenly over the partitions of the table.
+  boundaries() then cuts the key space where the sample does, into
+  ranges holding roughly equal numbers of partitions.
+ */
+class PartitionSampler {
+public:
+  static constexpr std::size_t max_sample {256};
+
+private:
+  std::unordered_map<std::string,std::set<std::string>> samples;
+  pplx::extensibility::critical_section_t lock;
+
+public:
+  PartitionSampler () :
+    samples {},
+    lock {}
+    {}
+
+  PartitionSampler (const PartitionSampler&) = delete;
+  PartitionSampler& operator= (const PartitionSampler&) = delete;
+
+  void saw (const std::string& table, const std::string& partition);
+  void drop_table (const std::string& table);
+
+  /*
+    Up to ranges - 1 partition keys, ascending, splitting table
+    into that many ranges; empty if too little of table has been
+    seen to split it
+   */
+  std::vector<std::string> boundaries (const std::string& table, std::size_t ranges);
+};
+
+/*
+  Query the ranges of store between successive boundaries at once
+
+  The boundaries must be ascending; n of them make n + 1 ranges,
+  the first starting at the lowest key and the last running to the
+  highest. At most workers ranges are read at a time, each on its
+  own thread, since a storage query blocks for every page.
+
+  The calling thread is always one of the workers. The others are
+  drawn from max_scan_threads shared by every scan in the process;
+  when those are all busy, the scan makes do with fewer workers,
+  down to the calling thread alone, rather than waiting for them.
+
+  visit is called for every entity, never by two threads at once,
+  but in no particular order across ranges: entities within one
+  range arrive in key order, interleaved with those of the others.
+
+  Throws the first exception any range's query threw, once every
+  range has stopped.
+ */
+constexpr std::size_t max_scan_threads {32};
+
+void parallel_query (TableStore& store, const std::vector<std::string>& boundaries,
+                     const std::vector<std::string>& columns, std::size_t workers,
+                     const entity_visitor_t& visit);
+
+#endif
@@ -0,0 +1,184 @@
+/*
+ Secondary property indexes, CMPT 276, Spring 2016.
+ */
+
+#include "PropertyIndex.h"
+
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cpprest/http_msg.h>
+
+#include <was/table.h>
+
+#include "TableStore.h"
+#include "make_unique.h"
+
+using azure::storage::edm_type;
+using azure::storage::entity_property;
+using azure::storage::table_entity;
+
+using pplx::extensibility::scoped_critical_section_t;
+
+using std::string;
+using std::vector;
+
+string PropertyIndex::index_value (const entity_property& property) {
+  if (property.property_type() == edm_type::string)
+    return property.string_value();
+  return property.str();
+}
+
+void PropertyIndex::set_value (index_t& index, const key_t& key, const string& value) {
+  auto old = index.values.find(key);
+  if (old != index.values.end()) {
+    if (old->second == value)
+      return;
+    auto keys = index.keys.find(old->second);
+    keys->second.erase(key);
+    if (keys->second.empty())
+      index.keys.erase(keys);
+    old->second = value;
+  }
+  else {
+    index.values.emplace(key, value);
+  }
+  index.keys[value].insert(key);
+}
+
+void PropertyIndex::remove_key (index_t& index, const key_t& key) {
+  auto old = index.values.find(key);
+  if (old == index.values.end())
+    return;
+  auto keys = index.keys.find(old->second);
+  keys->second.erase(key);
+  if (keys->second.empty())
+    index.keys.erase(keys);
+  index.values.erase(old);
+}
+
+void PropertyIndex::apply (entry_t& entry, const change_t& change) {
+  if (entry.live) {
+    if (change.remove)
+      remove_key(*entry.live, change.key);
+    else
+      set_value(*entry.live, change.key, change.value);
+  }
+  if (entry.building)
+    entry.log.push_back(change);
+}
+
+bool PropertyIndex::build (const string& table, const string& property, TableStore& store,
+                           std::size_t& count) {
+  {
+    scoped_critical_section_t l {lock};
+    entry_t& entry = indexes[table][property];
+    if (entry.building)
+      return false;
+    entry.building = true;
+    entry.log.clear();
+  }
+
+  std::unique_ptr<index_t> index {std::make_unique<index_t>()};
+  try {
+    store.query(table_range {string {}, 0, string {}, vector<string> {property}},
+                [&index, &property] (const table_entity& e) {
+                  auto p = e.properties().find(property);
+                  if (p != e.properties().end())
+                    set_value(*index, key_t {e.partition_key(), e.row_key()}, index_value(p->second));
+                });
+  }
+  catch (const std::exception&) {
+    scoped_critical_section_t l {lock};
+    auto t = indexes.find(table);
+    if (t != indexes.end()) {
+      auto e = t->second.find(property);
+      if (e != t->second.end()) {
+        e->second.building = false;
+        e->second.log.clear();
+        if ( ! e->second.live)
+          t->second.erase(e);
+      }
+    }
+    throw;
+  }
+
+  scoped_critical_section_t l {lock};
+  auto t = indexes.find(table);
+  if (t == indexes.end() || t->second.count(property) == 0) {
+    // Dropped while it was being built
+    count = 0;
+    return true;
+  }
+  entry_t& entry = t->second[property];
+  for (const auto& change : entry.log) {
+    if (change.remove)
+      remove_key(*index, change.key);
+    else
+      set_value(*index, change.key, change.value);
+  }
+  count = index->values.size();
+  entry.live = std::move(index);
+  entry.building = false;
+  entry.log.clear();
+  return true;
+}
+
+bool PropertyIndex::drop (const string& table, const string& property) {
+  scoped_critical_section_t l {lock};
+  auto t = indexes.find(table);
+  if (t == indexes.end() || t->second.erase(property) == 0)
+    return false;
+  if (t->second.empty())
+    indexes.erase(t);
+  return true;
+}
+
+void PropertyIndex::drop_table (const string& table) {
+  scoped_critical_section_t l {lock};
+  indexes.erase(table);
+}
+
+bool PropertyIndex::lookup (const string& table, const string& property, const string& value,
+                            vector<key_t>& keys) {
+  keys.clear();
+  scoped_critical_section_t l {lock};
+  auto t = indexes.find(table);
+  if (t == indexes.end())
+    return false;
+  auto e = t->second.find(property);
+  if (e == t->second.end() || ! e->second.live)
+    return false;
+  auto k = e->second.live->keys.find(value);
+  if (k != e->second.live->keys.end())
+    keys.assign(k->second.begin(), k->second.end());
+  return true;
+}
+
+void PropertyIndex::merged (const string& table, const table_entity& entity) {
+  scoped_critical_section_t l {lock};
+  auto t = indexes.find(table);
+  if (t == indexes.end())
+    return;
+  const table_entity::properties_type& properties = entity.properties();
+  for (auto& e : t->second) {
+    auto p = properties.find(e.first);
+    if (p != properties.end())
+      apply(e.second, change_t {key_t {entity.partition_key(), entity.row_key()},
+                                false, index_value(p->second)});
+  }
+}
+
+void PropertyIndex::removed (const string& table, const string& partition, const string& row) {
+  scoped_critical_section_t l {lock};
+  auto t = indexes.find(table);
+  if (t == indexes.end())
+    return;
+  for (auto& e : t->second) {
+    apply(e.second, change_t {key_t {partition, row}, true, string {}});
+  }
+}
@@ -0,0 +1,119 @@
+#ifndef PropertyIndex_h
+#define PropertyIndex_h
+
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <pplx/pplxtasks.h>
+
+#include <was/table.h>
+
+#include "TableStore.h"
+
+/*
+  In-process secondary indexes, each mapping the values of one
+  property of one table to the keys of the entities that have them
+
+  Indexes are opt-in: build() creates one, or rebuilds it, from a
+  scan of the table. The server then keeps it current by calling
+  merged() and removed() after each of its own writes, so lookup()
+  costs O(matches) rather than a scan of the table.
+
+  Writes made by other processes are not seen, so callers should
+  confirm each match against the entity they read. Rebuilding
+  brings an index back in step with storage.
+
+  A build takes as long as the scan, and writes continue meanwhile.
+  They are applied to the index being replaced, so lookups stay
+  answered from it, and are also logged; when the scan finishes,
+  the log is replayed over the new index before it replaces the
+  old. A write the scan has already seen is simply applied again.
+
+  Property values are indexed by their string form, as the
+  JSON-body filter and UpdateEntityAdmin see them.
+ */
+class PropertyIndex {
+public:
+  // (partition, row)
+  using key_t = std::pair<std::string,std::string>;
+
+private:
+  struct index_t {
+    std::unordered_map<std::string,std::set<key_t>> keys; // By value
+    std::map<key_t,std::string> values; // By entity
+  };
+
+  // A write to replay over an index being built
+  struct change_t {
+    key_t key;
+    bool remove;
+    std::string value;
+  };
+
+  struct entry_t {
+    std::unique_ptr<index_t> live; // Null until the first build finishes
+    bool building;
+    std::vector<change_t> log;
+  };
+
+  // Table to property to index
+  std::unordered_map<std::string,std::unordered_map<std::string,entry_t>> indexes;
+  pplx::extensibility::critical_section_t lock;
+
+  static void set_value (index_t& index, const key_t& key, const std::string& value);
+  static void remove_key (index_t& index, const key_t& key);
+  static void apply (entry_t& entry, const change_t& change);
+
+public:
+  PropertyIndex () :
+    indexes {},
+    lock {}
+    {};
+
+  PropertyIndex (const PropertyIndex&) = delete;
+  PropertyIndex& operator= (const PropertyIndex&) = delete;
+
+  // The string form of a property under which it is indexed
+  static std::string index_value (const azure::storage::entity_property& property);
+
+  /*
+    Build the index of property in table from a scan of store,
+    replacing any earlier one, and set count to the number of
+    entities it holds.
+
+    Returns false without scanning if a build of the same index is
+    already running. Throws std::exception if the scan fails, in
+    which case any earlier index is left in place.
+   */
+  bool build (const std::string& table, const std::string& property, TableStore& store,
+              std::size_t& count);
+
+  // Drop one index, returning false if there was none
+  bool drop (const std::string& table, const std::string& property);
+  // Drop every index of a table that has been deleted
+  void drop_table (const std::string& table);
+
+  /*
+    Set keys to the entities of table whose property has value, in
+    (partition, row) order. Returns false if the index has not been
+    built.
+   */
+  bool lookup (const std::string& table, const std::string& property, const std::string& value,
+               std::vector<key_t>& keys);
+
+  /*
+    Record a successful write: an insert or merge of entity, which
+    changes the indexed properties it carries and leaves the rest,
+    or the delete of (partition, row)
+   */
+  void merged (const std::string& table, const azure::storage::table_entity& entity);
+  void removed (const std::string& table, const std::string& partition, const std::string& row);
+};
+
+#endif
@@ -2,17 +2,18 @@
  Push Server code for CMPT 276, Spring 2016.
  */
 
-#include <iostream>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
-#include <cpprest/http_listener.h>
 #include <cpprest/json.h>
 
 #include <was/common.h>
 #include <was/table.h>
 
+#include "Logger.h"
+#include "Router.h"
+#include "ServerConfig.h"
 #include "TableCache.h"
 #include "make_unique.h"
 #include "ClientUtils.h"
@@ -33,10 +34,6 @@ using azure::storage::table_result;
 using pplx::extensibility::critical_section_t;
 using pplx::extensibility::scoped_critical_section_t;
 
-using std::cin;
-using std::cout;
-using std::endl;
-using std::getline;
 using std::make_pair;
 using std::pair;
 using std::string;
@@ -52,16 +49,16 @@ using web::http::uri;
 
 using web::json::value;
 
-using web::http::experimental::listener::http_listener;
 
 using prop_str_vals_t = vector<pair<string,string>>;
 
-constexpr const char* def_url = "http://localhost:34574";
+constexpr unsigned def_port {34574};
 const string addr {"http://localhost:34568/"};
 
 const string data_table_name {"DataTable"};
 const string read_entity_admin {"ReadEntityAdmin"};
 const string update_entity_admin {"UpdateEntityAdmin"};
+const string batch_update_admin {"BatchUpdateAdmin"};
 const string push_status {"PushStatus"};
 
 unordered_map<string,string> get_json_body(http_request message) {  
@@ -95,84 +92,81 @@ unordered_map<string,string> get_json_body(http_request message) {
 }
 
 /*
-  Top-level routine for processing all HTTP POST requests.
+  PushStatus/COUNTRY/USERID/STATUS (POST), with the user's friends
+  list in the JSON body
  */
-void handle_post(http_request message) {
-  string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** POST " << path << endl;
-  auto paths = uri::split_path(path);
-  
+void push_status_op (http_request message, const vector<string>& paths) {
   unordered_map<string,string> json_body {get_json_body(message)};
-  
-  if (paths[0] == push_status) {
-  	if (paths.size() < 4) {
-  	  message.reply(status_codes::BadRequest);
-  	  return;
-  	}
-  	
-  	string friendslist {json_body["Friends"]};
-    friends_list_t friendslist_vec = parse_friends_list(friendslist);
-  	
-  	for (int i = 0; i < friendslist_vec.size(); i++) {
-      cout << "Updating " + friendslist_vec[i].first + "/"
-              + friendslist_vec[i].second << endl;
-
-  		pair<status_code,value> get_entity {
-        do_request(methods::GET,
-                  string(addr)
-                  + read_entity_admin + "/"
-                  + data_table_name + "/"
-                  + friendslist_vec[i].first + "/"
-                  + friendslist_vec[i].second)
-      };
-  		
-  		string updatelist = get_json_object_prop(get_entity.second, "Updates");
-  		updatelist.append(paths[3]);
-  		updatelist.append("\n");
-
-      cout << "New Status: " + updatelist << endl;
-  		
-  		value val = build_json_value("Updates", updatelist);
-  		
-  		pair<status_code,value> update_entity {
-        do_request(methods::PUT,
-                  string(addr)
-                  + update_entity_admin + "/"
-                  + data_table_name + "/"
-                  + friendslist_vec[i].first + "/"
-                  + friendslist_vec[i].second,
-			            val)
-      };
-  	}
-	
-  	message.reply(status_codes::OK); //went through all friends of this user and updated their updatelist
-  	return;
+
+  string friendslist {json_body["Friends"]};
+  friends_list_t friendslist_vec = parse_friends_list(friendslist);
+
+  // Read every friend's updates, then write them all in one batch
+  vector<value> updates {};
+  for (int i = 0; i < friendslist_vec.size(); i++) {
+    log_debug() << "Updating " + friendslist_vec[i].first + "/"
+                  + friendslist_vec[i].second;
+
+    http_headers resp_headers {};
+    pair<status_code,value> get_entity {
+      do_request(methods::GET,
+                 string(addr)
+                 + read_entity_admin + "/"
+                 + data_table_name + "/"
+                 + friendslist_vec[i].first + "/"
+                 + friendslist_vec[i].second,
+                 value {},
+                 vector<pair<string,string>> {},
+                 resp_headers)
+    };
+    if (get_entity.first == status_codes::ServiceUnavailable) {
+      reply_unavailable(message, resp_headers);
+      return;
+    }
+
+    string updatelist = get_json_object_prop(get_entity.second, "Updates");
+    updatelist.append(paths[3]);
+    updatelist.append("\n");
+
+    log_debug() << "New Status: " + updatelist;
+
+    updates.push_back(value::object(vector<pair<string,value>> {
+      make_pair("Partition", value::string(friendslist_vec[i].first)),
+      make_pair("Row", value::string(friendslist_vec[i].second)),
+      make_pair("Updates", value::string(updatelist))
+    }));
   }
-  else {
-	  message.reply(status_codes::BadRequest);
-	  return;
+
+  if ( ! updates.empty()) {
+    http_headers resp_headers {};
+    pair<status_code,value> update_entities {
+      do_request(methods::PUT,
+                 string(addr)
+                 + batch_update_admin + "/"
+                 + data_table_name,
+                 value::array(updates),
+                 vector<pair<string,string>> {},
+                 resp_headers)
+    };
+    if (update_entities.first == status_codes::ServiceUnavailable) {
+      reply_unavailable(message, resp_headers);
+      return;
+    }
   }
-}
 
-void handle_get(http_request message) {
-  string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** GET " << path << endl;
-  message.reply(status_codes::BadRequest);
-  return;
+  message.reply(status_codes::OK); //went through all friends of this user and updated their updatelist
 }
 
-void handle_put(http_request message) {
-  string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** PUT " << path << endl;
-  message.reply(status_codes::BadRequest);
-  return;
-}
+/*
+  PushServer's only operation, besides GET Metrics; every other
+  request gets BadRequest
+ */
+Router router {};
 
-void handle_delete(http_request message) {
-  string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** DELETE " << path << endl;
-  message.reply(status_codes::BadRequest);
-  return;
+void add_routes () {
+  router.add(methods::GET, metrics_op, 1, &reply_metrics);
+  router.unlimited(methods::GET, metrics_op);
+  router.add(methods::POST, push_status, 4, Router::any_arity, &push_status_op);
 }
 
 /*
@@ -182,32 +176,20 @@ void handle_delete(http_request message) {
   which processes each request asynchronously.
 
   Note that, unlike BasicServer, PushServer only
-  installs the listeners for POST. Any other HTTP
-  method will produce a Method Not Allowed (405)
+  has routes for POST and for GET Metrics. Any other
+  HTTP method will produce a Method Not Allowed (405)
   response.
 
-  If you want to support other methods, uncomment
-  the call below that hooks in a the appropriate 
-  listener.
-  
-  Wait for a carriage return, then shut the server down.
+  Options set the address, port, threads and drain timeout; see
+  ServerConfig.h.
+
+  Serve until told to stop, then drain and shut the server down.
  */
 int main (int argc, char const * argv[]) {
-  cout << "PushServer: Parsing connection string" << endl;
-
-  cout << "PushServer: Opening listener" << endl;
-  http_listener listener {def_url};
-  //listener.support(methods::GET, &handle_get);
-  listener.support(methods::POST, &handle_post);
-  //listener.support(methods::PUT, &handle_put);
-  //listener.support(methods::DEL, &handle_delete);
-  listener.open().wait(); // Wait for listener to complete starting
-
-  cout << "Enter carriage return to stop PushServer." << endl;
-  string line;
-  getline(std::cin, line);
-
-  // Shut it down
-  listener.close().wait();
-  cout << "PushServer closed" << endl;
+  ServerConfig config {};
+  if ( ! parse_server_config(argc, argv, def_port, config))
+    return 1;
+
+  add_routes();
+  serve(config, router, "PushServer");
 }
@@ -0,0 +1,215 @@
+/*
+ Request routing, CMPT 276, Spring 2016.
+ */
+
+#include "Router.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cpprest/base_uri.h>
+#include <cpprest/http_listener.h>
+#include <cpprest/http_msg.h>
+
+#include "Admission.h"
+#include "Logger.h"
+#include "Metrics.h"
+
+using std::size_t;
+using std::string;
+using std::vector;
+
+using web::http::http_request;
+using web::http::http_response;
+using web::http::method;
+using web::http::methods;
+using web::http::status_codes;
+using web::http::uri;
+
+using web::http::experimental::listener::http_listener;
+
+Router::Router (const string& name) :
+  server_name {name},
+  methods {},
+  active {0},
+  draining {false},
+  admission {}
+{}
+
+Router::method_t& Router::method_table (const method& m) {
+  method_t& table = methods[m];
+  if ( ! table.fallback) {
+    table.fallback = [] (http_request message, const vector<string>&) {
+      message.reply(status_codes::BadRequest);
+    };
+    table.unmatched = &server_metrics().operation(m, "(unmatched)");
+  }
+  return table;
+}
+
+void Router::add (const method& m, const string& operation, size_t arity, handler_t handler) {
+  add(m, operation, arity, arity, handler);
+}
+
+void Router::add (const method& m, const string& operation,
+                  size_t min_arity, size_t max_arity, handler_t handler) {
+  operation_t& op = method_table(m).operations[operation];
+  if ( ! op.metrics)
+    op.metrics = &server_metrics().operation(m, operation);
+  if (max_arity == any_arity) {
+    // Every arity past the ones listed shares the handler
+    if (op.by_arity.size() < min_arity)
+      op.by_arity.resize(min_arity);
+    for (size_t i {min_arity}; i < op.by_arity.size(); ++i) {
+      op.by_arity[i] = handler;
+    }
+    op.longer = handler;
+    return;
+  }
+  if (op.by_arity.size() <= max_arity) {
+    size_t old_size {op.by_arity.size()};
+    op.by_arity.resize(max_arity + 1);
+    for (size_t i {old_size}; i < op.by_arity.size(); ++i) {
+      op.by_arity[i] = op.longer;
+    }
+  }
+  for (size_t i {min_arity}; i <= max_arity; ++i) {
+    op.by_arity[i] = handler;
+  }
+}
+
+void Router::unlimited (const method& m, const string& operation) {
+  method_table(m).operations[operation].unlimited = true;
+}
+
+void Router::limit (size_t max_in_flight, size_t queue_length) {
+  admission.set_limits(max_in_flight, queue_length);
+}
+
+void Router::fallback (const method& m, handler_t handler) {
+  method_table(m).fallback = handler;
+}
+
+void Router::dispatch (http_request message) {
+  const string path {uri::decode(message.relative_uri().path())};
+  log_info() << "**** " << (server_name.empty() ? string {} : server_name + " ")
+             << message.method() << " " << path;
+  const vector<string> paths {uri::split_path(path)};
+
+  if (draining.load()) {
+    http_response response {status_codes::ServiceUnavailable};
+    response.headers().add("Connection", "close");
+    message.reply(response);
+    return;
+  }
+
+  auto m = methods.find(message.method());
+  if (m == methods.end()) {
+    message.reply(status_codes::MethodNotAllowed);
+    return;
+  }
+  if ( ! paths.empty()) {
+    auto op = m->second.operations.find(paths[0]);
+    if (op != m->second.operations.end()) {
+      const operation_t& routes = op->second;
+      const handler_t& handler = paths.size() < routes.by_arity.size() ? routes.by_arity[paths.size()]
+                                                                        : routes.longer;
+      if (handler) {
+        run(message, paths, handler, *routes.metrics, ! routes.unlimited);
+        return;
+      }
+    }
+  }
+  run(message, paths, m->second.fallback, *m->second.unmatched, false);
+}
+
+/*
+  A request stays active until its handler returns, not just until
+  it replies: a streaming handler replies first and then writes
+  the body, which the drain must wait for.
+ */
+void Router::run (http_request message, const vector<string>& paths,
+                  const handler_t& handler, OperationMetrics& metrics, bool limited) {
+  metrics.request();
+  ++active;
+  OperationMetrics* counted {&metrics};
+  message.get_response().then([counted] (pplx::task<http_response> response) {
+      try {
+        counted->status(response.get().status_code());
+      }
+      catch (const std::exception&) {
+        // The reply failed; there is no status to count
+      }
+    });
+  if ( ! limited) {
+    call(message, paths, handler, metrics);
+    --active;
+    return;
+  }
+
+  // The tables do not change once listening, so the handler can be kept by address
+  const handler_t* routed {&handler};
+  AdmissionControl* control {&admission};
+  std::atomic<std::size_t>* running {&active};
+  admission.admit(message.method() == methods::GET ? AdmissionControl::op_class::read
+                                                    : AdmissionControl::op_class::write,
+                  [message, paths, routed, counted, control, running] () {
+                    call(message, paths, *routed, *counted);
+                    // Only now is a streamed body fully written
+                    control->finished();
+                    --*running;
+                  },
+                  [message, running] () {
+                    http_response response {status_codes::ServiceUnavailable};
+                    response.headers().add("Retry-After", "1");
+                    message.reply(response);
+                    --*running;
+                  });
+}
+
+/*
+  Run handler, timing it, and reply InternalError if it throws:
+  an admitted request may not be on a listener thread, which would
+  reply for us
+ */
+void Router::call (http_request message, const vector<string>& paths,
+                   const handler_t& handler, OperationMetrics& metrics) {
+  ScopedTimer timer {metrics.latency};
+  try {
+    handler(message, paths);
+  }
+  catch (const std::exception& e) {
+    log_error() << "Handler for " << (paths.empty() ? string {} : paths[0]) << " threw: " << e.what();
+    try {
+      message.reply(status_codes::InternalError);
+    }
+    catch (const std::exception&) {
+      // The handler had already replied
+    }
+  }
+}
+
+void Router::stop_accepting () {
+  draining.store(true);
+}
+
+bool Router::wait_until_idle (std::chrono::milliseconds timeout) {
+  const auto deadline = std::chrono::steady_clock::now() + timeout;
+  while (active.load() > 0) {
+    if (std::chrono::steady_clock::now() >= deadline)
+      return false;
+    std::this_thread::sleep_for(std::chrono::milliseconds {10});
+  }
+  return true;
+}
+
+void Router::listen (http_listener& listener) {
+  for (const auto& m : methods) {
+    listener.support(m.first, [this] (http_request message) { dispatch(message); });
+  }
+}
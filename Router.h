@@ -0,0 +1,123 @@
+#ifndef Router_h
+#define Router_h
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cpprest/http_listener.h>
+#include <cpprest/http_msg.h>
+
+#include "Admission.h"
+#include "Metrics.h"
+
+/*
+  Dispatch of requests to handlers by method, operation and arity
+
+  Every path has the form OPERATION/OPERAND/..., and a route names
+  the method, the operation and the number of path segments,
+  counting the operation, that its handler accepts: exactly one
+  number, or any number from a minimum up. The handler is given
+  the path already decoded and split.
+
+  Routes are found with one hash lookup per method and one per
+  operation, then an index by arity, however many operations a
+  server has. A request matching no route goes to the method's
+  fallback, which by default replies BadRequest; servers whose
+  errors depend on the arity or the operation set their own.
+
+  Each route's method and operation is counted in server_metrics(),
+  with the time its handler takes and the status of the reply;
+  requests that reach a fallback are counted as "(unmatched)".
+  Every server also answers GET Metrics with those counts.
+
+  Routes must all be added before listen() is called; after that,
+  dispatch only reads the tables, so needs no lock.
+
+  Routed requests pass through admission control, set by limit(),
+  GETs as reads and the rest as writes; a request it turns away
+  gets ServiceUnavailable with Retry-After. Fallbacks, which only
+  reply with an error, and operations marked unlimited() bypass it,
+  so that a server can still report its metrics when overloaded.
+
+  The router counts the requests it has dispatched whose handlers
+  have not yet returned, streamed bodies included, so that a
+  server shutting down can stop_accepting() and then
+  wait_until_idle() before it closes its listener.
+ */
+class Router {
+public:
+  using handler_t = std::function<void (web::http::http_request message,
+                                        const std::vector<std::string>& paths)>;
+
+  // For add(): no upper limit on the number of segments
+  static constexpr std::size_t any_arity {static_cast<std::size_t> (-1)};
+
+private:
+  struct operation_t {
+    std::vector<handler_t> by_arity; // Empty functions where no route matches
+    handler_t longer; // For arities beyond by_arity, if the last route had no limit
+    OperationMetrics* metrics;
+    bool unlimited; // Not subject to admission control
+  };
+
+  struct method_t {
+    std::unordered_map<std::string,operation_t> operations;
+    handler_t fallback;
+    OperationMetrics* unmatched;
+  };
+
+  std::string server_name;
+  std::unordered_map<web::http::method,method_t> methods;
+  std::atomic<std::size_t> active; // Requests dispatched whose handlers have not returned
+  std::atomic<bool> draining;
+  AdmissionControl admission;
+
+  method_t& method_table (const web::http::method& method);
+  void run (web::http::http_request message, const std::vector<std::string>& paths,
+            const handler_t& handler, OperationMetrics& metrics, bool limited);
+  static void call (web::http::http_request message, const std::vector<std::string>& paths,
+                    const handler_t& handler, OperationMetrics& metrics);
+
+public:
+  // name prefixes each logged request, if not empty
+  explicit Router (const std::string& name = std::string {});
+
+  // Route OPERATION with exactly arity segments, or with min_arity to max_arity
+  void add (const web::http::method& method, const std::string& operation, std::size_t arity,
+            handler_t handler);
+  void add (const web::http::method& method, const std::string& operation,
+            std::size_t min_arity, std::size_t max_arity, handler_t handler);
+
+  // Exempt an operation already added from admission control
+  void unlimited (const web::http::method& method, const std::string& operation);
+
+  // Admit at most max_in_flight requests at once, 0 for no limit; see Admission.h
+  void limit (std::size_t max_in_flight, std::size_t queue_length);
+
+  // Handler for requests to method that match no route
+  void fallback (const web::http::method& method, handler_t handler);
+
+  void dispatch (web::http::http_request message);
+
+  // Reply ServiceUnavailable, and close the connection, to every later request
+  void stop_accepting ();
+  /*
+    Wait until every request dispatched has been handled, or for
+    at most timeout; returns false if some were still running
+   */
+  bool wait_until_idle (std::chrono::milliseconds timeout);
+  std::size_t active_requests () const { return active.load(); }
+
+  /*
+    Have listener send every method with a route or a fallback to
+    dispatch(); other methods get 405 Method Not Allowed
+   */
+  void listen (web::http::experimental::listener::http_listener& listener);
+};
+
+#endif
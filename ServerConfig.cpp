@@ -0,0 +1,296 @@
+/*
+ Server configuration and shutdown, CMPT 276, Spring 2016.
+ */
+
+#include "ServerConfig.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <cpprest/http_listener.h>
+
+#include <pplx/pplxtasks.h>
+
+#include "Logger.h"
+#include "Router.h"
+
+using std::size_t;
+using std::string;
+using std::vector;
+
+using web::http::experimental::listener::http_listener;
+
+namespace {
+  constexpr std::chrono::milliseconds default_drain_timeout {10000};
+  constexpr size_t default_max_in_flight {0};
+  constexpr size_t default_queue_length {64};
+  constexpr std::chrono::seconds default_snapshot_interval {60};
+  constexpr std::chrono::seconds default_cache_ttl {30};
+  constexpr std::chrono::milliseconds default_write_combine_window {0};
+
+  // Written by the signal handler, read by wait_for_shutdown()
+  int signal_pipe[2] {-1, -1};
+  volatile sig_atomic_t signalled {0}; // If the pipe could not be made
+
+  void on_signal_flag (int) {
+    signalled = 1;
+  }
+
+  void on_signal (int) {
+    const char byte {0};
+    int saved_errno {errno};
+    ssize_t ignored {write(signal_pipe[1], &byte, 1)};
+    (void) ignored;
+    errno = saved_errno;
+  }
+
+  void set_signal_handlers (void (*handler) (int)) {
+    struct sigaction action {};
+    action.sa_handler = handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+  }
+
+  /*
+    Block until SIGINT, SIGTERM or, if standard input is a
+    terminal, a carriage return or end of file
+   */
+  void wait_for_shutdown (const string& name) {
+    bool interactive {isatty(STDIN_FILENO) == 1};
+    if (pipe(signal_pipe) != 0) {
+      // Standard input may not be a terminal, so only a signal can stop the server
+      log_error() << name << ": Cannot make a signal pipe; send SIGINT or SIGTERM to stop";
+      flush_log();
+      set_signal_handlers(&on_signal_flag);
+      while ( ! signalled) {
+        std::this_thread::sleep_for(std::chrono::milliseconds {100});
+      }
+      set_signal_handlers(SIG_DFL);
+      return;
+    }
+    set_signal_handlers(&on_signal);
+
+    if (interactive)
+      log_info() << "Enter carriage return, or send SIGINT or SIGTERM, to stop " << name;
+    else
+      log_info() << "Send SIGINT or SIGTERM to stop " << name;
+    flush_log();
+
+    pollfd watched[2] {{signal_pipe[0], POLLIN, 0}, {STDIN_FILENO, POLLIN, 0}};
+    for (;;) {
+      if (poll(watched, interactive ? 2 : 1, -1) < 0) {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+      if (watched[0].revents != 0)
+        break;
+      if (watched[1].revents != 0) {
+        string line;
+        getline(std::cin, line);
+        break;
+      }
+    }
+    // A second signal stops the process without waiting for the drain
+    set_signal_handlers(SIG_DFL);
+  }
+
+  // Parse a whole string as an unsigned number
+  bool parse_number (const string& text, unsigned long& out) {
+    if (text.empty() || text[0] == '-')
+      return false;
+    try {
+      size_t used {0};
+      out = std::stoul(text, &used);
+      return used == text.size();
+    }
+    catch (const std::exception&) {
+      return false;
+    }
+  }
+}
+
+string ServerConfig::url () const {
+  return "http://" + address + ":" + std::to_string(port);
+}
+
+bool parse_server_config (int argc, char const * argv[], unsigned default_port, ServerConfig& config) {
+  config.address = "localhost";
+  config.port = default_port;
+  config.threads = 0;
+  config.drain_timeout = default_drain_timeout;
+  config.max_in_flight = default_max_in_flight;
+  config.queue_length = default_queue_length;
+  config.snapshot.clear();
+  config.snapshot_interval = default_snapshot_interval;
+  config.cache_ttl = default_cache_ttl;
+  config.cache_bytes = 0;
+  config.write_combine_window = default_write_combine_window;
+  config.arguments.clear();
+
+  for (int i {1}; i < argc; ++i) {
+    const string arg {argv[i]};
+    if (arg.compare(0, 2, "--") != 0) {
+      config.arguments.push_back(arg);
+      continue;
+    }
+
+    // Either --name=value or --name value
+    string name {arg};
+    string text {};
+    size_t equals {arg.find('=')};
+    if (equals != string::npos) {
+      name = arg.substr(0, equals);
+      text = arg.substr(equals + 1);
+    }
+    else if (i + 1 < argc) {
+      text = argv[++i];
+    }
+    else {
+      log_error() << "Option " << name << " needs a value";
+      return false;
+    }
+
+    unsigned long number {0};
+    if (name == "--address" && ! text.empty()) {
+      config.address = text;
+    }
+    else if (name == "--port" && parse_number(text, number) && number > 0 && number < 65536) {
+      config.port = static_cast<unsigned> (number);
+    }
+    else if (name == "--threads" && parse_number(text, number)) {
+      config.threads = static_cast<size_t> (number);
+    }
+    else if (name == "--drain-timeout" && parse_number(text, number)) {
+      config.drain_timeout = std::chrono::milliseconds {number};
+    }
+    else if (name == "--max-in-flight" && parse_number(text, number)) {
+      config.max_in_flight = static_cast<size_t> (number);
+    }
+    else if (name == "--queue-length" && parse_number(text, number)) {
+      config.queue_length = static_cast<size_t> (number);
+    }
+    else if (name == "--snapshot" && ! text.empty()) {
+      config.snapshot = text;
+    }
+    else if (name == "--snapshot-interval" && parse_number(text, number) && number > 0) {
+      config.snapshot_interval = std::chrono::seconds {number};
+    }
+    else if (name == "--cache-ttl" && parse_number(text, number)) {
+      config.cache_ttl = std::chrono::seconds {number};
+    }
+    else if (name == "--cache-bytes" && parse_number(text, number) && number > 0) {
+      config.cache_bytes = static_cast<size_t> (number);
+    }
+    else if (name == "--write-combine-ms" && parse_number(text, number)) {
+      config.write_combine_window = std::chrono::milliseconds {number};
+    }
+    else {
+      log_error() << "Bad option: " << name << " " << text;
+      return false;
+    }
+  }
+
+  if (config.threads > 0) {
+    if (config.max_in_flight == 0) {
+      log_error() << "--threads needs --max-in-flight, or unlimited requests can take every thread";
+      return false;
+    }
+    const size_t needed {pool_threads_needed(config.max_in_flight)};
+    if (config.threads < needed) {
+      log_warning() << "--threads " << config.threads << " could deadlock with --max-in-flight "
+                    << config.max_in_flight << "; using " << needed;
+      config.threads = needed;
+    }
+  }
+  return true;
+}
+
+size_t pool_threads_needed (size_t max_in_flight) {
+  return max_in_flight * (1 + max_handler_tasks) + 1;
+}
+
+WorkerPool::WorkerPool (size_t threads) :
+  lock {},
+  ready {},
+  tasks {},
+  stopping {false},
+  workers {}
+{
+  for (size_t i {0}; i < threads; ++i) {
+    workers.emplace_back([this] () { run(); });
+  }
+}
+
+WorkerPool::~WorkerPool () {
+  {
+    std::lock_guard<std::mutex> l {lock};
+    stopping = true;
+  }
+  ready.notify_all();
+  for (auto& w : workers) {
+    w.join();
+  }
+}
+
+void WorkerPool::schedule (pplx::TaskProc_t proc, void* param) {
+  {
+    std::lock_guard<std::mutex> l {lock};
+    tasks.emplace_back(proc, param);
+  }
+  ready.notify_one();
+}
+
+void WorkerPool::run () {
+  for (;;) {
+    std::pair<pplx::TaskProc_t,void*> task {};
+    {
+      std::unique_lock<std::mutex> l {lock};
+      ready.wait(l, [this] () { return stopping || ! tasks.empty(); });
+      if (tasks.empty())
+        return; // Stopping, with nothing left to run
+      task = tasks.front();
+      tasks.pop_front();
+    }
+    task.first(task.second);
+  }
+}
+
+void serve (const ServerConfig& config, Router& router, const string& name) {
+  if (config.threads > 0) {
+    pplx::set_ambient_scheduler(std::make_shared<WorkerPool>(config.threads));
+    log_info() << name << ": Running tasks on " << config.threads << " threads";
+  }
+
+  router.limit(config.max_in_flight, config.queue_length);
+
+  log_info() << name << ": Opening listener on " << config.url();
+  http_listener listener {config.url()};
+  router.listen(listener);
+  listener.open().wait(); // Wait for listener to complete starting
+
+  wait_for_shutdown(name);
+
+  log_info() << name << ": Draining " << router.active_requests() << " requests";
+  router.stop_accepting();
+  if ( ! router.wait_until_idle(config.drain_timeout))
+    log_warning() << name << ": " << router.active_requests()
+                  << " requests still running after " << config.drain_timeout.count() << " ms";
+
+  // Shut it down
+  listener.close().wait();
+  log_info() << name << " closed";
+  flush_log();
+}
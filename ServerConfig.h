@@ -0,0 +1,134 @@
+#ifndef ServerConfig_h
+#define ServerConfig_h
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <pplx/pplxtasks.h>
+
+#include "Router.h"
+
+/*
+  Command-line configuration of a server and its lifetime
+
+  Every server accepts
+
+    --address HOST        Interface to listen on (default localhost)
+    --port N              Port to listen on (default: the server's own)
+    --threads N           Threads running task continuations; 0, the
+                          default, leaves pplx's own scheduler. Needs
+                          --max-in-flight, and is raised to
+                          pool_threads_needed() if below it
+    --drain-timeout MS    How long shutdown waits for requests already
+                          running (default 10000)
+    --max-in-flight N     Requests handled at once, 0, the default,
+                          for no limit; see Admission.h
+    --queue-length N      Requests that may wait for each class of
+                          operation (default 64)
+    --snapshot FILE       Where to keep a snapshot of the entity
+                          cache across restarts (default none); see
+                          Snapshot.h
+    --snapshot-interval S Seconds between snapshots (default 60)
+    --cache-ttl S         Seconds an entity stays in the entity
+                          cache (default 30); see EntityCache.h
+    --cache-bytes N       Most bytes the entity cache holds
+                          (default: the server's own)
+    --write-combine-ms MS How long a write waits for others to the
+                          same entity to combine with (default 0,
+                          no combining); see WriteCombiner.h. The
+                          first write sleeps out the window on its
+                          thread, so with --threads each write
+                          being combined holds a pool thread
+
+  either as "--port 8080" or "--port=8080". Any other arguments are
+  positional, and each server gives them its own meaning.
+
+  serve() runs the server until it gets SIGINT or SIGTERM or, when
+  standard input is a terminal, a carriage return. It then stops
+  accepting requests, which get ServiceUnavailable, waits up to the
+  drain timeout for those running to reply, and closes the
+  listener. A second signal during the drain exits at once.
+ */
+/*
+  Most tasks a handler starts and waits on at once, such as
+  BasicServer's concurrent reads of index matches. Each blocks a
+  thread while it waits on storage, as does the handler itself.
+ */
+constexpr std::size_t max_handler_tasks {16};
+
+struct ServerConfig {
+  std::string address;
+  unsigned port;
+  std::size_t threads;
+  std::chrono::milliseconds drain_timeout;
+  std::size_t max_in_flight;
+  std::size_t queue_length;
+  std::string snapshot; // Empty for none
+  std::chrono::seconds snapshot_interval;
+  std::chrono::seconds cache_ttl;
+  std::size_t cache_bytes; // 0 for the server's own default
+  std::chrono::milliseconds write_combine_window;
+  std::vector<std::string> arguments; // Positional arguments, in order
+
+  std::string url () const;
+};
+
+/*
+  Parse argv into config, defaulting the port to default_port
+
+  Returns false, having logged why, if an option is unknown or its
+  value is missing or bad.
+ */
+bool parse_server_config (int argc, char const * argv[], unsigned default_port, ServerConfig& config);
+
+/*
+  Threads a WorkerPool needs so that max_in_flight requests, each
+  waiting on max_handler_tasks tasks, still leave one thread free
+  to run the continuations that complete them
+ */
+std::size_t pool_threads_needed (std::size_t max_in_flight);
+
+/*
+  A fixed set of threads running the tasks pplx schedules
+
+  Handlers that wait on storage or on another server block a
+  thread while they wait, so the pool must have more threads than
+  requests that can be waiting at once, each with its own tasks.
+  Otherwise every thread can end up waiting on a task queued
+  behind it, and the server deadlocks.
+ */
+class WorkerPool : public pplx::scheduler_interface {
+private:
+  std::mutex lock;
+  std::condition_variable ready;
+  std::deque<std::pair<pplx::TaskProc_t,void*>> tasks;
+  bool stopping;
+  std::vector<std::thread> workers;
+
+  void run ();
+
+public:
+  explicit WorkerPool (std::size_t threads);
+  virtual ~WorkerPool ();
+
+  WorkerPool (const WorkerPool&) = delete;
+  WorkerPool& operator= (const WorkerPool&) = delete;
+
+  virtual void schedule (pplx::TaskProc_t proc, void* param) override;
+};
+
+/*
+  Apply config's threads and limits, listen on config.url() with
+  router's routes, and return once the server has shut down as
+  described above. name prefixes the messages logged.
+ */
+void serve (const ServerConfig& config, Router& router, const std::string& name);
+
+#endif
@@ -4,36 +4,144 @@
 
 #include "ServerUtils.h"
 
-#include <iostream>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <list>
 #include <string>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include <cpprest/asyncrt_utils.h>
+
+#include <pplx/pplxtasks.h>
+
 #include <was/table.h>
 
+#include "Logger.h"
+#include "Metrics.h"
+#include "TableStore.h"
+
 using azure::storage::cloud_table;
 using azure::storage::cloud_table_client;
 using azure::storage::entity_property;
+using azure::storage::query_comparison_operator;
+using azure::storage::query_logical_operator;
 using azure::storage::storage_credentials;
 using azure::storage::storage_exception;
 using azure::storage::table_entity;
 using azure::storage::table_operation;
+using azure::storage::table_query;
+using azure::storage::table_query_iterator;
 using azure::storage::table_result;
 
-using std::cout;
-using std::endl;
+using pplx::extensibility::critical_section_t;
+using pplx::extensibility::scoped_critical_section_t;
+
 using std::make_pair;
 using std::pair;
 using std::string;
 using std::unordered_map;
 using std::vector;
 
+using web::http::http_headers;
 using web::http::http_request;
 using web::http::status_code;
 using web::http::status_codes;
 using web::http::uri;
 
+using utility::datetime;
+
+/*
+  Table handles for SAS tokens, kept until the token expires
+
+  Building a cloud_table_client and table reference for every
+  request repeats the credential and endpoint setup and loses the
+  chance to reuse the client's connections. UserServer presents the
+  same token, good for a day, on every request for a user, so ready
+  handles are instead kept per (endpoint, token, table) until the
+  token's expiry time, its "se" parameter. A token whose expiry
+  cannot be read is kept for unparsed_lifetime; using a handle after
+  its token expired does no harm, as storage rejects the request.
+
+  At most max_tables handles are kept, dropping the least recently
+  used. An expired handle is dropped when it is next looked up.
+  The lock is held only to look up or insert, never while a handle
+  is built or used.
+ */
+namespace {
+  // In datetime intervals, units of 100 ns
+  const uint64_t unparsed_lifetime {datetime::from_seconds(60)};
+  constexpr std::size_t max_tables {1024};
+
+  struct cached_table_t {
+    cloud_table table;
+    uint64_t expires;
+    std::list<string>::iterator use; // This handle's place in table_lru
+  };
+
+  critical_section_t table_lock {};
+  std::unordered_map<string,cached_table_t> token_tables {};
+  std::list<string> table_lru {}; // Keys of token_tables, most recently used first
+
+  cloud_table token_table (const string& endpoint, const string& token, const string& name) {
+    const uint64_t now {datetime::utc_now().to_interval()};
+    // None of the parts of a request path can contain a newline
+    const string key {endpoint + "\n" + token + "\n" + name};
+    {
+      scoped_critical_section_t lock {table_lock};
+      auto found = token_tables.find(key);
+      if (found != token_tables.end()) {
+        if (now < found->second.expires) {
+          table_lru.splice(table_lru.begin(), table_lru, found->second.use);
+          return found->second.table;
+        }
+        table_lru.erase(found->second.use);
+        token_tables.erase(found);
+      }
+    }
+
+    cloud_table_client client {uri {endpoint}, storage_credentials {token}};
+    cloud_table table {client.get_table_reference(name)};
+    const uint64_t expires {sas_token_expiry(token)};
+
+    scoped_critical_section_t lock {table_lock};
+    auto found = token_tables.find(key);
+    if (found != token_tables.end()) {
+      // Another request built a handle for the same token meanwhile
+      table_lru.splice(table_lru.begin(), table_lru, found->second.use);
+      return found->second.table;
+    }
+    table_lru.push_front(key);
+    token_tables.emplace(key, cached_table_t {table, expires, table_lru.begin()});
+    if (token_tables.size() > max_tables) {
+      token_tables.erase(table_lru.back());
+      table_lru.pop_back();
+    }
+    return table;
+  }
+}
+
+/*
+  The token is itself a query string, so it may be encoded twice.
+ */
+uint64_t sas_token_expiry (const string& token) {
+  try {
+    string decoded {uri::decode(token)};
+    auto params = uri::split_query(decoded);
+    auto se = params.find("se");
+    if (se != params.end()) {
+      datetime expiry {datetime::from_string(uri::decode(se->second), datetime::ISO_8601)};
+      if (expiry.is_initialized())
+        return expiry.to_interval();
+    }
+  }
+  catch (const std::exception&) {
+  }
+  return datetime::utc_now().to_interval() + unparsed_lifetime;
+}
+
 /*
   Read from a table using a security token
 
@@ -45,12 +153,15 @@ using web::http::uri;
     "http://STORAGE.table.core.windows.net/", where STORAGE is
     replaced by the user's Azure Storage account name.
 
+  columns, if not empty, names the only properties to read.
+
   Returns a pair:
     first: HTTP status code from the read
     second: if the status code is OK, the entity read from the table
  */
 pair<status_code,table_entity> read_with_token (const http_request& message,
-                                                 const string& endpoint) {
+                                                 const string& endpoint,
+                                                 const vector<string>& columns) {
   /*
     Tokens can contain %2F ('/'). Thus we split the URI path
     *before* decoding and pass the undecoded values to Azure Storage
@@ -66,16 +177,35 @@ pair<status_code,table_entity> read_with_token (const http_request& message,
   const string partition {undecoded_paths[3]};
   const string row {undecoded_paths[4]};
 
+  static Histogram& read_time {server_metrics().dependency("storage", "read_with_token")};
+  ScopedTimer timer {read_time};
   try {
-    uri endpoint_uri {endpoint};
-    storage_credentials creds {token};
-    cloud_table_client client {endpoint_uri, creds};
+    cloud_table table_cred {token_table(endpoint, token, tname)};
+    if ( ! columns.empty()) {
+      // A point retrieve cannot select properties; query for the one entity
+      table_query query {};
+      query.set_filter_string(table_query::combine_filter_conditions(
+        table_query::generate_filter_condition("PartitionKey", query_comparison_operator::equal, uri::decode(partition)),
+        query_logical_operator::op_and,
+        table_query::generate_filter_condition("RowKey", query_comparison_operator::equal, uri::decode(row))));
+      query.set_select_columns(columns);
+      table_query_iterator end;
+      table_query_iterator it {table_cred.execute_query(query)};
+      if (it == end) {
+        log_debug() << "Not found";
+        return make_pair (status_codes::NotFound,
+                           table_entity{});
+      }
+      table_entity entity {*it};
+      select_properties(entity, columns);
+      return make_pair (status_codes::OK,
+                         entity);
+    }
 
     table_operation op {table_operation::retrieve_entity(partition, row)};
-    cloud_table table_cred {client.get_table_reference(tname)};
     table_result retrieve_result {table_cred.execute(op)};
     if (retrieve_result.http_status_code() == status_codes::NotFound) {
-      cout << "Not found" << endl;
+      log_debug() << "Not found";
       return make_pair (status_codes::NotFound,
                          table_entity{});
     }
@@ -84,8 +214,8 @@ pair<status_code,table_entity> read_with_token (const http_request& message,
                        entity);
   }
   catch (const storage_exception& e) {
-    cout << "Azure Table Storage error: " << e.what() << endl;
-    cout << e.result().extended_error().message() << endl;
+    log_error() << "Azure Table Storage error: " << e.what() << ": "
+                << e.result().extended_error().message();
     if (e.result().http_status_code() == status_codes::Forbidden)
       return make_pair (status_codes::Forbidden,
                          table_entity{});
@@ -108,6 +238,10 @@ pair<status_code,table_entity> read_with_token (const http_request& message,
   props is an unordered_map of properties to be merged into
     the entity. This will typically be the result of get_json_body().
 
+  If message has an If-Match header, the merge only succeeds if
+  the entity's ETag matches it, and otherwise returns
+  PreconditionFailed.
+
   Returns:  HTTP status code from the write.
  */
 status_code update_with_token (const http_request& message,
@@ -129,18 +263,20 @@ status_code update_with_token (const http_request& message,
   const string partition {undecoded_paths[3]};
   const string row {undecoded_paths[4]};
   table_entity entity {partition, row};
+  const http_headers& headers {message.headers()};
+  auto if_match (headers.find("If-Match"));
+  if (if_match != headers.end())
+    entity.set_etag(if_match->second);
+  static Histogram& update_time {server_metrics().dependency("storage", "update_with_token")};
+  ScopedTimer timer {update_time};
   try {
-    uri endpoint_uri {endpoint};
-    storage_credentials creds {token};
-    cloud_table_client client {endpoint_uri, creds};
-
     table_entity::properties_type& properties = entity.properties();
     for (const auto v : props) {
       properties[v.first] = entity_property {v.second};
     }
 
     table_operation op {table_operation::merge_entity(entity)};
-    cloud_table table_cred {client.get_table_reference(tname)};
+    cloud_table table_cred {token_table(endpoint, token, tname)};
     table_result update_result {table_cred.execute(op)};
     status_code status {static_cast<status_code> (update_result.http_status_code())};
     if (status == status_codes::NoContent || status == status_codes::OK)
@@ -150,11 +286,62 @@ status_code update_with_token (const http_request& message,
   }
   catch (const storage_exception& e)
   {
-    cout << "Azure Table Storage error: " << e.what() << endl;
-    cout << e.result().extended_error().message() << endl;
+    log_error() << "Azure Table Storage error: " << e.what() << ": "
+                << e.result().extended_error().message();
     if (e.result().http_status_code() == status_codes::Forbidden)
       return status_codes::Forbidden;
+    else if (e.result().http_status_code() == status_codes::PreconditionFailed)
+      return status_codes::PreconditionFailed;
     else
       return status_codes::InternalError;
   }
 }
+
+namespace {
+  string strong_part (const string& tag) {
+    string::size_type b {tag.find_first_not_of(" \t")};
+    if (b == string::npos)
+      return string {};
+    string::size_type e {tag.find_last_not_of(" \t")};
+    string t {tag.substr(b, e - b + 1)};
+    if (t.compare(0, 2, "W/") == 0)
+      t.erase(0, 2);
+    return t;
+  }
+}
+
+bool etag_matches (const string& header_value, const string& etag) {
+  const string target {strong_part(etag)};
+  bool quoted {false};
+  string::size_type start {0};
+  for (string::size_type i {0}; i <= header_value.size(); ++i) {
+    if (i < header_value.size()) {
+      if (header_value[i] == '"')
+        quoted = ! quoted;
+      if (quoted || header_value[i] != ',')
+        continue;
+    }
+    string tag {strong_part(header_value.substr(start, i - start))};
+    if (tag == "*" || ( ! target.empty() && tag == target))
+      return true;
+    start = i + 1;
+  }
+  return false;
+}
+
+PropertyFilter::PropertyFilter (const unordered_map<string,string>& json_body) :
+  required {}
+{
+  required.reserve(json_body.size());
+  for (const auto& p : json_body) {
+    required.push_back(p.first);
+  }
+}
+
+bool PropertyFilter::matches (const table_entity::properties_type& properties) const {
+  for (const auto& name : required) {
+    if (properties.find(name) == properties.end())
+      return false;
+  }
+  return true;
+}
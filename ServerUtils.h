@@ -1,8 +1,11 @@
 #ifndef ServerUtils_h
 #define ServerUtils_h
 
+#include <cstdint>
 #include <string>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include <cpprest/http_listener.h>
 
@@ -10,11 +13,47 @@
 
 std::pair<web::http::status_code,azure::storage::table_entity>
 read_with_token(const web::http::http_request& message,
-                const std::string& endpoint);
+                const std::string& endpoint,
+                const std::vector<std::string>& columns = std::vector<std::string> {});
 
 
 web::http::status_code
 update_with_token (const web::http::http_request& message,
                    const std::string& endpoint,
                    const std::unordered_map<std::string,std::string>& props);
+
+/*
+  When a SAS token as it appears in a request path expires, as a
+  utility::datetime interval: its "se" parameter, or a minute from
+  now if that cannot be read. Table handles built for the token
+  are kept until then.
+ */
+uint64_t sas_token_expiry (const std::string& token);
+
+/*
+  Return true if the value of an If-Match or If-None-Match header
+  names etag, or is "*"
+
+  The value is a comma-separated list of entity tags. Comparison
+  is weak: a W/ prefix on either side is ignored.
+ */
+bool etag_matches (const std::string& header_value, const std::string& etag);
+
+/*
+  Filter compiled from the JSON body of a ReadEntityAdmin table read
+
+  An entity matches when it has every property named in the body.
+  The body's values are ignored. The names are extracted once per
+  request so that each entity is tested with one hash lookup per
+  name, without converting its properties.
+ */
+class PropertyFilter {
+private:
+  std::vector<std::string> required;
+public:
+  explicit PropertyFilter (const std::unordered_map<std::string,std::string>& json_body);
+
+  bool matches (const azure::storage::table_entity::properties_type& properties) const;
+};
+
 #endif
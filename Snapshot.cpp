@@ -0,0 +1,337 @@
+/*
+ Entity snapshots, CMPT 276, Spring 2016.
+ */
+
+#include "Snapshot.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <was/table.h>
+
+#include "EntityCache.h"
+#include "Logger.h"
+#include "TableStore.h"
+
+using azure::storage::table_entity;
+
+using std::size_t;
+using std::string;
+using std::vector;
+
+namespace {
+  const string magic {"ESNAP001"};
+  constexpr size_t header_size {32};
+  constexpr size_t index_entry_size {24};
+
+  void put_u32 (string& out, uint32_t n) {
+    for (int i {0}; i < 4; ++i) {
+      out.push_back(static_cast<char> ((n >> (8 * i)) & 0xff));
+    }
+  }
+
+  void put_u64 (string& out, uint64_t n) {
+    for (int i {0}; i < 8; ++i) {
+      out.push_back(static_cast<char> ((n >> (8 * i)) & 0xff));
+    }
+  }
+
+  void put_str (string& out, const string& s) {
+    put_u32(out, static_cast<uint32_t> (s.size()));
+    out += s;
+  }
+
+  uint64_t load_le (const char* p, int bytes) {
+    uint64_t n {0};
+    for (int i {0}; i < bytes; ++i) {
+      n |= static_cast<uint64_t> (static_cast<unsigned char> (p[i])) << (8 * i);
+    }
+    return n;
+  }
+
+  /*
+    Reads the strings of one record, failing rather than running
+    past its end
+   */
+  class record_reader {
+  private:
+    const char* pos;
+    const char* end;
+
+  public:
+    record_reader (const char* record, size_t length) :
+      pos {record},
+      end {record + length}
+      {}
+
+    bool get_u32 (uint32_t& n) {
+      if (end - pos < 4)
+        return false;
+      n = static_cast<uint32_t> (load_le(pos, 4));
+      pos += 4;
+      return true;
+    }
+
+    bool get_char (char& c) {
+      if (pos == end)
+        return false;
+      c = *pos++;
+      return true;
+    }
+
+    bool get_str (string& s) {
+      uint32_t len {0};
+      if ( ! get_u32(len) || static_cast<size_t> (end - pos) < len)
+        return false;
+      s.assign(pos, len);
+      pos += len;
+      return true;
+    }
+  };
+
+  // Write all of data to fd, retrying short writes
+  bool write_all (int fd, const string& data) {
+    size_t done {0};
+    while (done < data.size()) {
+      ssize_t n {::write(fd, data.data() + done, data.size() - done)};
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      done += static_cast<size_t> (n);
+    }
+    return true;
+  }
+}
+
+EntitySnapshot::EntitySnapshot (const char* mapped, size_t mapped_length) :
+  base {mapped},
+  length {mapped_length},
+  count {load_le(mapped + 16, 8)},
+  written_at {std::chrono::system_clock::time_point {} +
+              std::chrono::seconds {static_cast<int64_t> (load_le(mapped + 8, 8))}}
+{}
+
+EntitySnapshot::~EntitySnapshot () {
+  ::munmap(const_cast<char*> (base), length);
+}
+
+uint64_t EntitySnapshot::get_u64 (size_t offset) const {
+  return load_le(base + offset, 8);
+}
+
+uint32_t EntitySnapshot::get_u32 (size_t offset) const {
+  return static_cast<uint32_t> (load_le(base + offset, 4));
+}
+
+bool EntitySnapshot::write (const string& path, vector<entry_t> entries) {
+  std::sort(entries.begin(), entries.end(),
+            [] (const entry_t& a, const entry_t& b) { return a.first < b.first; });
+
+  string records {};
+  vector<std::pair<uint64_t,uint32_t>> record_spans {};
+  record_spans.reserve(entries.size());
+  for (const auto& e : entries) {
+    const size_t start {records.size()};
+    put_str(records, e.second.partition_key());
+    put_str(records, e.second.row_key());
+    put_str(records, e.second.etag());
+    put_u32(records, static_cast<uint32_t> (e.second.properties().size()));
+    for (const auto& p : e.second.properties()) {
+      put_str(records, p.first);
+      records.push_back(property_type_code(p.second.property_type()));
+      put_str(records, property_text(p.second));
+    }
+    record_spans.emplace_back(start, static_cast<uint32_t> (records.size() - start));
+  }
+
+  size_t keys_size {0};
+  for (const auto& e : entries) {
+    keys_size += e.first.size();
+  }
+  const uint64_t keys_offset {header_size + index_entry_size * entries.size()};
+  const uint64_t records_offset {keys_offset + keys_size};
+  const uint64_t file_size {records_offset + records.size()};
+
+  string head {magic};
+  put_u64(head, static_cast<uint64_t> (std::chrono::duration_cast<std::chrono::seconds> (
+                  std::chrono::system_clock::now().time_since_epoch()).count()));
+  put_u64(head, entries.size());
+  put_u64(head, file_size);
+  uint64_t key_offset {keys_offset};
+  for (size_t i {0}; i < entries.size(); ++i) {
+    put_u64(head, key_offset);
+    put_u32(head, static_cast<uint32_t> (entries[i].first.size()));
+    put_u64(head, records_offset + record_spans[i].first);
+    put_u32(head, record_spans[i].second);
+    key_offset += entries[i].first.size();
+  }
+  for (const auto& e : entries) {
+    head += e.first;
+  }
+
+  const string temp {path + ".tmp"};
+  int fd {::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600)};
+  if (fd < 0) {
+    log_error() << "Cannot create snapshot " << temp << ": " << errno;
+    return false;
+  }
+  bool ok {write_all(fd, head) && write_all(fd, records) && ::fsync(fd) == 0};
+  ::close(fd);
+  if ( ! ok || std::rename(temp.c_str(), path.c_str()) != 0) {
+    log_error() << "Snapshot write error " << path << ": " << errno;
+    std::remove(temp.c_str());
+    return false;
+  }
+  return true;
+}
+
+std::unique_ptr<EntitySnapshot> EntitySnapshot::open (const string& path) {
+  int fd {::open(path.c_str(), O_RDONLY)};
+  if (fd < 0) {
+    if (errno != ENOENT)
+      log_error() << "Cannot open snapshot " << path << ": " << errno;
+    return nullptr;
+  }
+  struct stat st {};
+  if (::fstat(fd, &st) != 0 || st.st_size < static_cast<off_t> (header_size)) {
+    ::close(fd);
+    log_error() << "Snapshot " << path << " is truncated";
+    return nullptr;
+  }
+  const size_t size {static_cast<size_t> (st.st_size)};
+  void* mapped {::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0)};
+  ::close(fd); // The mapping outlives the descriptor
+  if (mapped == MAP_FAILED) {
+    log_error() << "Cannot map snapshot " << path << ": " << errno;
+    return nullptr;
+  }
+  std::unique_ptr<EntitySnapshot> snapshot {new EntitySnapshot {static_cast<const char*> (mapped), size}};
+
+  const char* base {snapshot->base};
+  bool ok {std::memcmp(base, magic.data(), magic.size()) == 0 &&
+           snapshot->get_u64(24) == size &&
+           snapshot->count <= (size - header_size) / index_entry_size};
+  for (size_t i {0}; ok && i < snapshot->size(); ++i) {
+    const size_t entry {header_size + i * index_entry_size};
+    const uint64_t key_offset {snapshot->get_u64(entry)};
+    const uint64_t key_length {snapshot->get_u32(entry + 8)};
+    const uint64_t record_offset {snapshot->get_u64(entry + 12)};
+    const uint64_t record_length {snapshot->get_u32(entry + 20)};
+    ok = key_offset <= size && key_length <= size - key_offset &&
+         record_offset <= size && record_length <= size - record_offset &&
+         (i == 0 || snapshot->key(i - 1) < snapshot->key(i));
+  }
+  if ( ! ok) {
+    log_error() << "Snapshot " << path << " is damaged or not a snapshot";
+    return nullptr;
+  }
+  return snapshot;
+}
+
+string EntitySnapshot::key (size_t i) const {
+  const size_t entry {header_size + i * index_entry_size};
+  return string (base + get_u64(entry), get_u32(entry + 8));
+}
+
+bool EntitySnapshot::record (size_t i, table_entity& entity) const {
+  const size_t entry {header_size + i * index_entry_size};
+  record_reader in {base + get_u64(entry + 12), get_u32(entry + 20)};
+  string partition {}, row {}, etag {};
+  uint32_t properties {0};
+  if ( ! in.get_str(partition) || ! in.get_str(row) || ! in.get_str(etag) ||
+       ! in.get_u32(properties))
+    return false;
+
+  table_entity e {partition, row};
+  e.set_etag(etag);
+  for (uint32_t p {0}; p < properties; ++p) {
+    string name {}, text {};
+    char code {0};
+    if ( ! in.get_str(name) || ! in.get_char(code) || ! in.get_str(text))
+      return false;
+    try {
+      e.properties()[name] = make_property(code, text);
+    }
+    catch (const std::exception&) {
+      return false;
+    }
+  }
+  entity = std::move(e);
+  return true;
+}
+
+bool EntitySnapshot::find (const string& key, table_entity& entity) const {
+  size_t low {0};
+  size_t high {size()};
+  while (low < high) {
+    const size_t mid {low + (high - low) / 2};
+    const size_t entry {header_size + mid * index_entry_size};
+    int order {key.compare(0, string::npos, base + get_u64(entry), get_u32(entry + 8))};
+    if (order == 0)
+      return record(mid, entity);
+    if (order < 0)
+      high = mid;
+    else
+      low = mid + 1;
+  }
+  return false;
+}
+
+constexpr std::chrono::minutes CacheSnapshotter::max_age;
+
+CacheSnapshotter::CacheSnapshotter (EntityCache& snapshot_cache, const string& snapshot_path,
+                                    std::chrono::seconds write_interval, EntityCache::reader_t reader) :
+  cache (snapshot_cache),
+  path {snapshot_path},
+  interval {write_interval},
+  read {reader},
+  stopping {false},
+  revalidated {false},
+  lock {},
+  stop_requested {},
+  worker {}
+{
+  cache.load_snapshot(path, max_age);
+  worker = std::thread {&CacheSnapshotter::run, this};
+}
+
+CacheSnapshotter::~CacheSnapshotter () {
+  {
+    std::lock_guard<std::mutex> l {lock};
+    stopping = true;
+  }
+  stop_requested.notify_all();
+  worker.join();
+  if (revalidated)
+    cache.write_snapshot(path);
+}
+
+void CacheSnapshotter::run () {
+  if ( ! cache.revalidate_snapshot(read, stopping))
+    return;
+  revalidated = true;
+  std::unique_lock<std::mutex> l {lock};
+  while ( ! stop_requested.wait_for(l, interval, [this] () { return stopping.load(); })) {
+    l.unlock();
+    cache.write_snapshot(path);
+    l.lock();
+  }
+}
@@ -0,0 +1,124 @@
+#ifndef Snapshot_h
+#define Snapshot_h
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <was/table.h>
+
+#include "EntityCache.h"
+
+/*
+  A read-only file of entities, looked up by key without parsing
+  it first
+
+  The file is mapped into memory, so opening it costs one mmap()
+  whatever its size, and a lookup touches only the pages it reads.
+
+  Format, all integers little-endian:
+
+    header   magic "ESNAP001", then 8-byte fields: the time it was
+             written (seconds since the epoch), the number of
+             entries and the file size
+    index    per entry, in ascending key order, 24 bytes: offset
+             and length of its key (8 + 4), then offset and length
+             of its record (8 + 4)
+    keys     the keys, back to back
+    records  per entry: partition key, row key, etag, property
+             count (4 bytes), then per property its name, type
+             code (1 byte, see property_type_code()) and value as
+             property_text() prints it
+
+  where each string in a record is a 4-byte length and its bytes.
+  open() checks the header and that every index entry lies within
+  the file, so a truncated or foreign file is refused rather than
+  read past its end.
+ */
+class EntitySnapshot {
+public:
+  using entry_t = std::pair<std::string,azure::storage::table_entity>;
+
+private:
+  const char* base;
+  std::size_t length;
+  uint64_t count;
+  std::chrono::system_clock::time_point written_at;
+
+  EntitySnapshot (const char* base, std::size_t length);
+
+  uint64_t get_u64 (std::size_t offset) const;
+  uint32_t get_u32 (std::size_t offset) const;
+  bool record (std::size_t i, azure::storage::table_entity& entity) const;
+
+public:
+  ~EntitySnapshot ();
+
+  EntitySnapshot (const EntitySnapshot&) = delete;
+  EntitySnapshot& operator= (const EntitySnapshot&) = delete;
+
+  /*
+    Write entries to path, replacing any file there only once the
+    new one is complete. The file is readable by its owner alone,
+    as entities may hold secrets such as passwords.
+
+    Returns false, having logged why, if it could not be written.
+   */
+  static bool write (const std::string& path, std::vector<entry_t> entries);
+
+  // The snapshot at path, or nullptr, having logged why, if there is none or it is bad
+  static std::unique_ptr<EntitySnapshot> open (const std::string& path);
+
+  std::size_t size () const { return static_cast<std::size_t> (count); }
+  std::chrono::system_clock::time_point written () const { return written_at; }
+
+  std::string key (std::size_t i) const;
+
+  // Sets entity and returns true if key is in the snapshot
+  bool find (const std::string& key, azure::storage::table_entity& entity) const;
+};
+
+/*
+  Keeps a snapshot of an EntityCache on disk for the next run
+
+  On construction, stands the snapshot at path behind the cache,
+  if there is one no older than max_age, and starts a thread that
+  revalidates it and then writes a fresh snapshot every interval.
+  Destruction stops the thread and writes a last snapshot, unless
+  revalidation had not finished, when the old one is left as is.
+ */
+class CacheSnapshotter {
+public:
+  static constexpr std::chrono::minutes max_age {10};
+
+private:
+  EntityCache& cache;
+  const std::string path;
+  const std::chrono::seconds interval;
+  const EntityCache::reader_t read;
+  std::atomic<bool> stopping;
+  std::atomic<bool> revalidated;
+  std::mutex lock;
+  std::condition_variable stop_requested;
+  std::thread worker;
+
+  void run ();
+
+public:
+  CacheSnapshotter (EntityCache& cache, const std::string& path, std::chrono::seconds interval,
+                    EntityCache::reader_t read);
+  ~CacheSnapshotter ();
+
+  CacheSnapshotter (const CacheSnapshotter&) = delete;
+  CacheSnapshotter& operator= (const CacheSnapshotter&) = delete;
+};
+
+#endif
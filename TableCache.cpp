@@ -1,42 +1,252 @@
 #include "TableCache.h"
 
 #include <cassert>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
 
 #include <was/storage_account.h>
 #include <was/table.h>
 
+#include "AzureTableStore.h"
+#include "LocalTableStore.h"
+#include "Metrics.h"
+
 using azure::storage::cloud_storage_account;
 using azure::storage::cloud_table;
 using azure::storage::cloud_table_client;
 using azure::storage::storage_uri;
+using azure::storage::table_entity;
 
 using pplx::extensibility::critical_section_t;
 using pplx::extensibility::scoped_critical_section_t;
 
+using std::shared_ptr;
 using std::string;
+using std::vector;
+
+using web::http::status_code;
+using web::http::status_codes;
 
 using web::http::uri;
 
-using cache_t = std::unordered_map<string,cloud_table>;
+const string local_store_key {"LocalStoreDirectory="};
+
+namespace {
+  // Time taken by each kind of storage call, looked up once
+  struct storage_times {
+    Histogram& exists;
+    Histogram& create;
+    Histogram& remove_table;
+    Histogram& retrieve;
+    Histogram& insert_or_merge;
+    Histogram& merge;
+    Histogram& remove;
+    Histogram& batch;
+    Histogram& query;
+    Histogram& sign;
+  };
+
+  const storage_times& storage_time () {
+    static const storage_times times {
+      server_metrics().dependency("storage", "exists"),
+      server_metrics().dependency("storage", "create_table"),
+      server_metrics().dependency("storage", "delete_table"),
+      server_metrics().dependency("storage", "retrieve"),
+      server_metrics().dependency("storage", "insert_or_merge"),
+      server_metrics().dependency("storage", "merge"),
+      server_metrics().dependency("storage", "remove"),
+      server_metrics().dependency("storage", "execute_batch"),
+      server_metrics().dependency("storage", "query"),
+      server_metrics().dependency("storage", "shared_access_signature")
+    };
+    return times;
+  }
+
+  /*
+    A store that times every call to the one it wraps
+
+    A query's time includes its visitor's, since the backends call
+    the visitor as each storage page arrives.
+   */
+  class TimedTableStore : public TableStore {
+  private:
+    shared_ptr<TableStore> store;
+
+  public:
+    explicit TimedTableStore (shared_ptr<TableStore> wrapped) : store {wrapped} {}
 
-cloud_table TableCache::lookup_table(const string& table_name) {
-  assert (client.base_uri ().path() != "");
+    bool exists () override {
+      ScopedTimer timer {storage_time().exists};
+      return store->exists();
+    }
+    bool create_if_not_exists () override {
+      ScopedTimer timer {storage_time().create};
+      return store->create_if_not_exists();
+    }
+    bool delete_table () override {
+      ScopedTimer timer {storage_time().remove_table};
+      return store->delete_table();
+    }
+    status_code retrieve (const string& partition, const string& row,
+                          azure::storage::table_entity& entity) override {
+      ScopedTimer timer {storage_time().retrieve};
+      return store->retrieve(partition, row, entity);
+    }
+    status_code retrieve (const string& partition, const string& row, const vector<string>& columns,
+                          azure::storage::table_entity& entity) override {
+      ScopedTimer timer {storage_time().retrieve};
+      return store->retrieve(partition, row, columns, entity);
+    }
+    status_code insert_or_merge (const azure::storage::table_entity& entity) override {
+      ScopedTimer timer {storage_time().insert_or_merge};
+      return store->insert_or_merge(entity);
+    }
+    status_code merge (const azure::storage::table_entity& entity) override {
+      ScopedTimer timer {storage_time().merge};
+      return store->merge(entity);
+    }
+    status_code remove (const string& partition, const string& row) override {
+      ScopedTimer timer {storage_time().remove};
+      return store->remove(partition, row);
+    }
+    status_code execute_batch (const vector<batch_write>& writes) override {
+      ScopedTimer timer {storage_time().batch};
+      return store->execute_batch(writes);
+    }
+    string query (const table_range& range, const entity_visitor_t& visit) override {
+      ScopedTimer timer {storage_time().query};
+      return store->query(range, visit);
+    }
+    string shared_access_signature (const azure::storage::table_shared_access_policy& policy,
+                                    const string& partition, const string& row) override {
+      ScopedTimer timer {storage_time().sign};
+      return store->shared_access_signature(policy, partition, row);
+    }
+  };
+}
+
+/*
+  Calling init() again with the same connection string keeps the
+  client and the open tables.
+ */
+void TableCache::init(const string& connection) {
   scoped_critical_section_t lock {resplock};
+  if (initialized && connection == connection_string)
+    return;
+  initialized = true;
+  connection_string = connection;
+  table_cache.clear();
+  if (connection.compare(0, local_store_key.size(), local_store_key) == 0) {
+    local_directory = connection.substr(local_store_key.size());
+    ::mkdir(local_directory.c_str(), 0755);
+  }
+  else {
+    local_directory.clear();
+    account = cloud_storage_account::parse(connection);
+    client = account.create_cloud_table_client();
+  }
+}
 
+constexpr std::chrono::seconds TableCache::exists_ttl;
+constexpr std::chrono::seconds TableCache::missing_ttl;
+
+/*
+  Find or open the entry for table_name
+
+  Caller must hold resplock.
+ */
+TableCache::entry_t& TableCache::find_entry(const string& table_name) {
   auto entry (table_cache.find(table_name));
   if (entry == table_cache.end()) {
-      cloud_table table {client.get_table_reference(table_name)};
-      table_cache[table_name] = table;
-      return table;
+    shared_ptr<TableStore> table {};
+    if (local_directory.empty()) {
+      assert (client.base_uri ().path() != "");
+      table = std::make_shared<AzureTableStore> (client.get_table_reference(table_name));
+    }
+    else {
+      table = std::make_shared<LocalTableStore> (local_directory + "/" + table_name + ".log");
+    }
+    table = std::make_shared<TimedTableStore> (table);
+    entry = table_cache.emplace(table_name,
+                                entry_t {table, existence::unknown, clock_t::time_point {}, 0}).first;
   }
   return entry->second;
 }
 
-bool TableCache::delete_entry(const string& table_name) {
+shared_ptr<TableStore> TableCache::lookup_table(const string& table_name) {
   scoped_critical_section_t lock {resplock};
+  return find_entry(table_name).store;
+}
 
-  cache_t::size_type count {table_cache.erase(table_name)};
-  return count == 1;
+shared_ptr<TableStore> TableCache::lookup_table(const string& table_name, bool& exists) {
+  shared_ptr<TableStore> table {};
+  uint64_t generation {0};
+  {
+    scoped_critical_section_t lock {resplock};
+    entry_t& entry (find_entry(table_name));
+    if (entry.state != existence::unknown && clock_t::now() < entry.expires) {
+      exists = entry.state == existence::present;
+      return entry.store;
+    }
+    table = entry.store;
+    generation = entry.generation;
+  }
+
+  // Ask the store without holding the lock, so other tables are not held up
+  exists = table->exists();
+
+  scoped_critical_section_t lock {resplock};
+  auto entry (table_cache.find(table_name));
+  // Don't overwrite a create or delete that finished while we were asking
+  if (entry != table_cache.end() && entry->second.generation == generation) {
+    entry->second.state = exists ? existence::present : existence::missing;
+    entry->second.expires = clock_t::now() + (exists ? exists_ttl : missing_ttl);
+    ++entry->second.generation;
+  }
+  return table;
+}
+
+status_code TableCache::retrieve(const string& table_name, const string& partition,
+                                const string& row, table_entity& entity) {
+  bool exists {false};
+  shared_ptr<TableStore> table {lookup_table(table_name, exists)};
+  if ( ! exists)
+    return status_codes::NotFound;
+  return table->retrieve(partition, row, entity);
+}
+
+void TableCache::set_state(const string& table_name, existence state) {
+  scoped_critical_section_t lock {resplock};
+  entry_t& entry (find_entry(table_name));
+  entry.state = state;
+  entry.expires = clock_t::now() + (state == existence::present ? exists_ttl : missing_ttl);
+  ++entry.generation;
+}
+
+void TableCache::table_created(const string& table_name) {
+  set_state(table_name, existence::present);
+}
+
+void TableCache::table_deleted(const string& table_name) {
+  set_state(table_name, existence::missing);
+}
+
+bool TableCache::valid_table_name(const string& table_name) {
+  if (table_name.size() < 3 || table_name.size() > 63)
+    return false;
+  if ( ! std::isalpha(static_cast<unsigned char> (table_name[0])))
+    return false;
+  for (char c : table_name) {
+    if ( ! std::isalnum(static_cast<unsigned char> (c)))
+      return false;
+  }
+  return true;
 }
@@ -1,6 +1,9 @@
 #ifndef TableCache_h
 #define TableCache_h
 
+#include <chrono>
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <unordered_map>
 
@@ -9,27 +12,96 @@
 #include <was/storage_account.h>
 #include <was/table.h>
 
+#include "TableStore.h"
+
+/*
+  Cache of opened tables and of whether they exist
+
+  init() chooses where tables are kept. The connection string is
+  either an Azure Storage connection string or
+
+    LocalStoreDirectory=DIR
+
+  which keeps each table as a LocalTableStore log in DIR. All Azure
+  tables share one cloud_table_client, so connection setup is done
+  once rather than per request.
+
+  Asking the store whether a table exists costs a round trip, so
+  the answer is remembered: for exists_ttl if the table exists and
+  for the much shorter missing_ttl if it does not. Tables created
+  or deleted through this process update the answer at once; the
+  TTLs only bound how long a change made by another process goes
+  unnoticed.
+
+  Every store handed out is timed: each call is recorded in
+  server_metrics() as a "storage" dependency named by the call.
+ */
 class TableCache {
+public:
+  using clock_t = std::chrono::steady_clock;
+
+  static constexpr std::chrono::seconds exists_ttl {60};
+  static constexpr std::chrono::seconds missing_ttl {1};
+
 private:
+  enum class existence {unknown, present, missing};
+
+  struct entry_t {
+    std::shared_ptr<TableStore> store;
+    existence state;
+    clock_t::time_point expires;
+    uint64_t generation; // Incremented whenever state is set
+  };
+
+  bool initialized;
+  std::string connection_string;
   azure::storage::cloud_storage_account account;
   azure::storage::cloud_table_client client;
-  std::unordered_map<std::string,azure::storage::cloud_table> table_cache;
+  std::string local_directory;
+  std::unordered_map<std::string,entry_t> table_cache;
   pplx::extensibility::critical_section_t resplock;
+
+  entry_t& find_entry(const std::string& table_name);
+  void set_state(const std::string& table_name, existence state);
 public:
   TableCache () : 
+    initialized {false},
+    connection_string {},
     account {},
     client {},
+    local_directory {},
     table_cache {},
     resplock {}
     {};
 
-  void init(const std::string& connection) {
-    account  = azure::storage::cloud_storage_account::parse(connection);
-    client = account.create_cloud_table_client();
-  };
+  void init(const std::string& connection);
+
+  /*
+    Return the store for table_name. The second form also sets
+    exists, asking the store only if the cached answer has expired.
+   */
+  std::shared_ptr<TableStore> lookup_table(const std::string& table_name);
+  std::shared_ptr<TableStore> lookup_table(const std::string& table_name, bool& exists);
+
+  /*
+    Read one entity of table_name straight from its store, bypassing
+    any entity cache, as a snapshot is revalidated. Returns NotFound
+    if the table does not exist.
+   */
+  web::http::status_code retrieve(const std::string& table_name, const std::string& partition,
+                                  const std::string& row, azure::storage::table_entity& entity);
+
+  // Record that this process has created or deleted table_name
+  void table_created(const std::string& table_name);
+  void table_deleted(const std::string& table_name);
+
 
-  azure::storage::cloud_table lookup_table(const std::string& table_name);
-  bool delete_entry(const std::string& table_name);
+  /*
+    Whether table_name is a valid Azure table name: 3 to 63
+    letters and digits, starting with a letter. Only such names are
+    safe to use as a LocalTableStore file name.
+   */
+  static bool valid_table_name(const std::string& table_name);
 };
 
 #endif
@@ -0,0 +1,84 @@
+#include "TableStore.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <cpprest/asyncrt_utils.h>
+
+#include <was/table.h>
+
+using azure::storage::edm_type;
+using azure::storage::entity_property;
+
+using std::string;
+using std::vector;
+
+constexpr std::size_t TableStore::max_batch_size;
+
+void select_properties (azure::storage::table_entity& entity, const vector<string>& columns) {
+  if (columns.empty())
+    return;
+  auto& properties = entity.properties();
+  for (auto it = properties.begin(); it != properties.end();) {
+    if (std::find(columns.begin(), columns.end(), it->first) == columns.end())
+      it = properties.erase(it);
+    else
+      ++it;
+  }
+}
+
+string encode_continuation (const string& marker) {
+  if (marker.empty())
+    return string {};
+  string s {utility::conversions::to_base64(vector<unsigned char> (marker.begin(), marker.end()))};
+  while ( ! s.empty() && s.back() == '=')
+    s.pop_back();
+  std::replace(s.begin(), s.end(), '+', '-');
+  std::replace(s.begin(), s.end(), '/', '_');
+  return s;
+}
+
+string decode_continuation (string s) {
+  if (s.empty())
+    return string {};
+  std::replace(s.begin(), s.end(), '-', '+');
+  std::replace(s.begin(), s.end(), '_', '/');
+  while (s.size() % 4 != 0)
+    s.push_back('=');
+  vector<unsigned char> marker {utility::conversions::from_base64(s)};
+  return string (marker.begin(), marker.end());
+}
+
+char property_type_code (edm_type type) {
+  switch (type) {
+  case edm_type::boolean: return 'b';
+  case edm_type::int32: return 'i';
+  case edm_type::int64: return 'l';
+  case edm_type::double_floating_point: return 'd';
+  case edm_type::datetime: return 't';
+  case edm_type::guid: return 'g';
+  case edm_type::binary: return 'x';
+  default: return 's';
+  }
+}
+
+string property_text (const entity_property& property) {
+  return property.property_type() == edm_type::string ?
+    property.string_value() : property.str();
+}
+
+entity_property make_property (char code, const string& text) {
+  switch (code) {
+  case 'b': return entity_property {text == "true"};
+  case 'i': return entity_property {static_cast<int32_t> (std::stol(text))};
+  case 'l': return entity_property {static_cast<int64_t> (std::stoll(text))};
+  case 'd': return entity_property {std::stod(text)};
+  case 't': return entity_property {utility::datetime::from_string(text, utility::datetime::ISO_8601)};
+  case 'g': return entity_property {utility::string_to_uuid(text)};
+  case 'x': return entity_property {utility::conversions::from_base64(text)};
+  default: return entity_property {text};
+  }
+}
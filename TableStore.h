@@ -0,0 +1,135 @@
+#ifndef TableStore_h
+#define TableStore_h
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <cpprest/http_msg.h>
+
+#include <was/table.h>
+
+/*
+  Entities to read in one TableStore::query
+
+  partition: if not empty, read only this partition
+  take: read at most this many entities; 0 or less reads them all
+  continuation: if not empty, resume where an earlier query with
+    the same partition stopped
+  columns: if not empty, read only these properties of each entity
+  first_partition, end_partition: if partition is empty, read only
+    the partitions from first_partition up to but not including
+    end_partition; either may be empty for no bound
+ */
+struct table_range {
+  std::string partition;
+  int take;
+  std::string continuation;
+  std::vector<std::string> columns;
+  std::string first_partition;
+  std::string end_partition;
+};
+
+/*
+  One write in a TableStore::execute_batch: an insert-or-merge of
+  entity or, if remove is true, a delete of it
+ */
+struct batch_write {
+  bool remove;
+  azure::storage::table_entity entity;
+};
+
+// Called once for each entity read by TableStore::query
+using entity_visitor_t = std::function<void (const azure::storage::table_entity&)>;
+
+/*
+  One table, independent of where it is stored
+
+  Entity operations return OK on success, NotFound if the entity
+  (or table) does not exist, and otherwise the status the backend
+  reported. They do not throw for storage errors.
+
+  merge() is conditional on the entity's ETag: unless entity.etag()
+  is empty or "*", it returns PreconditionFailed if the stored
+  entity's ETag differs. insert_or_merge() ignores the ETag.
+
+  query() visits entities in (partition, row) order and returns the
+  continuation for the next page, or the empty string when there
+  are no more. Because a query may already have visited entities,
+  it throws std::exception for storage errors, and also if
+  range.continuation was not returned by an earlier query on the
+  same store.
+
+  execute_batch() applies up to max_batch_size writes, all in one
+  partition and each to a different row, as a single transaction:
+  it returns OK if every write was applied, and otherwise the
+  status of the failure, in which case none was. Deleting an
+  entity that does not exist fails the batch with NotFound.
+ */
+class TableStore {
+public:
+  static constexpr std::size_t max_batch_size {100};
+
+  virtual ~TableStore () {}
+
+  virtual bool exists () = 0;
+  virtual bool create_if_not_exists () = 0;
+  virtual bool delete_table () = 0;
+
+  virtual web::http::status_code retrieve (const std::string& partition,
+                                           const std::string& row,
+                                           azure::storage::table_entity& entity) = 0;
+  // As above, reading only the properties named in columns, or all if it is empty
+  virtual web::http::status_code retrieve (const std::string& partition,
+                                           const std::string& row,
+                                           const std::vector<std::string>& columns,
+                                           azure::storage::table_entity& entity) = 0;
+  virtual web::http::status_code insert_or_merge (const azure::storage::table_entity& entity) = 0;
+  virtual web::http::status_code merge (const azure::storage::table_entity& entity) = 0;
+  virtual web::http::status_code remove (const std::string& partition,
+                                         const std::string& row) = 0;
+
+  virtual web::http::status_code execute_batch (const std::vector<batch_write>& writes) = 0;
+
+  virtual std::string query (const table_range& range, const entity_visitor_t& visit) = 0;
+
+  /*
+    Shared access signature for the single entity (partition, row),
+    or the empty string if this store cannot issue one.
+   */
+  virtual std::string shared_access_signature (const azure::storage::table_shared_access_policy& policy,
+                                               const std::string& partition,
+                                               const std::string& row) = 0;
+};
+
+/*
+  Remove from entity every property not named in columns, unless
+  columns is empty
+ */
+void select_properties (azure::storage::table_entity& entity,
+                        const std::vector<std::string>& columns);
+
+/*
+  Convert a backend's resume position to the opaque continuation
+  string handed to clients, and back.
+
+  The string is URL-safe base64 without padding, so clients can
+  pass it in a query string without escaping it.
+ */
+std::string encode_continuation (const std::string& marker);
+std::string decode_continuation (std::string s);
+
+/*
+  A property as a one-byte type code and its value as text, the
+  form in which table logs and cache snapshots store it, and back.
+
+  The codes are b(oolean), i(nt32), l(int64), d(ouble), t(datetime),
+  g(uid), x (binary, in base64) and s(tring). make_property() throws
+  std::exception if text is not a value of the type.
+ */
+char property_type_code (azure::storage::edm_type type);
+std::string property_text (const azure::storage::entity_property& property);
+azure::storage::entity_property make_property (char code, const std::string& text);
+
+#endif
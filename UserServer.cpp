@@ -2,17 +2,19 @@
  User Server code for CMPT 276, Spring 2016.
  */
 
-#include <iostream>
+#include <functional>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
-#include <cpprest/http_listener.h>
 #include <cpprest/json.h>
 
 #include <was/common.h>
 #include <was/table.h>
 
+#include "Logger.h"
+#include "Router.h"
+#include "ServerConfig.h"
 #include "TableCache.h"
 #include "make_unique.h"
 #include "ClientUtils.h"
@@ -29,10 +31,6 @@ using azure::storage::table_request_options;
 using azure::storage::table_result;
 using azure::storage::table_shared_access_policy;
 
-using std::cin;
-using std::cout;
-using std::endl;
-using std::getline;
 using std::make_pair;
 using std::pair;
 using std::string;
@@ -51,15 +49,17 @@ using web::http::uri;
 
 using web::json::value;
 
-using web::http::experimental::listener::http_listener;
 
 using prop_str_vals_t = vector<pair<string,string>>;
 
-constexpr const char* def_url = "http://localhost:34572";
+constexpr unsigned def_port {34572};
 const string auth_addr {"http://localhost:34570/"};
 const string push_addr {"http://localhost:34574/"};
 const string addr {"http://localhost:34568/"};
 
+// Attempts at a Friends update that loses a race with another update
+constexpr int max_friend_attempts {8};
+
 const string sign_on {"SignOn"};
 const string sign_off {"SignOff"};
 const string add_friend {"AddFriend"};
@@ -105,6 +105,74 @@ int put_entity(const string& addr, const string& table, const string& partition,
   return result.first;
 }
 
+/*
+  Apply change to the Friends list in a user's DataTable entity
+
+  The entity is read with its ETag and written back with If-Match,
+  so concurrent changes to one user's friends need no lock: a change
+  that loses the race gets 412 Precondition Failed, re-reads the
+  list and tries again, up to max_friend_attempts times.
+
+  change edits the list and returns false if it need not be written.
+
+  Returns the status code to reply with. For ServiceUnavailable,
+  downstream is set to the headers it came with.
+ */
+status_code update_friends (const string& token, const string& partition, const string& row,
+                            const std::function<bool (friends_list_t&)>& change,
+                            http_headers& downstream) {
+  const string entity_uri {string(addr)
+                           + read_entity_auth + "/"
+                           + data_table_name + "/"
+                           + token + "/"
+                           + partition + "/"
+                           + row};
+  const string update_uri {string(addr)
+                           + update_entity_auth + "/"
+                           + data_table_name + "/"
+                           + token + "/"
+                           + partition + "/"
+                           + row};
+  for (int attempt {0}; attempt < max_friend_attempts; ++attempt) {
+    http_headers resp_headers {};
+    pair<status_code,value> get_entity {
+      do_request(methods::GET, entity_uri + "?$select=Friends", value {},
+                 vector<pair<string,string>> {}, resp_headers)
+    };
+    if (get_entity.first == status_codes::ServiceUnavailable) {
+      downstream = resp_headers;
+      return status_codes::ServiceUnavailable;
+    }
+    if (get_entity.first != status_codes::OK)
+      return status_codes::NotFound;
+
+    friends_list_t friendslist_vec = parse_friends_list(get_json_object_prop(get_entity.second, "Friends"));
+    if ( ! change(friendslist_vec))
+      return status_codes::OK;
+
+    vector<pair<string,string>> req_headers {};
+    auto etag (resp_headers.find("ETag"));
+    if (etag != resp_headers.end())
+      req_headers.push_back(make_pair("If-Match", etag->second));
+    http_headers put_headers {};
+    pair<status_code,value> merge_friends {
+      do_request(methods::PUT, update_uri,
+                 build_json_value("Friends", friends_list_to_string(friendslist_vec)),
+                 req_headers, put_headers)
+    };
+    if (merge_friends.first == status_codes::OK)
+      return status_codes::OK;
+    if (merge_friends.first == status_codes::ServiceUnavailable) {
+      downstream = put_headers;
+      return status_codes::ServiceUnavailable;
+    }
+    if (merge_friends.first != status_codes::PreconditionFailed)
+      return status_codes::NotFound;
+    log_info() << "Friends changed concurrently; retrying";
+  }
+  return status_codes::Conflict;
+}
+
 /*
   Given an HTTP message with a JSON body, return the JSON
   body as an unordered map of strings to strings.
@@ -149,16 +217,19 @@ unordered_map<string,string> get_json_body(http_request message) {
   return results;
 }
 
-pair<status_code,value> get_update_data(const string& addr,  const string& userid, const string& password) {
+pair<status_code,value> get_update_data(const string& addr,  const string& userid, const string& password,
+                                        http_headers& resp_headers) {
   value pwd {build_json_value (vector<pair<string,string>> {make_pair("Password", password)})};
   pair<status_code,value> result {do_request (methods::GET,
                                               addr +
                                               get_update_data_op + "/" +
                                               userid,
-                                              pwd
+                                              pwd,
+                                              vector<pair<string,string>> {},
+                                              resp_headers
                                               )
   };
-  //cout << "data: " << result.second << endl;
+  //log_info() << "data: " << result.second;
   if (result.first != status_codes::OK) {
     return make_pair (result.first, value {});
   }
@@ -168,472 +239,420 @@ pair<status_code,value> get_update_data(const string& addr,  const string& useri
 }
 
 /*
-  Top-level routine for processing all HTTP GET requests.
+  ReadFriendList/USERID (GET)
  */
-void handle_get(http_request message) { 
-  string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** GET " << path << endl;
-  auto paths = uri::split_path(path);
-
-  //No operation
-  if (paths.size() < 1) {
-    message.reply(status_codes::BadRequest);
-    return;
-  }
-
-  if (paths[0] == read_friend_list) {
-    //No userid
-    if (paths.size() < 2) {
-      message.reply(status_codes::BadRequest);
-      return;
-    }
-    string uid = paths[1];
-
-    if (session.size() > 0) {
-      for (auto it = session.begin(); it != session.end();) {
-        if (it->first == uid) {
-          cout << "userid was valid" << endl;
-          string token = get<0>(it->second);
-          string partition = get<1>(it->second);
-          string row = get<2>(it->second);
-
-          //Entity is returned
-          pair<status_code,value> result {
-            do_request(methods::GET,
-                      string(addr)
-                      + read_entity_auth + "/"
-                      + data_table_name + "/"
-                      + token + "/"
-                      + partition + "/"
-                      + row)
-          };
-          if (result.first != status_codes::OK) {
-            message.reply(status_codes::NotFound);
-            return;
-          }
-
-          string friendslist = get_json_object_prop(result.second, "Friends");
-          value body = build_json_value("Friends", friendslist);
+void read_friend_list_op (http_request message, const vector<string>& paths) {
+  string uid = paths[1];
 
-          message.reply(status_codes::OK, body);
+  if (session.size() > 0) {
+    for (auto it = session.begin(); it != session.end();) {
+      if (it->first == uid) {
+        log_debug() << "userid was valid";
+        string token = get<0>(it->second);
+        string partition = get<1>(it->second);
+        string row = get<2>(it->second);
+
+        //Only the Friends property is returned, not the Updates history
+        http_headers resp_headers {};
+        pair<status_code,value> result {
+          do_request(methods::GET,
+                    string(addr)
+                    + read_entity_auth + "/"
+                    + data_table_name + "/"
+                    + token + "/"
+                    + partition + "/"
+                    + row
+                    + "?$select=Friends",
+                    value {},
+                    vector<pair<string,string>> {},
+                    resp_headers)
+        };
+        if (result.first == status_codes::ServiceUnavailable) {
+          reply_unavailable(message, resp_headers);
           return;
         }
-        else {
-          ++it;
+        if (result.first != status_codes::OK) {
+          message.reply(status_codes::NotFound);
+          return;
         }
+
+        string friendslist = get_json_object_prop(result.second, "Friends");
+        value body = build_json_value("Friends", friendslist);
+
+        message.reply(status_codes::OK, body);
+        return;
+      }
+      else {
+        ++it;
       }
-      //uid did not have an active session
-      message.reply(status_codes::Forbidden);
-      return;
-    }
-    else {
-      message.reply(status_codes::Forbidden);
-      return;
     }
-
+    //uid did not have an active session
+    message.reply(status_codes::Forbidden);
+    return;
+  }
+  else {
+    message.reply(status_codes::Forbidden);
+    return;
   }
-
-  message.reply(status_codes::BadRequest);
-  return;
 }
 
 /*
-  Top-level routine for processing all HTTP POST requests.
+  SignOn/USERID (POST), with the password in the JSON body
  */
-void handle_post(http_request message) {
-
+void sign_on_op (http_request message, const vector<string>& paths) {
   unordered_map<string,string> json_body {get_json_body(message)};
 
-  string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** POST " << path << endl;
-  auto paths = uri::split_path(path);
-
-  //No operation and userid, or more parameters than needed
-  if (paths.size() != 2) {
+  //Nothing in JSON body
+  if (json_body.size() < 1) {
     message.reply(status_codes::NotFound);
     return;
   }
 
-  //Sign the person on
-  if (paths[0] == sign_on) {
-    //Nothing in JSON body
-    if (json_body.size() < 1) {
-      message.reply(status_codes::NotFound);
-      return;
-    }
-
-    string pass = json_body[auth_table_password_prop];
-    string uid = paths[1];
+  string pass = json_body[auth_table_password_prop];
+  string uid = paths[1];
 
-    cout << "**** SignOn " << uid << " " << pass << endl;
+  log_info() << "**** SignOn " << uid; // Never the password
 
-    //cout << "Requesting token and data" << endl;
-    pair<status_code, value> token_res {
-      get_update_data(auth_addr,
-                      uid,
-                      pass)
-    };
-    if (token_res.first != status_codes::OK) {
-      message.reply(status_codes::NotFound);
-      cout << "SignOn unsuccessful" << endl;
-      return;
-    }
+  //log_info() << "Requesting token and data";
+  http_headers auth_headers {};
+  pair<status_code, value> token_res {
+    get_update_data(auth_addr,
+                    uid,
+                    pass,
+                    auth_headers)
+  };
+  if (token_res.first == status_codes::ServiceUnavailable) {
+    reply_unavailable(message, auth_headers);
+    log_info() << "SignOn shed by AuthServer";
+    return;
+  }
+  if (token_res.first != status_codes::OK) {
+    message.reply(status_codes::NotFound);
+    log_info() << "SignOn unsuccessful";
+    return;
+  }
 
-    //Checks to see if already signed on
-    if (session.size() > 0) {
-      for (auto it = session.begin(); it != session.end();) {
-        if (it->first == uid) {
-          message.reply(status_codes::OK);
-          cout << "Already signed in" << endl;
-          return;
-        }
-        else {
-          ++it;
-        }
+  //Checks to see if already signed on
+  if (session.size() > 0) {
+    for (auto it = session.begin(); it != session.end();) {
+      if (it->first == uid) {
+        message.reply(status_codes::OK);
+        log_info() << "Already signed in";
+        return;
+      }
+      else {
+        ++it;
       }
     }
+  }
 
-    string DataRow_val = get_json_object_prop(token_res.second, "DataRow");
-    string DataPartition_val = get_json_object_prop(token_res.second, "DataPartition");
-    string token_val = get_json_object_prop(token_res.second, "token");
-
-    pair<status_code,value> result {
-      do_request (methods::GET,
-                  string(addr)
-                  + read_entity_auth + "/"
-                  + data_table_name + "/"
-                  + token_val + "/"
-                  + DataPartition_val + "/"
-                  + DataRow_val
-      )
-    };
+  string DataRow_val = get_json_object_prop(token_res.second, "DataRow");
+  string DataPartition_val = get_json_object_prop(token_res.second, "DataPartition");
+  string token_val = get_json_object_prop(token_res.second, "token");
 
-    if (status_codes::OK == result.first) {
+  http_headers resp_headers {};
+  pair<status_code,value> result {
+    do_request (methods::GET,
+                string(addr)
+                + read_entity_auth + "/"
+                + data_table_name + "/"
+                + token_val + "/"
+                + DataPartition_val + "/"
+                + DataRow_val,
+                value {},
+                vector<pair<string,string>> {},
+                resp_headers
+    )
+  };
 
-      tuple<string,string,string> data = make_tuple(token_val, DataPartition_val, DataRow_val);
-      session.insert({uid, data});
+  if (status_codes::OK == result.first) {
 
+    tuple<string,string,string> data = make_tuple(token_val, DataPartition_val, DataRow_val);
+    session.insert({uid, data});
+
+    message.reply(status_codes::OK);
+    log_info() << "SignOn successful";
+    return;
+  }
+  else if (result.first == status_codes::ServiceUnavailable) {
+    reply_unavailable(message, resp_headers);
+    log_info() << "SignOn shed by BasicServer";
+    return;
+  }
+  else{
+    message.reply(status_codes::NotFound);
+    log_info() << "SignOn unsuccessful";
+    return;
+  }
+}
+
+/*
+  SignOff/USERID (POST)
+ */
+void sign_off_op (http_request message, const vector<string>& paths) {
+  string uid = paths[1];
+  log_info() << "**** SignOff " << uid;
+
+  for (auto it = session.begin(); it != session.end();) {
+    if (it->first == uid) {
+      it = session.erase(it);
       message.reply(status_codes::OK);
-      cout << "SignOn successful" << endl;
+      log_info() << "SignOff successful";
       return;
     }
-    else{
-      message.reply(status_codes::NotFound);
-      cout << "SignOn unsuccessful" << endl;
-      return;
+    else {
+      ++it;
     }
   }
-  //Sign the person off
-  else if (paths[0] == sign_off) {
-    string uid = paths[1];
-    cout << "**** SignOff " << uid << endl;
+  message.reply(status_codes::NotFound);
+  log_info() << "SignOff unsuccessful";
+  return;
+}
 
+/*
+  AddFriend/USERID/COUNTRY/NAME (PUT)
+ */
+void add_friend_op (http_request message, const vector<string>& paths) {
+  string uid = paths[1];
+
+  string add_country = paths[2];
+  string add_name = paths[3];
+
+  //checks to see if userid has a session
+  if (session.size() > 0) {
     for (auto it = session.begin(); it != session.end();) {
       if (it->first == uid) {
-        it = session.erase(it);
-        message.reply(status_codes::OK);
-        cout << "SignOff successful" << endl;
+        log_debug() << "userid was valid";
+        string token = get<0>(it->second);
+        string partition = get<1>(it->second);
+        string row = get<2>(it->second);
+
+        http_headers downstream {};
+        status_code code {update_friends(token, partition, row,
+          [&add_country, &add_name] (friends_list_t& friendslist_vec) {
+            //if already in friends list
+            for (int i = 0; i < friendslist_vec.size(); i++) {
+              if (friendslist_vec[i].first == add_country &&
+                  friendslist_vec[i].second == add_name) {
+                return false;
+              }
+            }
+            friendslist_vec.push_back(make_pair(add_country, add_name));
+            return true;
+          }, downstream)};
+        if (code == status_codes::ServiceUnavailable)
+          reply_unavailable(message, downstream);
+        else
+          message.reply(code);
         return;
       }
       else {
         ++it;
       }
     }
-    message.reply(status_codes::NotFound);
-    cout << "SignOff unsuccessful" << endl;
+    //uid did not have an active session
+    message.reply(status_codes::Forbidden);
     return;
   }
   else {
-    message.reply(status_codes::BadRequest);
+    message.reply(status_codes::Forbidden);
     return;
   }
+	
+  return;
 }
 
 /*
-  Top-level routine for processing all HTTP PUT requests.
+  UnFriend/USERID/COUNTRY/NAME (PUT)
  */
-void handle_put(http_request message) {
-  string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** PUT " << path << endl;
-  auto paths = uri::split_path(path);
-
-  //no op, userid, and status/friend info
-  if (paths.size() < 3) {
-    message.reply(status_codes::BadRequest);
-    return;
-  }
-
+void unfriend_op (http_request message, const vector<string>& paths) {
   string uid = paths[1];
-
-  if (paths[0] == add_friend) {
-    //add friend code
-    if (paths.size() < 4) {
-      message.reply(status_codes::BadRequest);
-      return;
+	
+	  string rm_country = paths[2];
+	  string rm_name = paths[3];
+	
+	  //checks to see if userid has a session
+  if (session.size() > 0) {
+    for (auto it = session.begin(); it != session.end();) {
+      if (it->first == uid) {
+        log_debug() << "userid was valid";
+        string token = get<0>(it->second);
+        string partition = get<1>(it->second);
+        string row = get<2>(it->second);
+
+        http_headers downstream {};
+        status_code code {update_friends(token, partition, row,
+          [&rm_country, &rm_name] (friends_list_t& friendslist_vec) {
+            //if in friend's list, delete
+            //if not, nothing happens
+            for (int i = 0; i < friendslist_vec.size(); i++) {
+              if (friendslist_vec[i].first == rm_country &&
+                  friendslist_vec[i].second == rm_name) {
+                friendslist_vec.erase(friendslist_vec.begin() + i); //removes the friend from friend list
+                return true;
+              }
+            }
+            return false;
+          }, downstream)};
+        if (code == status_codes::ServiceUnavailable)
+          reply_unavailable(message, downstream);
+        else
+          message.reply(code);
+        return;
+      }
+      else {
+        ++it;
+      }
     }
+    //uid did not have an active session
+    message.reply(status_codes::Forbidden);
+    return;
+  }
+  else {
+    message.reply(status_codes::Forbidden);
+    return;
+  }
 
-    string add_country = paths[2];
-    string add_name = paths[3];
-
-    //checks to see if userid has a session
-    if (session.size() > 0) {
-      for (auto it = session.begin(); it != session.end();) {
-        if (it->first == uid) {
-          cout << "userid was valid" << endl;
-          string token = get<0>(it->second);
-          string partition = get<1>(it->second);
-          string row = get<2>(it->second);
-
-          pair<status_code,value> get_entity {
-            do_request(methods::GET,
-                      string(addr)
-                      + read_entity_auth + "/"
-                      + data_table_name + "/"
-                      + token + "/"
-                      + partition + "/"
-                      + row)
-          };
-          if (get_entity.first != status_codes::OK) {
-            message.reply(status_codes::NotFound);
-            return;
-          }
-          
-          string friendslist = get_json_object_prop(get_entity.second, "Friends");
-          friends_list_t friendslist_vec = parse_friends_list(friendslist);
-
-          //if already in friends list
-          for (int i = 0; i < friendslist_vec.size(); i++) {
-            if (friendslist_vec[i].first == add_country &&
-                friendslist_vec[i].second == add_name) {
-              message.reply(status_codes::OK);
-              return;
-            }
-          }
+  return;
+}
 
-          friendslist_vec.push_back(make_pair(add_country, add_name));
-          friendslist = friends_list_to_string(friendslist_vec);
-
-          value val = build_json_value("Friends", friendslist);
-
-          pair<status_code,value> merge_friend {
-            do_request (methods::PUT,
-              string(addr)
-              + update_entity_auth + "/"
-              + data_table_name + "/"
-              + token + "/"
-              + partition + "/"
-              + row,
-              val)
-          };
-          if (merge_friend.first != status_codes::OK) {
-            message.reply(status_codes::NotFound);
-            return;
-          }
-        
-          message.reply(status_codes::OK);
+/*
+  UpdateStatus/USERID/STATUS (PUT)
+ */
+void update_status_op (http_request message, const vector<string>& paths) {
+  string uid = paths[1];
+	if (session.size() > 0) {
+    for (auto it = session.begin(); it != session.end();) {
+      if (it->first == uid) {
+        log_debug() << "userid was valid";
+        string token = get<0>(it->second);
+        string partition = get<1>(it->second);
+        string row = get<2>(it->second);
+		  
+		    http_headers resp_headers {};
+		    pair<status_code,value> get_entity {
+          do_request(methods::GET,
+                    string(addr)
+                    + read_entity_auth + "/"
+                    + data_table_name + "/"
+                    + token + "/"
+                    + partition + "/"
+                    + row,
+                    value {},
+                    vector<pair<string,string>> {},
+                    resp_headers)
+        };
+        if (get_entity.first == status_codes::ServiceUnavailable) {
+          reply_unavailable(message, resp_headers);
           return;
         }
-        else {
-          ++it;
+        if (get_entity.first != status_codes::OK) {
+            message.reply(status_codes::NotFound);
+            return;
         }
-      }
-      //uid did not have an active session
-      message.reply(status_codes::Forbidden);
-      return;
-    }
-    else {
-      message.reply(status_codes::Forbidden);
-      return;
-    }
-	
-    return;
-  }
-  else if (paths[0] == un_friend) {
-    //unfriend code
-    if (paths.size() < 4) {
-      message.reply(status_codes::BadRequest);
-      return;
-    }
-	
-	  string rm_country = paths[2];
-	  string rm_name = paths[3];
-	
-	  //checks to see if userid has a session
-    if (session.size() > 0) {
-      for (auto it = session.begin(); it != session.end();) {
-        if (it->first == uid) {
-          cout << "userid was valid" << endl;
-          string token = get<0>(it->second);
-          string partition = get<1>(it->second);
-          string row = get<2>(it->second);
-
-          pair<status_code,value> get_entity {
-            do_request(methods::GET,
-                      string(addr)
-                      + read_entity_auth + "/"
-                      + data_table_name + "/"
-                      + token + "/"
-                      + partition + "/"
-                      + row)
-          };
-          if (get_entity.first != status_codes::OK) {
+		  
+  		  value val = build_json_value("Status", paths[2]);
+
+  		  string friendslist = get_json_object_prop(get_entity.second, "Friends");
+        value flist = build_json_value("Friends", friendslist);
+
+    		pair<status_code, value> statusupdate { 
+  		    do_request (methods::PUT,
+  			             string(addr)
+  				           + update_entity_auth + "/"
+          				   + data_table_name + "/"
+          				   + token + "/"
+          				   + partition + "/"
+          				   + row,
+          				   val,
+          				   vector<pair<string,string>> {},
+          				   resp_headers)
+  		  };  
+  			if (statusupdate.first == status_codes::ServiceUnavailable) {
+  			  reply_unavailable(message, resp_headers);
+  			  return;
+  			}
+  			if (statusupdate.first != status_codes::OK) {
+    		  message.reply(status_codes::NotFound);
+    		  return;
+    		}
+        log_info() << "updating friends";
+  		  try {
+          //pushserver code
+          pair<status_code, value> statusupdate { 
+            do_request (methods::POST,
+                        string(push_addr)
+                        + push_status + "/"
+                        + partition + "/"
+                        + uid + "/"
+                        + paths[2],
+                        flist,
+                        vector<pair<string,string>> {},
+                        resp_headers)
+          };  
+          log_info() << "PushServer is up";
+          if (statusupdate.first != status_codes::OK && 
+              statusupdate.first != status_codes::ServiceUnavailable) {
             message.reply(status_codes::NotFound);
             return;
           }
-          
-          string friendslist = get_json_object_prop(get_entity.second, "Friends");
-          friends_list_t friendslist_vec = parse_friends_list(friendslist);
-
-          //if in friend's list, delete
-          //if not, nothing happens 
-          for (int i = 0; i < friendslist_vec.size(); i++) {
-            if (friendslist_vec[i].first == rm_country &&
-                friendslist_vec[i].second == rm_name) {
-			        friendslist_vec.erase(friendslist_vec.begin() + i); //removes the friend from friend list
-			        break;
-            }
-          } 
-
-          friendslist = friends_list_to_string(friendslist_vec);
-          value val = build_json_value("Friends", friendslist);
-
-          pair<status_code,value> delete_friend {
-            do_request (methods::PUT,
-              string(addr)
-              + update_entity_auth + "/"
-              + data_table_name + "/"
-              + token + "/"
-              + partition + "/"
-              + row,
-              val)
-          };
-          if (delete_friend.first != status_codes::OK) {
-            message.reply(status_codes::NotFound);
+          else if (statusupdate.first == status_codes::ServiceUnavailable) {
+            reply_unavailable(message, resp_headers);
             return;
           }
-        
           message.reply(status_codes::OK);
-          return;
+          return;          
         }
-        else {
-          ++it;
+  		  catch (const web::uri_exception& e) {
+          log_info() << "PushServer is down";
+  			  message.reply(status_codes::ServiceUnavailable);
+  			  return;
+  		  }
+        catch (...) {
+          log_info() << "PushServer is down";
+          message.reply(status_codes::ServiceUnavailable);
+          return;
         }
+  		}
+		  else {
+         ++it;
       }
-      //uid did not have an active session
-      message.reply(status_codes::Forbidden);
-      return;
     }
-    else {
+	  message.reply(status_codes::Forbidden);
+      return;
+	}
+	else {
       message.reply(status_codes::Forbidden);
       return;
-    }
-
-    return;
-  }
-  else if (paths[0] == update_status) {  //status update code
-  	if (session.size() > 0) {
-      for (auto it = session.begin(); it != session.end();) {
-        if (it->first == uid) {
-          cout << "userid was valid" << endl;
-          string token = get<0>(it->second);
-          string partition = get<1>(it->second);
-          string row = get<2>(it->second);
-  		  
-  		    pair<status_code,value> get_entity {
-            do_request(methods::GET,
-                      string(addr)
-                      + read_entity_auth + "/"
-                      + data_table_name + "/"
-                      + token + "/"
-                      + partition + "/"
-                      + row)
-          };
-          if (get_entity.first != status_codes::OK) {
-              message.reply(status_codes::NotFound);
-              return;
-          }
-  		  
-    		  value val = build_json_value("Status", paths[2]);
-
-    		  string friendslist = get_json_object_prop(get_entity.second, "Friends");
-          value flist = build_json_value("Friends", friendslist);
-
-      		pair<status_code, value> statusupdate { 
-    		    do_request (methods::PUT,
-    			             string(addr)
-    				           + update_entity_auth + "/"
-            				   + data_table_name + "/"
-            				   + token + "/"
-            				   + partition + "/"
-            				   + row,
-            				   val)
-    		  };  
-    			if (statusupdate.first != status_codes::OK) {
-      		  message.reply(status_codes::NotFound);
-      		  return;
-      		}
-          cout << "updating friends" << endl;
-    		  try {
-            //pushserver code
-            pair<status_code, value> statusupdate { 
-              do_request (methods::POST,
-                          string(push_addr)
-                          + push_status + "/"
-                          + partition + "/"
-                          + uid + "/"
-                          + paths[2],
-                          flist)
-            };  
-            cout << "PushServer is up" << endl;
-            if (statusupdate.first != status_codes::OK && 
-                statusupdate.first != status_codes::ServiceUnavailable) {
-              message.reply(status_codes::NotFound);
-              return;
-            }
-            else if (statusupdate.first == status_codes::ServiceUnavailable) {
-              message.reply(status_codes::ServiceUnavailable);
-              return;
-            }
-            message.reply(status_codes::OK);
-            return;          
-          }
-    		  catch (const web::uri_exception& e) {
-            cout << "PushServer is down" << endl;
-    			  message.reply(status_codes::ServiceUnavailable);
-    			  return;
-    		  }
-          catch (...) {
-            cout << "PushServer is down" << endl;
-            message.reply(status_codes::ServiceUnavailable);
-            return;
-          }
-    		}
-  		  else {
-           ++it;
-        }
-      }
-  	  message.reply(status_codes::Forbidden);
-        return;
-  	}
-  	else {
-        message.reply(status_codes::Forbidden);
-        return;
-    }
-  }
-  else {
-    message.reply(status_codes::BadRequest);
-    return;
   }
-
-
 }
 
-void handle_delete(http_request message) {
-  string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** DELETE " << path << endl;
+/*
+  The operations of this server and the path lengths they take
 
+  A POST whose path does not have exactly two segments gets
+  NotFound; every other request that matches no route gets
+  BadRequest.
+ */
+Router router {};
+
+void add_routes () {
+  router.add(methods::GET, metrics_op, 1, &reply_metrics);
+  router.unlimited(methods::GET, metrics_op);
+  router.add(methods::GET, read_friend_list, 2, Router::any_arity, &read_friend_list_op);
+
+  router.add(methods::POST, sign_on, 2, &sign_on_op);
+  router.add(methods::POST, sign_off, 2, &sign_off_op);
+  router.fallback(methods::POST, [] (http_request message, const vector<string>& paths) {
+    message.reply(paths.size() != 2 ? status_codes::NotFound : status_codes::BadRequest);
+  });
+
+  router.add(methods::PUT, add_friend, 4, Router::any_arity, &add_friend_op);
+  router.add(methods::PUT, un_friend, 4, Router::any_arity, &unfriend_op);
+  router.add(methods::PUT, update_status, 3, Router::any_arity, &update_status_op);
 }
 
+
 /*
   Main authentication server routine
 
@@ -641,32 +660,20 @@ void handle_delete(http_request message) {
   which processes each request asynchronously.
 
   Note that, unlike BasicServer, UserServer only
-  installs the listeners for GET, PUT and POST. Any other HTTP
+  has routes for GET, PUT and POST. Any other HTTP
   method will produce a Method Not Allowed (405)
   response.
 
-  If you want to support other methods, uncomment
-  the call below that hooks in a the appropriate 
-  listener.
-  
-  Wait for a carriage return, then shut the server down.
+  Options set the address, port, threads and drain timeout; see
+  ServerConfig.h.
+
+  Serve until told to stop, then drain and shut the server down.
  */
 int main (int argc, char const * argv[]) {
-  cout << "UserServer: Parsing connection string" << endl;
-
-  cout << "UserServer: Opening listener" << endl;
-  http_listener listener {def_url};
-  listener.support(methods::GET, &handle_get);
-  listener.support(methods::POST, &handle_post);
-  listener.support(methods::PUT, &handle_put);
-  //listener.support(methods::DEL, &handle_delete);
-  listener.open().wait(); // Wait for listener to complete starting
-
-  cout << "Enter carriage return to stop UserServer." << endl;
-  string line;
-  getline(std::cin, line);
-
-  // Shut it down
-  listener.close().wait();
-  cout << "UserServer closed" << endl;
+  ServerConfig config {};
+  if ( ! parse_server_config(argc, argv, def_port, config))
+    return 1;
+
+  add_routes();
+  serve(config, router, "UserServer");
 }
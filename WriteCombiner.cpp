@@ -0,0 +1,134 @@
+/*
+ Write combining, CMPT 276, Spring 2016.
+ */
+
+#include "WriteCombiner.h"
+
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <was/table.h>
+
+#include "Logger.h"
+
+using azure::storage::table_entity;
+
+using pplx::extensibility::scoped_critical_section_t;
+
+using std::make_shared;
+using std::shared_ptr;
+using std::string;
+
+using web::http::status_code;
+using web::http::status_codes;
+
+namespace {
+  string make_key (const string& table_name, const string& partition, const string& row) {
+    string key {table_name};
+    key += '\0';
+    key += partition;
+    key += '\0';
+    key += row;
+    return key;
+  }
+}
+
+WriteCombiner::WriteCombiner (std::chrono::milliseconds combine_window) :
+  window {combine_window},
+  keys {},
+  lock {}
+{}
+
+void WriteCombiner::set_window (std::chrono::milliseconds combine_window) {
+  scoped_critical_section_t l {lock};
+  window = combine_window;
+}
+
+status_code WriteCombiner::insert_or_merge (const string& table_name, TableStore& table,
+                                            const table_entity& entity) {
+  std::chrono::milliseconds wait {};
+  {
+    scoped_critical_section_t l {lock};
+    wait = window;
+  }
+  if (wait.count() <= 0)
+    return table.insert_or_merge(entity);
+
+  const string key {make_key(table_name, entity.partition_key(), entity.row_key())};
+
+  shared_ptr<pending_t> pending {};
+  pplx::task<status_code> result {};
+  {
+    scoped_critical_section_t l {lock};
+    key_state_t& state = keys[key];
+    if (state.collecting) {
+      // Join the write already waiting for this entity
+      table_entity::properties_type& properties = state.collecting->entity.properties();
+      for (const auto& p : entity.properties()) {
+        properties[p.first] = p.second;
+      }
+      result = pplx::create_task(state.collecting->done);
+    }
+    else {
+      pending = make_shared<pending_t> (pending_t {entity, pplx::task_completion_event<status_code> {}});
+      state.collecting = pending;
+    }
+  }
+  if ( ! pending)
+    return result.get();
+
+  std::this_thread::sleep_for(wait);
+  return flush(key, table, pending);
+}
+
+void WriteCombiner::wait_for (const string& table_name, const string& partition, const string& row) {
+  shared_ptr<pending_t> latest {};
+  {
+    scoped_critical_section_t l {lock};
+    auto state = keys.find(make_key(table_name, partition, row));
+    if (state == keys.end())
+      return;
+    // A collected write is sent only after the one before it finishes
+    latest = state->second.collecting ? state->second.collecting : state->second.last;
+  }
+  if (latest)
+    pplx::create_task(latest->done).wait();
+}
+
+/*
+  Send the write collected in pending, after the previous write
+  to the same entity has finished, and complete its waiters
+ */
+status_code WriteCombiner::flush (const string& key, TableStore& table,
+                                  shared_ptr<pending_t> pending) {
+  shared_ptr<pending_t> previous {};
+  {
+    scoped_critical_section_t l {lock};
+    key_state_t& state = keys[key];
+    state.collecting.reset();
+    previous = state.last;
+    state.last = pending;
+  }
+  if (previous)
+    pplx::create_task(previous->done).wait();
+
+  status_code code {status_codes::InternalError};
+  try {
+    code = table.insert_or_merge(pending->entity);
+  }
+  catch (const std::exception& e) {
+    log_error() << "Combined write failed: " << e.what();
+  }
+  pending->done.set(code);
+
+  scoped_critical_section_t l {lock};
+  auto state = keys.find(key);
+  // Forget the entity unless another write has started collecting since
+  if (state != keys.end() && ! state->second.collecting &&
+      state->second.last == pending)
+    keys.erase(state);
+  return code;
+}
@@ -0,0 +1,79 @@
+#ifndef WriteCombiner_h
+#define WriteCombiner_h
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include <cpprest/http_msg.h>
+
+#include <pplx/pplxtasks.h>
+
+#include <was/table.h>
+
+#include "TableStore.h"
+
+/*
+  Combines concurrent insert-or-merge writes to the same entity
+
+  The first write to arrive for an entity waits window, collecting
+  the properties of any other writes to that entity that arrive
+  meanwhile, later values replacing earlier ones. It then makes
+  one insert_or_merge() for all of them, and every waiting write
+  returns its status.
+
+  Writes to one entity reach the store in the order they arrived:
+  a combined write does not start until the one before it for the
+  same entity has finished.
+
+  The first write blocks its thread for the window, and those
+  joining it block until it finishes, so on a WorkerPool they hold
+  pool threads meanwhile.
+
+  A window of zero disables combining; every write goes straight
+  to the store.
+ */
+class WriteCombiner {
+private:
+  struct pending_t {
+    azure::storage::table_entity entity;
+    pplx::task_completion_event<web::http::status_code> done;
+  };
+
+  struct key_state_t {
+    std::shared_ptr<pending_t> collecting; // Null if no write is waiting
+    std::shared_ptr<pending_t> last; // The latest write sent to the store
+  };
+
+  std::chrono::milliseconds window;
+  std::unordered_map<std::string,key_state_t> keys;
+  pplx::extensibility::critical_section_t lock;
+
+  web::http::status_code flush (const std::string& key, TableStore& table,
+                                std::shared_ptr<pending_t> pending);
+
+public:
+  explicit WriteCombiner (std::chrono::milliseconds combine_window);
+
+  WriteCombiner (const WriteCombiner&) = delete;
+  WriteCombiner& operator= (const WriteCombiner&) = delete;
+
+  void set_window (std::chrono::milliseconds combine_window);
+
+  /*
+    Insert or merge entity into table_name, whose store is table,
+    returning the status of the (possibly combined) write
+   */
+  web::http::status_code insert_or_merge (const std::string& table_name, TableStore& table,
+                                          const azure::storage::table_entity& entity);
+
+  /*
+    Wait until every write to the entity already collected or sent
+    has reached the store, as a write that bypasses the combiner,
+    such as a conditional merge, must see their ETag
+   */
+  void wait_for (const std::string& table_name, const std::string& partition, const std::string& row);
+};
+
+#endif
@@ -0,0 +1,106 @@
+/*
+ Benchmark of response compression, CMPT 276, Spring 2016.
+
+ For JSON bodies of several sizes, made of entities like those in
+ DataTable, reports the bytes saved and the CPU time spent by gzip
+ at several levels, to help choose BasicServer's compression
+ threshold.
+
+ Usage: bench_compress [iterations]
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <was/table.h>
+
+#include "Compress.h"
+#include "EntityJson.h"
+
+using azure::storage::entity_property;
+using azure::storage::table_entity;
+
+using std::cout;
+using std::endl;
+using std::setw;
+using std::string;
+using std::vector;
+
+using bench_clock = std::chrono::steady_clock;
+
+/*
+  A JSON array of DataTable-like entities of about size bytes
+ */
+string make_body (size_t size) {
+  string body {"["};
+  for (int i {0}; body.size() < size; ++i) {
+    table_entity e {"USA", "User" + std::to_string(i)};
+    table_entity::properties_type& p = e.properties();
+    p["Friends"] = entity_property {string {"USA;Franklin,Aretha|Canada;Mitchell,Joni"}};
+    p["Status"] = entity_property {"Status number " + std::to_string(i * 7919 % 1000)};
+    p["Updates"] = entity_property {"Out of the house\nBack home after " + std::to_string(i) + " days\n"};
+    if (i > 0)
+      body.push_back(',');
+    append_entity_json(body, e, true);
+  }
+  body.push_back(']');
+  return body;
+}
+
+template <typename F>
+double time_us (int iterations, F f) {
+  bench_clock::time_point start {bench_clock::now()};
+  for (int i {0}; i < iterations; ++i) {
+    f();
+  }
+  std::chrono::duration<double, std::micro> elapsed {bench_clock::now() - start};
+  return elapsed.count() / iterations;
+}
+
+int main (int argc, char const * argv[]) {
+  int iterations {argc > 1 ? std::atoi(argv[1]) : 100};
+  if (iterations <= 0) {
+    cout << "Usage: bench_compress [iterations]" << endl;
+    return 1;
+  }
+  const vector<size_t> sizes {256, 1024, 4 * 1024, 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024};
+  const vector<int> levels {1, 6, 9};
+
+  cout << setw(9) << "bytes" << setw(7) << "level" << setw(11) << "compressed"
+       << setw(8) << "ratio" << setw(13) << "compress us" << setw(15) << "decompress us"
+       << setw(11) << "MB/s" << endl;
+  for (auto size : sizes) {
+    string body {make_body(size)};
+    for (auto level : levels) {
+      string compressed {};
+      if ( ! compress_body(body, gzip_coding, compressed, level)) {
+        cout << "Compression failed" << endl;
+        return 1;
+      }
+      string back {};
+      if ( ! decompress_body(compressed, gzip_coding, back) || back != body) {
+        cout << "Round trip failed" << endl;
+        return 1;
+      }
+
+      double compress_us {time_us(iterations, [&] () {
+            compress_body(body, gzip_coding, compressed, level);
+          })};
+      double decompress_us {time_us(iterations, [&] () {
+            decompress_body(compressed, gzip_coding, back);
+          })};
+      cout << setw(9) << body.size() << setw(7) << level << setw(11) << compressed.size()
+           << setw(8) << std::fixed << std::setprecision(2)
+           << static_cast<double> (body.size()) / compressed.size()
+           << setw(13) << std::setprecision(1) << compress_us
+           << setw(15) << decompress_us
+           << setw(11) << body.size() / compress_us << endl;
+    }
+  }
+  return 0;
+}
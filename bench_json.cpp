@@ -0,0 +1,163 @@
+/*
+ Benchmark of entity JSON serialization, CMPT 276, Spring 2016.
+
+ Compares the value-tree path BasicServer used to take (copy the
+ properties into a vector of pairs, build a json::value object per
+ entity and an array of them, then serialize) with writing the
+ entities straight into a reused buffer with append_entity_json().
+
+ Usage: bench_json [entities [iterations]]
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cpprest/json.h>
+
+#include <was/table.h>
+
+#include "EntityJson.h"
+
+using azure::storage::edm_type;
+using azure::storage::entity_property;
+using azure::storage::table_entity;
+
+using std::cout;
+using std::endl;
+using std::make_pair;
+using std::pair;
+using std::string;
+using std::vector;
+
+using web::json::value;
+
+using prop_vals_t = vector<pair<string,value>>;
+using bench_clock = std::chrono::steady_clock;
+
+/*
+  The conversion BasicServer used before EntityJson, kept here
+  as the baseline
+ */
+prop_vals_t get_properties (const table_entity::properties_type& properties, prop_vals_t values = prop_vals_t {}) {
+  for (const auto v : properties) {
+    if (v.second.property_type() == edm_type::string) {
+      values.push_back(make_pair(v.first, value::string(v.second.string_value())));
+    }
+    else if (v.second.property_type() == edm_type::datetime) {
+      values.push_back(make_pair(v.first, value::string(v.second.str())));
+    }
+    else if(v.second.property_type() == edm_type::int32) {
+      values.push_back(make_pair(v.first, value::number(v.second.int32_value())));
+    }
+    else if(v.second.property_type() == edm_type::int64) {
+      values.push_back(make_pair(v.first, value::number(v.second.int64_value())));
+    }
+    else if(v.second.property_type() == edm_type::double_floating_point) {
+      values.push_back(make_pair(v.first, value::number(v.second.double_value())));
+    }
+    else if(v.second.property_type() == edm_type::boolean) {
+      values.push_back(make_pair(v.first, value::boolean(v.second.boolean_value())));
+    }
+    else {
+      values.push_back(make_pair(v.first, value::string(v.second.str())));
+    }
+  }
+  return values;
+}
+
+string value_tree_json (const vector<table_entity>& entities) {
+  vector<value> results {};
+  for (const auto& e : entities) {
+    prop_vals_t keys {
+      make_pair("Partition", value::string(e.partition_key())),
+      make_pair("Row", value::string(e.row_key()))
+    };
+    keys = get_properties(e.properties(), keys);
+    results.push_back(value::object(keys));
+  }
+  return value::array(results).serialize();
+}
+
+void direct_json (const vector<table_entity>& entities, string& body) {
+  body.push_back('[');
+  bool first {true};
+  for (const auto& e : entities) {
+    if ( ! first)
+      body.push_back(',');
+    first = false;
+    append_entity_json(body, e, true);
+  }
+  body.push_back(']');
+}
+
+vector<table_entity> make_entities (int count) {
+  vector<table_entity> entities {};
+  for (int i {0}; i < count; ++i) {
+    table_entity e {"Partition" + std::to_string(i % 10), "Row,\"" + std::to_string(i) + "\""};
+    table_entity::properties_type& p = e.properties();
+    p["Song"] = entity_property {string {"Song number "} + std::to_string(i)};
+    p["Lyrics"] = entity_property {string {"Line one\nLine \"two\"\tand a \\ backslash"}};
+    p["Plays"] = entity_property {static_cast<int32_t> (i * 7)};
+    p["Listeners"] = entity_property {static_cast<int64_t> (i) * 1000003};
+    p["Rating"] = entity_property {i / 3.0};
+    p["Explicit"] = entity_property {i % 2 == 0};
+    p["Friends"] = entity_property {string {"USA;Franklin,Aretha|Canada;Mitchell,Joni"}};
+    p["Updates"] = entity_property {string {"Out of the house\nBack home\n"}};
+    entities.push_back(e);
+  }
+  return entities;
+}
+
+template <typename F>
+double time_per_entity (int iterations, int entities, F f) {
+  bench_clock::time_point start {bench_clock::now()};
+  for (int i {0}; i < iterations; ++i) {
+    f();
+  }
+  std::chrono::duration<double, std::nano> elapsed {bench_clock::now() - start};
+  return elapsed.count() / (static_cast<double> (iterations) * entities);
+}
+
+int main (int argc, char const * argv[]) {
+  int count {argc > 1 ? std::atoi(argv[1]) : 1000};
+  int iterations {argc > 2 ? std::atoi(argv[2]) : 200};
+  if (count <= 0 || iterations <= 0) {
+    cout << "Usage: bench_json [entities [iterations]]" << endl;
+    return 1;
+  }
+  vector<table_entity> entities {make_entities(count)};
+
+  // The two paths must agree before their speed means anything
+  string tree {value_tree_json(entities)};
+  string direct {};
+  direct_json(entities, direct);
+  if (tree != direct) {
+    cout << "Outputs differ" << endl;
+    cout << "value tree: " << tree.substr(0, 400) << endl;
+    cout << "direct:     " << direct.substr(0, 400) << endl;
+    return 1;
+  }
+
+  size_t sink {0};
+  double tree_ns {time_per_entity(iterations, count, [&] () {
+        sink += value_tree_json(entities).size();
+      })};
+  string body {};
+  double direct_ns {time_per_entity(iterations, count, [&] () {
+        body.clear();
+        direct_json(entities, body);
+        sink += body.size();
+      })};
+
+  cout << count << " entities, " << iterations << " iterations, "
+       << direct.size() << " bytes per response" << endl;
+  cout << "value tree: " << tree_ns << " ns/entity" << endl;
+  cout << "direct:     " << direct_ns << " ns/entity" << endl;
+  cout << "speedup:    " << tree_ns / direct_ns << "x" << endl;
+  return sink == 0 ? 1 : 0;
+}
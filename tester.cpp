@@ -3,12 +3,25 @@
  */
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
 #include <exception>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <cpprest/http_client.h>
 #include <cpprest/json.h>
 
@@ -16,8 +29,13 @@
 
 #include <UnitTest++/UnitTest++.h>
 
+#include "Compress.h"
+#include "LocalTableStore.h"
+#include "Logger.h"
 #include "ServerUtils.h"
+#include "Snapshot.h"
 #include "TableCache.h"
+#include "WriteCombiner.h"
 #include "make_unique.h"
 
 #include "azure_keys.h"
@@ -44,14 +62,26 @@ using web::http::client::http_client;
 using web::json::object;
 using web::json::value;
 
+using azure::storage::entity_property;
 using azure::storage::storage_exception;
+using azure::storage::table_entity;
 
 const string create_table_op {"CreateTableAdmin"};
 const string delete_table_op {"DeleteTableAdmin"};
 
 const string read_entity_admin {"ReadEntityAdmin"};
+const string cache_stats_admin {"CacheStatsAdmin"};
+const string metrics_op {"Metrics"};
 const string update_entity_admin {"UpdateEntityAdmin"};
 const string delete_entity_admin {"DeleteEntityAdmin"};
+const string batch_update_admin {"BatchUpdateAdmin"};
+const string batch_delete_admin {"BatchDeleteAdmin"};
+const string export_table_admin {"ExportTableAdmin"};
+const string import_table_admin {"ImportTableAdmin"};
+const string count_entities_admin {"CountEntitiesAdmin"};
+const string create_index_admin {"CreateIndexAdmin"};
+const string query_index_admin {"QueryIndexAdmin"};
+const string delete_index_admin {"DeleteIndexAdmin"};
 
 const string read_entity_auth {"ReadEntityAuth"};
 const string update_entity_auth {"UpdateEntityAuth"};
@@ -404,6 +434,112 @@ pair<status_code,string> get_read_token(const string& addr,  const string& useri
   }
 }
 
+/*
+  Utility to GET one page of a paged read
+
+  uri_string: full URI, including the query string
+  result: set to the status code and JSON body of the response
+
+  Returns the value of the Continuation header, or the empty
+  string if the response has none.
+ */
+string get_paged (const string& uri_string, pair<status_code,value>& result) {
+  string cont {};
+  http_client client {uri_string};
+  client.request (http_request {methods::GET})
+    .then([&result, &cont](http_response response)
+          {
+            result.first = response.status_code();
+            const http_headers& headers {response.headers()};
+            auto c (headers.find("Continuation"));
+            if (c != headers.end())
+              cont = c->second;
+            return response.extract_json();
+          })
+    .then([&result](value v) -> void
+          {
+            result.second = v;
+          })
+    .wait();
+  return cont;
+}
+
+/*
+  Make a GET request that accepts gzip, returning the status code,
+  the Content-Encoding of the response, and its body decompressed
+ */
+string get_gzip (const string& uri_string, pair<status_code,string>& result) {
+  string coding {};
+  vector<unsigned char> bytes {};
+  http_request request {methods::GET};
+  request.headers().add("Accept-Encoding", "gzip");
+  http_client client {uri_string};
+  client.request (request)
+    .then([&result, &coding](http_response response)
+          {
+            result.first = response.status_code();
+            const http_headers& headers {response.headers()};
+            auto c (headers.find("Content-Encoding"));
+            if (c != headers.end())
+              coding = c->second;
+            return response.extract_vector();
+          })
+    .then([&bytes](vector<unsigned char> v) -> void
+          {
+            bytes = v;
+          })
+    .wait();
+  string body (bytes.begin(), bytes.end());
+  if (coding.empty() || ! decompress_body(body, coding, result.second))
+    result.second = body;
+  return coding;
+}
+
+/*
+  Make a GET request with an If-None-Match header (omitted if
+  if_none_match is empty), returning the status code and setting
+  etag to the response's ETag header
+ */
+status_code get_conditional (const string& uri_string, const string& if_none_match, string& etag) {
+  status_code code {};
+  http_request request {methods::GET};
+  if ( ! if_none_match.empty())
+    request.headers().add("If-None-Match", if_none_match);
+  http_client client {uri_string};
+  client.request (request)
+    .then([&code, &etag](http_response response)
+          {
+            code = response.status_code();
+            const http_headers& headers {response.headers()};
+            auto e (headers.find("ETag"));
+            etag = e == headers.end() ? string {} : e->second;
+          })
+    .wait();
+  return code;
+}
+
+/*
+  Merge one property into an entity with UpdateEntityAdmin, only
+  if its ETag matches if_match
+ */
+status_code put_if_match (const string& addr, const string& table, const string& partition, const string& row,
+                          const string& prop, const string& pstring, const string& if_match) {
+  status_code code {};
+  http_request request {methods::PUT};
+  request.headers().add("If-Match", if_match);
+  request.headers().add("Content-Type", "application/json");
+  request.set_body(value::object (vector<pair<string,value>>
+                                   {make_pair(prop, value::string(pstring))}));
+  http_client client {addr + update_entity_admin + "/" + table + "/" + partition + "/" + row};
+  client.request (request)
+    .then([&code](http_response response)
+          {
+            code = response.status_code();
+          })
+    .wait();
+  return code;
+}
+
 /*
   A sample fixture that ensures TestTable exists, and
   at least has the entity Franklin,Aretha/USA
@@ -801,6 +937,53 @@ SUITE(GET) {
 
    }
 
+   /*
+      A JSON body on a table read selects the entities that have
+      every property it names, whatever their values
+   */
+   TEST_FIXTURE(BasicFixture, GetJSONPresence) {
+      cout << ">> GetJSONPresence test" << endl;
+
+      string partition {"CAN"};
+      string row {"Katherines,The"};
+      CHECK_EQUAL(status_codes::OK,
+                  put_entity (BasicFixture::addr, BasicFixture::table, partition, row,
+                              vector<pair<string,value>> {
+                                make_pair(string(BasicFixture::property), value::string("Home Girl")),
+                                make_pair(string("Home"), value::string("Vancouver"))}));
+
+      const string uri_string {string(BasicFixture::addr) + read_entity_admin + "/" + BasicFixture::table};
+
+      // Both entities have Song; the body's value matches neither
+      pair<status_code,value> result {
+         do_request (methods::GET, uri_string,
+                     value::object (vector<pair<string,value>>
+                         {make_pair(string(BasicFixture::property), value::string("No Such Song"))}))};
+      CHECK_EQUAL(status_codes::OK, result.first);
+      CHECK_EQUAL(2, result.second.as_array().size());
+
+      // Only the new entity has both Song and Home
+      result = do_request (methods::GET, uri_string,
+                           value::object (vector<pair<string,value>> {
+                               make_pair(string(BasicFixture::property), value::string("")),
+                               make_pair(string("Home"), value::string(""))}));
+      CHECK_EQUAL(status_codes::OK, result.first);
+      CHECK_EQUAL(1, result.second.as_array().size());
+      if (result.second.as_array().size() == 1) {
+        CHECK_EQUAL(row, result.second[0]["Row"].as_string());
+        CHECK_EQUAL("Vancouver", result.second[0]["Home"].as_string());
+      }
+
+      // No entity has every property named
+      result = do_request (methods::GET, uri_string,
+                           value::object (vector<pair<string,value>> {
+                               make_pair(string("Home"), value::string("")),
+                               make_pair(string("NotASong"), value::string(""))}));
+      CHECK_EQUAL(status_codes::BadRequest, result.first);
+
+      CHECK_EQUAL(status_codes::OK, delete_entity (BasicFixture::addr, BasicFixture::table, partition, row));
+   }
+
    /*
       A test of GET all table entries
    */
@@ -834,6 +1017,535 @@ SUITE(GET) {
       CHECK_EQUAL(status_codes::OK, result.first);
       CHECK_EQUAL(status_codes::OK, delete_entity (BasicFixture::addr, BasicFixture::table, partition, row));
    }
+
+   /*
+      A test of paging through a partition with $top and continuation
+   */
+   TEST_FIXTURE(BasicFixture, GetPaged) {
+      cout << ">> GetPaged test" << endl;
+
+      vector<string> rows {"Doe,John", "Doe,Jane"};
+      for (const auto& r : rows) {
+         CHECK_EQUAL(status_codes::OK,
+                     put_entity (BasicFixture::addr, BasicFixture::table, BasicFixture::partition, r, "Song", "Paged"));
+      }
+
+      size_t total {0};
+      int pages {0};
+      string cont {};
+      do {
+         string uri_string {string(BasicFixture::addr)
+            + read_entity_admin + "/"
+            + BasicFixture::table + "/"
+            + BasicFixture::partition + "/"
+            + "*" + "?$top=1"};
+         if ( ! cont.empty())
+            uri_string += "&continuation=" + cont;
+         pair<status_code,value> result {};
+         cont = get_paged (uri_string, result);
+         CHECK_EQUAL(status_codes::OK, result.first);
+         CHECK(result.second.is_array());
+         CHECK(result.second.as_array().size() <= 1);
+         total += result.second.as_array().size();
+         ++pages;
+      } while ( ! cont.empty() && pages < 10);
+      CHECK_EQUAL(3, total);
+      CHECK(pages >= 3);
+
+      // A malformed page size is rejected
+      pair<status_code,value> bad {
+         do_request (methods::GET,
+            string(BasicFixture::addr)
+            + read_entity_admin + "/"
+            + BasicFixture::table
+            + "?$top=0")
+      };
+      CHECK_EQUAL(status_codes::BadRequest, bad.first);
+
+      for (const auto& r : rows) {
+         CHECK_EQUAL(status_codes::OK, delete_entity (BasicFixture::addr, BasicFixture::table, BasicFixture::partition, r));
+      }
+   }
+
+   /*
+     A full-table read is compressed for a client that accepts gzip
+    */
+   TEST_FIXTURE(BasicFixture, GetCompressed) {
+      cout << ">> GetCompressed test" << endl;
+
+      string uri_string {string(BasicFixture::addr)
+         + read_entity_admin + "/"
+         + BasicFixture::table};
+      pair<status_code,string> result {};
+      string coding {get_gzip (uri_string, result)};
+      CHECK_EQUAL(status_codes::OK, result.first);
+      CHECK_EQUAL(gzip_coding, coding);
+
+      value table {value::parse(result.second)};
+      CHECK(table.is_array());
+      pair<status_code,value> plain {do_request (methods::GET, uri_string)};
+      CHECK_EQUAL(status_codes::OK, plain.first);
+      CHECK_EQUAL(plain.second.serialize(), table.serialize());
+   }
+
+   /*
+     An entity read carries its ETag, and a read naming the current
+     ETag in If-None-Match gets 304 Not Modified
+    */
+   TEST_FIXTURE(BasicFixture, GetNotModified) {
+      cout << ">> GetNotModified test" << endl;
+
+      string uri_string {string(BasicFixture::addr)
+         + read_entity_admin + "/"
+         + BasicFixture::table + "/"
+         + BasicFixture::partition + "/"
+         + BasicFixture::row};
+      string etag {};
+      CHECK_EQUAL(status_codes::OK, get_conditional (uri_string, string {}, etag));
+      CHECK( ! etag.empty());
+
+      string etag2 {};
+      CHECK_EQUAL(status_codes::NotModified, get_conditional (uri_string, etag, etag2));
+      CHECK_EQUAL(etag, etag2);
+
+      CHECK_EQUAL(status_codes::OK,
+                  put_entity (BasicFixture::addr, BasicFixture::table, BasicFixture::partition, BasicFixture::row,
+                              BasicFixture::property, "THINK"));
+      CHECK_EQUAL(status_codes::OK, get_conditional (uri_string, etag, etag2));
+      CHECK(etag != etag2);
+   }
+
+  /*
+    A table read split into partition ranges returns the same
+    entities as a sequential one, though not necessarily in order
+   */
+  TEST_FIXTURE(BasicFixture, GetParallel) {
+    cout << ">> GetParallel test" << endl;
+
+    string partition {"CAN"};
+    string row {"Katherines,The"};
+    string property {"Home"};
+    string prop_val {"Vancouver"};
+    CHECK_EQUAL(status_codes::OK,
+                put_entity (BasicFixture::addr, BasicFixture::table, partition, row, property, prop_val));
+
+    string table_uri {string(BasicFixture::addr) + read_entity_admin + "/" + BasicFixture::table};
+    pair<status_code,value> result {do_request (methods::GET, table_uri + "?$parallel=4&$split=CAN,M")};
+    CHECK_EQUAL(status_codes::OK, result.first);
+
+    value obj1 {
+      value::object(vector<pair<string,value>> {
+          make_pair(string("Partition"), value::string(partition)),
+          make_pair(string("Row"), value::string(row)),
+          make_pair(property, value::string(prop_val))
+      })
+    };
+    value obj2 {
+      value::object(vector<pair<string,value>> {
+          make_pair(string("Partition"), value::string(BasicFixture::partition)),
+          make_pair(string("Row"), value::string(BasicFixture::row)),
+          make_pair(string(BasicFixture::property), value::string(BasicFixture::prop_val))
+      })
+    };
+    compare_json_arrays(vector<object> {obj1.as_object(), obj2.as_object()}, result.second);
+
+    pair<status_code,value> bad {do_request (methods::GET, table_uri + "?$parallel=0")};
+    CHECK_EQUAL(status_codes::BadRequest, bad.first);
+
+    CHECK_EQUAL(status_codes::OK, delete_entity (BasicFixture::addr, BasicFixture::table, partition, row));
+  }
+
+  /*
+    Counts by partition and property, kept up to date by the
+    server's own writes
+   */
+  TEST_FIXTURE(BasicFixture, CountEntities) {
+    cout << ">> CountEntities test" << endl;
+
+    string partition {"CAN"};
+    string property {"Home"};
+    CHECK_EQUAL(status_codes::OK,
+                put_entity (BasicFixture::addr, BasicFixture::table, partition, "Katherines,The", property, "Vancouver"));
+
+    string count_uri {string(BasicFixture::addr) + count_entities_admin + "/" + BasicFixture::table};
+    string select {"?$select=" + property + "," + BasicFixture::property};
+    pair<status_code,value> result {do_request (methods::GET, count_uri + select)};
+    CHECK_EQUAL(status_codes::OK, result.first);
+    CHECK_EQUAL(2, result.second["Entities"].as_integer());
+    CHECK_EQUAL(1, result.second["Partitions"][partition].as_integer());
+    CHECK_EQUAL(1, result.second["Partitions"][BasicFixture::partition].as_integer());
+    CHECK_EQUAL(1, result.second["Properties"][property].as_integer());
+    CHECK_EQUAL(1, result.second["Properties"][BasicFixture::property].as_integer());
+
+    // A write since the last count is included in the next
+    CHECK_EQUAL(status_codes::OK,
+                put_entity (BasicFixture::addr, BasicFixture::table, partition, "Tegan,Sara", "Genre", "Pop"));
+    result = do_request (methods::GET, count_uri + select);
+    CHECK_EQUAL(status_codes::OK, result.first);
+    CHECK_EQUAL(3, result.second["Entities"].as_integer());
+    CHECK_EQUAL(2, result.second["Partitions"][partition].as_integer());
+    CHECK_EQUAL(1, result.second["Properties"][property].as_integer());
+
+    result = do_request (methods::GET, count_uri + "/" + partition);
+    CHECK_EQUAL(status_codes::OK, result.first);
+    CHECK_EQUAL(2, result.second["Entities"].as_integer());
+
+    CHECK_EQUAL(status_codes::OK, delete_entity (BasicFixture::addr, BasicFixture::table, partition, "Tegan,Sara"));
+    result = do_request (methods::GET, count_uri);
+    CHECK_EQUAL(status_codes::OK, result.first);
+    CHECK_EQUAL(2, result.second["Entities"].as_integer());
+
+    CHECK_EQUAL(status_codes::OK, delete_entity (BasicFixture::addr, BasicFixture::table, partition, "Katherines,The"));
+  }
+
+   /*
+     $select returns only the named properties
+    */
+   TEST_FIXTURE(BasicFixture, GetSelect) {
+      cout << ">> GetSelect test" << endl;
+
+      CHECK_EQUAL(status_codes::OK,
+                  put_entity (BasicFixture::addr, BasicFixture::table, BasicFixture::partition, BasicFixture::row,
+                              "Album", "Lady Soul"));
+
+      pair<status_code,value> single {
+         do_request (methods::GET,
+            string(BasicFixture::addr)
+            + read_entity_admin + "/"
+            + BasicFixture::table + "/"
+            + BasicFixture::partition + "/"
+            + BasicFixture::row
+            + "?$select=Album")
+      };
+      CHECK_EQUAL(status_codes::OK, single.first);
+      CHECK_EQUAL(1, single.second.size());
+      CHECK_EQUAL(string("Lady Soul"), single.second["Album"].as_string());
+
+      pair<status_code,value> partition {
+         do_request (methods::GET,
+            string(BasicFixture::addr)
+            + read_entity_admin + "/"
+            + BasicFixture::table + "/"
+            + BasicFixture::partition + "/*"
+            + "?$select=Album")
+      };
+      CHECK_EQUAL(status_codes::OK, partition.first);
+      CHECK(partition.second.is_array());
+      for (const auto& e : partition.second.as_array()) {
+         CHECK( ! e.has_field(BasicFixture::property));
+      }
+   }
+
+   /*
+     A repeated read is served from the entity cache, and an update
+     is visible to the next read
+    */
+   TEST_FIXTURE(BasicFixture, GetCached) {
+      cout << ">> GetCached test" << endl;
+
+      string entity_uri {string(BasicFixture::addr)
+         + read_entity_admin + "/"
+         + BasicFixture::table + "/"
+         + BasicFixture::partition + "/"
+         + BasicFixture::row};
+      string stats_uri {string(BasicFixture::addr) + cache_stats_admin};
+
+      pair<status_code,value> first {do_request (methods::GET, entity_uri)};
+      CHECK_EQUAL(status_codes::OK, first.first);
+      pair<status_code,value> before {do_request (methods::GET, stats_uri)};
+      CHECK_EQUAL(status_codes::OK, before.first);
+
+      pair<status_code,value> second {do_request (methods::GET, entity_uri)};
+      CHECK_EQUAL(status_codes::OK, second.first);
+      CHECK_EQUAL(first.second.serialize(), second.second.serialize());
+      pair<status_code,value> after {do_request (methods::GET, stats_uri)};
+      CHECK_EQUAL(status_codes::OK, after.first);
+      CHECK_EQUAL(before.second["Hits"].as_number().to_int64() + 1,
+                  after.second["Hits"].as_number().to_int64());
+
+      CHECK_EQUAL(status_codes::OK,
+                  put_entity (BasicFixture::addr, BasicFixture::table, BasicFixture::partition, BasicFixture::row,
+                              BasicFixture::property, "THINK"));
+      pair<status_code,value> updated {do_request (methods::GET, entity_uri)};
+      CHECK_EQUAL(status_codes::OK, updated.first);
+      CHECK_EQUAL(string("THINK"), updated.second[BasicFixture::property].as_string());
+   }
+
+  /*
+    A read is counted under its operation, with its latency
+    quantiles, in the server's metrics
+   */
+   TEST_FIXTURE(BasicFixture, GetMetrics) {
+      cout << ">> GetMetrics test" << endl;
+
+      pair<status_code,value> read {
+        do_request (methods::GET,
+                    string(BasicFixture::addr)
+                    + read_entity_admin + "/"
+                    + BasicFixture::table + "/"
+                    + BasicFixture::partition + "/"
+                    + BasicFixture::row)};
+      CHECK_EQUAL(status_codes::OK, read.first);
+
+      pair<status_code,string> result {};
+      get_gzip (string(BasicFixture::addr) + metrics_op, result);
+      CHECK_EQUAL(status_codes::OK, result.first);
+      CHECK(result.second.find("operation=\"" + read_entity_admin + "\",status=\"200\"") != string::npos);
+      CHECK(result.second.find("quantile=\"0.99\"") != string::npos);
+   }
+}
+
+SUITE(BATCH) {
+  /*
+    Write and delete entities in two partitions with one request each
+   */
+  TEST_FIXTURE(BasicFixture, BatchUpdateDelete) {
+    cout << ">> BatchUpdateDelete test" << endl;
+
+    vector<pair<string,string>> keys {
+      make_pair("Canada", "Mitchell,Joni"),
+      make_pair("Canada", "Cohen,Leonard"),
+      make_pair("Sweden", "Lykke,Li")
+    };
+    vector<value> entities {};
+    for (const auto& k : keys) {
+      entities.push_back(value::object(vector<pair<string,value>> {
+        make_pair("Partition", value::string(k.first)),
+        make_pair("Row", value::string(k.second)),
+        make_pair("Song", value::string("Batched"))
+      }));
+    }
+    // Missing its Row, so rejected on its own
+    entities.push_back(value::object(vector<pair<string,value>> {
+      make_pair("Partition", value::string("Canada"))
+    }));
+
+    pair<status_code,value> result {
+      do_request (methods::PUT,
+                  string(BasicFixture::addr) + batch_update_admin + "/" + BasicFixture::table,
+                  value::array(entities))
+    };
+    CHECK_EQUAL(status_codes::OK, result.first);
+    CHECK(result.second.is_array());
+    CHECK_EQUAL(entities.size(), result.second.as_array().size());
+    if (result.second.is_array() && result.second.as_array().size() == entities.size()) {
+      for (vector<value>::size_type i {0}; i < keys.size(); ++i) {
+        CHECK_EQUAL(status_codes::OK, result.second[i]["Status"].as_integer());
+        CHECK_EQUAL(keys[i].second, result.second[i]["Row"].as_string());
+      }
+      CHECK_EQUAL(status_codes::BadRequest, result.second[keys.size()]["Status"].as_integer());
+    }
+
+    pair<status_code,value> read {
+      do_request (methods::GET,
+                  string(BasicFixture::addr) + read_entity_admin + "/"
+                  + BasicFixture::table + "/" + keys[2].first + "/" + keys[2].second)
+    };
+    CHECK_EQUAL(status_codes::OK, read.first);
+    CHECK_EQUAL(string("Batched"), read.second["Song"].as_string());
+
+    entities.pop_back();
+    result = do_request (methods::DEL,
+                         string(BasicFixture::addr) + batch_delete_admin + "/" + BasicFixture::table,
+                         value::array(entities));
+    CHECK_EQUAL(status_codes::OK, result.first);
+    CHECK(result.second.is_array());
+    if (result.second.is_array()) {
+      for (vector<value>::size_type i {0}; i < result.second.as_array().size(); ++i) {
+        CHECK_EQUAL(status_codes::OK, result.second[i]["Status"].as_integer());
+      }
+    }
+
+    read = do_request (methods::GET,
+                       string(BasicFixture::addr) + read_entity_admin + "/"
+                       + BasicFixture::table + "/" + keys[0].first + "/" + keys[0].second);
+    CHECK_EQUAL(status_codes::NotFound, read.first);
+
+    // The body must be an array
+    result = do_request (methods::PUT,
+                         string(BasicFixture::addr) + batch_update_admin + "/" + BasicFixture::table,
+                         entities[0]);
+    CHECK_EQUAL(status_codes::BadRequest, result.first);
+  }
+}
+
+SUITE(BULK) {
+  /*
+    Import newline-delimited JSON into a table and export it back
+   */
+  TEST_FIXTURE(BasicFixture, ImportExport) {
+    cout << ">> ImportExport test" << endl;
+
+    const string lines {
+      "{\"Partition\":\"Canada\",\"Row\":\"Mitchell,Joni\",\"Home\":\"Fort Macleod\"}\n"
+      "\n"
+      "not an entity\n"
+      "{\"Partition\":\"Sweden\",\"Row\":\"Lykke,Li\",\"Home\":\"Ystad\"}"
+    };
+    http_request import {methods::PUT};
+    import.set_body(lines, "application/x-ndjson");
+    http_client import_client {string(BasicFixture::addr) + import_table_admin + "/" + BasicFixture::table};
+    http_response imported {import_client.request(import).get()};
+    CHECK_EQUAL(status_codes::OK, imported.status_code());
+    value counts {imported.extract_json().get()};
+    CHECK_EQUAL(2, counts["Imported"].as_integer());
+    CHECK_EQUAL(0, counts["Failed"].as_integer());
+    CHECK_EQUAL(1, counts["Invalid"].as_integer());
+
+    http_client export_client {string(BasicFixture::addr) + export_table_admin + "/" + BasicFixture::table};
+    http_response exported {export_client.request(methods::GET).get()};
+    CHECK_EQUAL(status_codes::OK, exported.status_code());
+    string body {exported.extract_string(true).get()};
+    vector<object> entities {};
+    string::size_type start {0};
+    for (string::size_type end; (end = body.find('\n', start)) != string::npos; start = end + 1) {
+      entities.push_back(value::parse(body.substr(start, end - start)).as_object());
+    }
+    // The fixture's entity and the two imported
+    CHECK_EQUAL(3, entities.size());
+
+    CHECK_EQUAL(status_codes::OK, delete_entity (BasicFixture::addr, BasicFixture::table, "Canada", "Mitchell,Joni"));
+    CHECK_EQUAL(status_codes::OK, delete_entity (BasicFixture::addr, BasicFixture::table, "Sweden", "Lykke,Li"));
+
+    http_client missing {string(BasicFixture::addr) + export_table_admin + "/NoSuchTable"};
+    CHECK_EQUAL(status_codes::NotFound, missing.request(methods::GET).get().status_code());
+  }
+
+  /*
+    A later line for the same entity wins, and an overlong line is
+    Invalid without ending the import
+   */
+  TEST_FIXTURE(BasicFixture, ImportRepeatsAndLongLines) {
+    cout << ">> ImportRepeatsAndLongLines test" << endl;
+
+    const string lines {
+      "{\"Partition\":\"Canada\",\"Row\":\"Young,Neil\",\"Home\":\"Toronto\"}\n"
+      "{\"Partition\":\"Canada\",\"Row\":\"Young,Neil\",\"Home\":\"Omemee\"}\n"
+      + string(2 * 1024 * 1024, 'x') + "\n"
+      "{\"Partition\":\"Canada\",\"Row\":\"Cohen,Leonard\",\"Home\":\"Montreal\"}\n"
+    };
+    http_request import {methods::PUT};
+    import.set_body(lines, "application/x-ndjson");
+    http_client import_client {string(BasicFixture::addr) + import_table_admin + "/" + BasicFixture::table};
+    http_response imported {import_client.request(import).get()};
+    CHECK_EQUAL(status_codes::OK, imported.status_code());
+    value counts {imported.extract_json().get()};
+    CHECK_EQUAL(3, counts["Imported"].as_integer());
+    CHECK_EQUAL(1, counts["Invalid"].as_integer());
+
+    pair<status_code,value> read {
+      do_request (methods::GET,
+                  string(BasicFixture::addr) + read_entity_admin + "/"
+                  + BasicFixture::table + "/Canada/Young,Neil")};
+    CHECK_EQUAL(status_codes::OK, read.first);
+    CHECK_EQUAL("Omemee", read.second["Home"].as_string());
+
+    CHECK_EQUAL(status_codes::OK, delete_entity (BasicFixture::addr, BasicFixture::table, "Canada", "Young,Neil"));
+    CHECK_EQUAL(status_codes::OK, delete_entity (BasicFixture::addr, BasicFixture::table, "Canada", "Cohen,Leonard"));
+  }
+}
+
+SUITE(UPDATE) {
+  /*
+    An update with If-Match succeeds only against the current ETag
+   */
+  TEST_FIXTURE(BasicFixture, PutIfMatch) {
+    cout << ">> PutIfMatch test" << endl;
+
+    string uri_string {string(BasicFixture::addr)
+       + read_entity_admin + "/"
+       + BasicFixture::table + "/"
+       + BasicFixture::partition + "/"
+       + BasicFixture::row};
+    string etag {};
+    CHECK_EQUAL(status_codes::OK, get_conditional (uri_string, string {}, etag));
+
+    CHECK_EQUAL(status_codes::OK,
+                put_if_match (BasicFixture::addr, BasicFixture::table, BasicFixture::partition, BasicFixture::row,
+                              BasicFixture::property, "THINK", etag));
+    // The first update changed the ETag, so a second with the old one loses
+    CHECK_EQUAL(status_codes::PreconditionFailed,
+                put_if_match (BasicFixture::addr, BasicFixture::table, BasicFixture::partition, BasicFixture::row,
+                              BasicFixture::property, "CHAIN OF FOOLS", etag));
+
+    pair<status_code,value> result {do_request (methods::GET, uri_string)};
+    CHECK_EQUAL(status_codes::OK, result.first);
+    CHECK_EQUAL(string("THINK"), result.second[BasicFixture::property].as_string());
+
+    CHECK_EQUAL(status_codes::NotFound,
+                put_if_match (BasicFixture::addr, BasicFixture::table, BasicFixture::partition, "No,Such",
+                              BasicFixture::property, "THINK", "*"));
+  }
+}
+
+SUITE(INDEX) {
+  /*
+    Lookups through an index follow writes to the indexed property
+   */
+  TEST_FIXTURE(BasicFixture, IndexQuery) {
+    cout << ">> IndexQuery test" << endl;
+
+    string query_uri {string(BasicFixture::addr) + query_index_admin + "/"
+                      + BasicFixture::table + "/" + BasicFixture::property + "/"};
+
+    pair<status_code,value> result {do_request (methods::GET, query_uri + BasicFixture::prop_val)};
+    CHECK_EQUAL(status_codes::NotFound, result.first);
+
+    result = do_request (methods::POST,
+                         string(BasicFixture::addr) + create_index_admin + "/"
+                         + BasicFixture::table + "/" + BasicFixture::property);
+    CHECK_EQUAL(status_codes::OK, result.first);
+
+    string partition {"Canada"};
+    string row {"Indexed,Row"};
+    CHECK_EQUAL(status_codes::OK,
+                put_entity (BasicFixture::addr, BasicFixture::table, partition, row,
+                            BasicFixture::property, BasicFixture::prop_val));
+
+    result = do_request (methods::GET, query_uri + BasicFixture::prop_val);
+    CHECK_EQUAL(status_codes::OK, result.first);
+    CHECK(result.second.is_array());
+    CHECK_EQUAL(2, result.second.as_array().size());
+    if (result.second.as_array().size() == 2) {
+      CHECK_EQUAL(partition, result.second[0]["Partition"].as_string());
+      CHECK_EQUAL(string(BasicFixture::partition), result.second[1]["Partition"].as_string());
+    }
+
+    CHECK_EQUAL(status_codes::OK,
+                put_entity (BasicFixture::addr, BasicFixture::table, partition, row,
+                            BasicFixture::property, "Changed/Song"));
+    result = do_request (methods::GET, query_uri + BasicFixture::prop_val);
+    CHECK_EQUAL(1, result.second.as_array().size());
+    result = do_request (methods::GET, query_uri + "Changed%2FSong");
+    CHECK_EQUAL(status_codes::OK, result.first);
+    CHECK_EQUAL(1, result.second.as_array().size());
+
+    CHECK_EQUAL(status_codes::OK, delete_entity (BasicFixture::addr, BasicFixture::table, partition, row));
+    result = do_request (methods::GET, query_uri + "Changed%2FSong");
+    CHECK_EQUAL(0, result.second.as_array().size());
+
+    result = do_request (methods::DEL,
+                         string(BasicFixture::addr) + delete_index_admin + "/"
+                         + BasicFixture::table + "/" + BasicFixture::property);
+    CHECK_EQUAL(status_codes::OK, result.first);
+    result = do_request (methods::GET, query_uri + BasicFixture::prop_val);
+    CHECK_EQUAL(status_codes::NotFound, result.first);
+  }
+
+  /*
+    A table name that is not a valid Azure name, such as one that
+    would leave the store's directory, is rejected
+   */
+  TEST_FIXTURE(BasicFixture, IndexQueryBadTable) {
+    cout << ">> IndexQueryBadTable test" << endl;
+
+    for (const string& name : {string("..%2F..%2Fetc"), string("Test.Table"), string("ab")}) {
+      pair<status_code,value> result {
+        do_request (methods::GET, string(BasicFixture::addr) + query_index_admin + "/"
+                    + name + "/" + BasicFixture::property + "/" + BasicFixture::prop_val)};
+      CHECK_EQUAL(status_codes::BadRequest, result.first);
+    }
+  }
 }
 
 class AuthFixture {
@@ -1742,4 +2454,633 @@ SUITE(USER_DIS) {
   }
 }
 
-   
\ No newline at end of file
+   
+/*
+  A snapshot of two entities written to a scratch file, which is
+  removed afterwards
+ */
+class SnapshotFixture {
+public:
+  const string path;
+
+  SnapshotFixture () :
+    path {"/tmp/tester-snapshot-" + std::to_string(getpid())}
+  {
+    table_entity joni {"Canada", "Mitchell,Joni"};
+    joni.set_etag("W/\"1\"");
+    joni.properties()["Home"] = entity_property {string {"Fort Macleod"}};
+    joni.properties()["Albums"] = entity_property {int32_t {19}};
+    table_entity li {"Sweden", "Lykke,Li"};
+    li.properties()["Home"] = entity_property {string {"Ystad"}};
+    if ( ! EntitySnapshot::write(path, vector<EntitySnapshot::entry_t> {
+           make_pair(string {"Sweden/Lykke,Li"}, li),
+           make_pair(string {"Canada/Mitchell,Joni"}, joni)
+         }))
+      throw std::runtime_error("Cannot write snapshot " + path);
+  }
+
+  ~SnapshotFixture () {
+    std::remove(path.c_str());
+  }
+
+  // Overwrite length bytes of the file at offset with byte
+  void damage (off_t offset, size_t length, char byte) {
+    int fd {::open(path.c_str(), O_WRONLY)};
+    CHECK(fd >= 0);
+    const string bytes (length, byte);
+    CHECK_EQUAL(static_cast<ssize_t> (length), ::pwrite(fd, bytes.data(), length, offset));
+    ::close(fd);
+  }
+};
+
+SUITE(SNAPSHOT) {
+  /*
+    What is written is read back, by key, with its properties and ETag
+   */
+  TEST_FIXTURE(SnapshotFixture, RoundTrip) {
+    cout << ">> Snapshot RoundTrip test" << endl;
+
+    std::unique_ptr<EntitySnapshot> snapshot {EntitySnapshot::open(path)};
+    CHECK(snapshot);
+    if ( ! snapshot)
+      return;
+    CHECK_EQUAL(2, snapshot->size());
+    // Keys come back sorted
+    CHECK_EQUAL("Canada/Mitchell,Joni", snapshot->key(0));
+    CHECK_EQUAL("Sweden/Lykke,Li", snapshot->key(1));
+
+    table_entity entity {};
+    CHECK(snapshot->find("Canada/Mitchell,Joni", entity));
+    CHECK_EQUAL("Canada", entity.partition_key());
+    CHECK_EQUAL("Mitchell,Joni", entity.row_key());
+    CHECK_EQUAL("W/\"1\"", entity.etag());
+    CHECK_EQUAL("Fort Macleod", entity.properties()["Home"].string_value());
+    CHECK_EQUAL(19, entity.properties()["Albums"].int32_value());
+
+    CHECK(snapshot->find("Sweden/Lykke,Li", entity));
+    CHECK_EQUAL("Ystad", entity.properties()["Home"].string_value());
+
+    CHECK( ! snapshot->find("Sweden/Robyn", entity));
+  }
+
+  /*
+    A file cut short, as by a crash while copying it, is refused
+   */
+  TEST_FIXTURE(SnapshotFixture, Truncated) {
+    cout << ">> Snapshot Truncated test" << endl;
+
+    struct stat st {};
+    CHECK_EQUAL(0, ::stat(path.c_str(), &st));
+    CHECK_EQUAL(0, ::truncate(path.c_str(), st.st_size / 2));
+    CHECK( ! EntitySnapshot::open(path));
+
+    // Even shorter than the header
+    CHECK_EQUAL(0, ::truncate(path.c_str(), 8));
+    CHECK( ! EntitySnapshot::open(path));
+  }
+
+  /*
+    An index entry pointing outside the file is refused rather than
+    read past the end of the mapping
+   */
+  TEST_FIXTURE(SnapshotFixture, CorruptIndex) {
+    cout << ">> Snapshot CorruptIndex test" << endl;
+
+    // The first index entry starts after the 32-byte header with its key offset
+    damage(32, 8, '\xff');
+    CHECK( ! EntitySnapshot::open(path));
+  }
+}
+
+/*
+  A local table log in a scratch directory, which is removed
+  afterwards
+ */
+class LocalStoreFixture {
+public:
+  string dir;
+  string path;
+
+  LocalStoreFixture () :
+    dir {"/tmp/tester-tables-XXXXXX"},
+    path {}
+  {
+    if ( ! ::mkdtemp(&dir[0]))
+      throw std::runtime_error("Cannot create " + dir);
+    path = dir + "/Test.log";
+  }
+
+  ~LocalStoreFixture () {
+    std::remove(path.c_str());
+    ::rmdir(dir.c_str());
+  }
+
+  static table_entity make_entity (const string& row, const string& home) {
+    table_entity entity {"Canada", row};
+    entity.properties()["Home"] = entity_property {home};
+    return entity;
+  }
+
+  off_t log_size () {
+    struct stat st {};
+    CHECK_EQUAL(0, ::stat(path.c_str(), &st));
+    return st.st_size;
+  }
+
+  // Append bytes to the log, as a write torn part way would leave it
+  void append_raw (const string& bytes) {
+    int fd {::open(path.c_str(), O_WRONLY | O_APPEND)};
+    CHECK(fd >= 0);
+    CHECK_EQUAL(static_cast<ssize_t> (bytes.size()), ::write(fd, bytes.data(), bytes.size()));
+    ::close(fd);
+  }
+};
+
+SUITE(LOCAL_STORE) {
+  /*
+    A second store on the same log replays what the first wrote,
+    and keeps up with what it writes later
+   */
+  TEST_FIXTURE(LocalStoreFixture, Replay) {
+    cout << ">> LocalStore Replay test" << endl;
+
+    LocalTableStore writer {path};
+    CHECK(writer.create_if_not_exists());
+    CHECK_EQUAL(status_codes::OK, writer.insert_or_merge(make_entity("Mitchell,Joni", "Fort Macleod")));
+    CHECK_EQUAL(status_codes::OK, writer.insert_or_merge(make_entity("Young,Neil", "Toronto")));
+    CHECK_EQUAL(status_codes::OK, writer.remove("Canada", "Young,Neil"));
+
+    LocalTableStore reader {path};
+    CHECK(reader.exists());
+    table_entity written {};
+    table_entity read {};
+    CHECK_EQUAL(status_codes::OK, writer.retrieve("Canada", "Mitchell,Joni", written));
+    CHECK_EQUAL(status_codes::OK, reader.retrieve("Canada", "Mitchell,Joni", read));
+    CHECK_EQUAL("Fort Macleod", read.properties()["Home"].string_value());
+    CHECK_EQUAL(written.etag(), read.etag());
+    CHECK_EQUAL(status_codes::NotFound, reader.retrieve("Canada", "Young,Neil", read));
+
+    CHECK_EQUAL(status_codes::OK, writer.insert_or_merge(make_entity("Mitchell,Joni", "Saskatoon")));
+    CHECK_EQUAL(status_codes::OK, reader.retrieve("Canada", "Mitchell,Joni", read));
+    CHECK_EQUAL("Saskatoon", read.properties()["Home"].string_value());
+  }
+
+  /*
+    A record cut short, or whose CRC fails, at the end of the log is
+    a torn write: it is not replayed, and is cut off so later
+    writes land after the last good record
+   */
+  TEST_FIXTURE(LocalStoreFixture, TornTail) {
+    cout << ">> LocalStore TornTail test" << endl;
+
+    off_t good_size {0};
+    {
+      LocalTableStore store {path};
+      CHECK(store.create_if_not_exists());
+      CHECK_EQUAL(status_codes::OK, store.insert_or_merge(make_entity("Mitchell,Joni", "Fort Macleod")));
+      good_size = log_size();
+    }
+
+    // A header promising 100 bytes with only 3 written
+    append_raw(string {"\x64\0\0\0\0\0\0\0abc", 11});
+    {
+      LocalTableStore store {path};
+      table_entity entity {};
+      CHECK_EQUAL(status_codes::OK, store.retrieve("Canada", "Mitchell,Joni", entity));
+      CHECK_EQUAL(good_size, log_size());
+    }
+
+    // A complete record whose CRC does not match its payload
+    append_raw(string {"\x03\0\0\0\x01\x02\x03\x04xyz", 11});
+    {
+      LocalTableStore store {path};
+      table_entity entity {};
+      CHECK_EQUAL(status_codes::OK, store.retrieve("Canada", "Mitchell,Joni", entity));
+      CHECK_EQUAL(good_size, log_size());
+      CHECK_EQUAL(status_codes::OK, store.insert_or_merge(make_entity("Young,Neil", "Toronto")));
+    }
+
+    LocalTableStore store {path};
+    table_entity entity {};
+    CHECK_EQUAL(status_codes::OK, store.retrieve("Canada", "Young,Neil", entity));
+    CHECK_EQUAL("Toronto", entity.properties()["Home"].string_value());
+  }
+
+  /*
+    A bad record followed by good ones is damage, not a torn write:
+    the table refuses every operation
+   */
+  TEST_FIXTURE(LocalStoreFixture, DamagedRecord) {
+    cout << ">> LocalStore DamagedRecord test" << endl;
+
+    off_t first_end {0};
+    {
+      LocalTableStore store {path};
+      CHECK(store.create_if_not_exists());
+      CHECK_EQUAL(status_codes::OK, store.insert_or_merge(make_entity("Mitchell,Joni", "Fort Macleod")));
+      first_end = log_size();
+      CHECK_EQUAL(status_codes::OK, store.insert_or_merge(make_entity("Young,Neil", "Toronto")));
+    }
+
+    // Flip the last byte of the first record's payload
+    int fd {::open(path.c_str(), O_RDWR)};
+    CHECK(fd >= 0);
+    char byte {};
+    CHECK_EQUAL(1, ::pread(fd, &byte, 1, first_end - 1));
+    byte ^= 0x55;
+    CHECK_EQUAL(1, ::pwrite(fd, &byte, 1, first_end - 1));
+    ::close(fd);
+
+    LocalTableStore store {path};
+    table_entity entity {};
+    CHECK_EQUAL(status_codes::InternalError, store.retrieve("Canada", "Young,Neil", entity));
+    CHECK_EQUAL(status_codes::InternalError, store.insert_or_merge(make_entity("Cohen,Leonard", "Montreal")));
+  }
+
+  /*
+    Appenders take an exclusive flock() on the log, so a write waits
+    while another process holds it
+   */
+  TEST_FIXTURE(LocalStoreFixture, FlockExclusion) {
+    cout << ">> LocalStore FlockExclusion test" << endl;
+
+    LocalTableStore store {path};
+    CHECK(store.create_if_not_exists());
+
+    // A separate open file, as another process would have, so the locks conflict
+    int other {::open(path.c_str(), O_RDWR)};
+    CHECK(other >= 0);
+    CHECK_EQUAL(0, ::flock(other, LOCK_EX));
+
+    pplx::task<status_code> write {pplx::create_task([&store] () {
+          return store.insert_or_merge(make_entity("Mitchell,Joni", "Fort Macleod"));
+        })};
+    std::this_thread::sleep_for(std::chrono::milliseconds {200});
+    CHECK( ! write.is_done());
+
+    CHECK_EQUAL(0, ::flock(other, LOCK_UN));
+    CHECK_EQUAL(status_codes::OK, write.get());
+    ::close(other);
+
+    table_entity entity {};
+    CHECK_EQUAL(status_codes::OK, store.retrieve("Canada", "Mitchell,Joni", entity));
+  }
+
+  /*
+    Each write changes the ETag, a merge must match the current one,
+    and an ETag from before a delete and re-create never matches
+    after, though the log offsets start over
+   */
+  TEST_FIXTURE(LocalStoreFixture, ETags) {
+    cout << ">> LocalStore ETags test" << endl;
+
+    LocalTableStore store {path};
+    CHECK(store.create_if_not_exists());
+    CHECK_EQUAL(status_codes::OK, store.insert_or_merge(make_entity("Mitchell,Joni", "Fort Macleod")));
+    table_entity entity {};
+    CHECK_EQUAL(status_codes::OK, store.retrieve("Canada", "Mitchell,Joni", entity));
+    const string first {entity.etag()};
+    CHECK(first.compare(0, 3, "W/\"") == 0);
+
+    table_entity update {make_entity("Mitchell,Joni", "Saskatoon")};
+    update.set_etag(first);
+    CHECK_EQUAL(status_codes::OK, store.merge(update));
+    CHECK_EQUAL(status_codes::OK, store.retrieve("Canada", "Mitchell,Joni", entity));
+    CHECK(entity.etag() != first);
+    CHECK_EQUAL(status_codes::PreconditionFailed, store.merge(update));
+
+    CHECK(store.delete_table());
+    CHECK(store.create_if_not_exists());
+    CHECK_EQUAL(status_codes::OK, store.insert_or_merge(make_entity("Mitchell,Joni", "Fort Macleod")));
+    CHECK_EQUAL(status_codes::OK, store.retrieve("Canada", "Mitchell,Joni", entity));
+    CHECK(entity.etag() != first);
+    update.set_etag(first);
+    CHECK_EQUAL(status_codes::PreconditionFailed, store.merge(update));
+  }
+}
+
+/*
+  A local table that counts the insert_or_merge() calls reaching it
+ */
+class CountingStore : public LocalTableStore {
+public:
+  std::atomic<int> writes;
+
+  explicit CountingStore (const string& path) :
+    LocalTableStore {path},
+    writes {0}
+  {}
+
+  status_code insert_or_merge (const table_entity& entity) override {
+    ++writes;
+    return LocalTableStore::insert_or_merge(entity);
+  }
+};
+
+SUITE(WRITE_COMBINER) {
+  /*
+    Two merges to one entity inside the window become one write
+    carrying both properties, and both callers get its status
+   */
+  TEST_FIXTURE(LocalStoreFixture, CombinesConcurrentMerges) {
+    cout << ">> WriteCombiner CombinesConcurrentMerges test" << endl;
+
+    CountingStore store {path};
+    CHECK(store.create_if_not_exists());
+    WriteCombiner combiner {std::chrono::milliseconds {200}};
+
+    table_entity home {"Canada", "Mitchell,Joni"};
+    home.properties()["Home"] = entity_property {string {"Fort Macleod"}};
+    table_entity albums {"Canada", "Mitchell,Joni"};
+    albums.properties()["Albums"] = entity_property {string {"19"}};
+
+    pplx::task<status_code> first {pplx::create_task([&] () {
+          return combiner.insert_or_merge("Test", store, home);
+        })};
+    // Well inside the window, so the second joins the first
+    std::this_thread::sleep_for(std::chrono::milliseconds {50});
+    pplx::task<status_code> second {pplx::create_task([&] () {
+          return combiner.insert_or_merge("Test", store, albums);
+        })};
+    CHECK_EQUAL(status_codes::OK, first.get());
+    CHECK_EQUAL(status_codes::OK, second.get());
+    CHECK_EQUAL(1, store.writes.load());
+
+    table_entity entity {};
+    CHECK_EQUAL(status_codes::OK, store.retrieve("Canada", "Mitchell,Joni", entity));
+    CHECK_EQUAL("Fort Macleod", entity.properties()["Home"].string_value());
+    CHECK_EQUAL("19", entity.properties()["Albums"].string_value());
+  }
+
+  /*
+    With a window of zero every write goes straight to the store
+   */
+  TEST_FIXTURE(LocalStoreFixture, ZeroWindowPassesThrough) {
+    cout << ">> WriteCombiner ZeroWindowPassesThrough test" << endl;
+
+    CountingStore store {path};
+    CHECK(store.create_if_not_exists());
+    WriteCombiner combiner {std::chrono::milliseconds {0}};
+
+    CHECK_EQUAL(status_codes::OK,
+                combiner.insert_or_merge("Test", store, LocalStoreFixture::make_entity("Mitchell,Joni", "Fort Macleod")));
+    CHECK_EQUAL(1, store.writes.load());
+    CHECK_EQUAL(status_codes::OK,
+                combiner.insert_or_merge("Test", store, LocalStoreFixture::make_entity("Mitchell,Joni", "Saskatoon")));
+    CHECK_EQUAL(2, store.writes.load());
+
+    // Nothing is left waiting
+    combiner.wait_for("Test", "Canada", "Mitchell,Joni");
+    table_entity entity {};
+    CHECK_EQUAL(status_codes::OK, store.retrieve("Canada", "Mitchell,Joni", entity));
+    CHECK_EQUAL("Saskatoon", entity.properties()["Home"].string_value());
+  }
+}
+
+SUITE(TABLE_CACHE) {
+  /*
+    Whether a table exists is remembered for exists_ttl or
+    missing_ttl; this process's own creates and deletes update it
+    at once, while another process's go unnoticed until it expires
+   */
+  TEST_FIXTURE(LocalStoreFixture, ExistenceTTLs) {
+    cout << ">> TableCache ExistenceTTLs test" << endl;
+
+    TableCache cache {};
+    cache.init("LocalStoreDirectory=" + dir);
+    bool exists {true};
+    cache.lookup_table("Test", exists);
+    CHECK( ! exists);
+
+    // Created by "another process"
+    LocalTableStore other {path};
+    CHECK(other.create_if_not_exists());
+    cache.lookup_table("Test", exists);
+    CHECK( ! exists);
+    std::this_thread::sleep_for(TableCache::missing_ttl + std::chrono::milliseconds {100});
+    cache.lookup_table("Test", exists);
+    CHECK(exists);
+
+    // A delete by another process is not seen within exists_ttl
+    CHECK(other.delete_table());
+    cache.lookup_table("Test", exists);
+    CHECK(exists);
+
+    // One by this process is
+    cache.table_deleted("Test");
+    cache.lookup_table("Test", exists);
+    CHECK( ! exists);
+    cache.table_created("Test");
+    cache.lookup_table("Test", exists);
+    CHECK(exists);
+  }
+
+  /*
+    A store's answer that arrives after this process has created or
+    deleted the table does not overwrite what that recorded
+   */
+  TEST_FIXTURE(LocalStoreFixture, GenerationGuard) {
+    cout << ">> TableCache GenerationGuard test" << endl;
+
+    LocalTableStore other {path};
+    CHECK(other.create_if_not_exists());
+
+    TableCache cache {};
+    cache.init("LocalStoreDirectory=" + dir);
+
+    // Opening the log takes its flock, so holding it stalls the store's answer
+    int held {::open(path.c_str(), O_RDWR)};
+    CHECK(held >= 0);
+    CHECK_EQUAL(0, ::flock(held, LOCK_EX));
+    pplx::task<bool> asked {pplx::create_task([&cache] () {
+          bool exists {false};
+          cache.lookup_table("Test", exists);
+          return exists;
+        })};
+    std::this_thread::sleep_for(std::chrono::milliseconds {200});
+    cache.table_deleted("Test");
+    CHECK_EQUAL(0, ::flock(held, LOCK_UN));
+    ::close(held);
+
+    // The store saw the table, but the later delete stands
+    CHECK(asked.get());
+    bool exists {true};
+    cache.lookup_table("Test", exists);
+    CHECK( ! exists);
+  }
+}
+
+/*
+  Captures what the logger writes to stdout in a scratch file,
+  restoring stdout and the default level and sampling afterwards
+ */
+class LogCapture {
+public:
+  const string path;
+  int saved_stdout;
+
+  LogCapture () :
+    path {"/tmp/tester-log-" + std::to_string(getpid())},
+    saved_stdout {-1}
+  {
+    std::fflush(stdout);
+    cout.flush();
+    int fd {::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)};
+    if (fd < 0)
+      throw std::runtime_error("Cannot create " + path);
+    saved_stdout = ::dup(STDOUT_FILENO);
+    ::dup2(fd, STDOUT_FILENO);
+    ::close(fd);
+  }
+
+  ~LogCapture () {
+    restore();
+    set_log_level(log_level::info);
+    set_log_sample(1);
+    std::remove(path.c_str());
+  }
+
+  void restore () {
+    if (saved_stdout < 0)
+      return;
+    flush_log();
+    std::fflush(stdout);
+    ::dup2(saved_stdout, STDOUT_FILENO);
+    ::close(saved_stdout);
+    saved_stdout = -1;
+  }
+
+  // How many lines written since capture began contain marker
+  int count (const string& marker) {
+    restore();
+    std::ifstream in {path};
+    int n {0};
+    for (string line {}; std::getline(in, line); ) {
+      if (line.find(marker) != string::npos)
+        ++n;
+    }
+    return n;
+  }
+};
+
+SUITE(LOGGER) {
+  /*
+    Lines below the level are dropped; warnings and errors above it
+    are written
+   */
+  TEST(Levels) {
+    cout << ">> Logger Levels test" << endl;
+
+    int debug {0};
+    int info {0};
+    int warning {0};
+    int error {0};
+    {
+      LogCapture capture {};
+      set_log_level(log_level::warning);
+      log_debug() << "tester-level-debug";
+      log_info() << "tester-level-info";
+      log_warning() << "tester-level-warning";
+      log_error() << "tester-level-error";
+      debug = capture.count("tester-level-debug");
+      info = capture.count("tester-level-info");
+      warning = capture.count("tester-level-warning");
+      error = capture.count("tester-level-error");
+    }
+    CHECK_EQUAL(0, debug);
+    CHECK_EQUAL(0, info);
+    CHECK_EQUAL(1, warning);
+    CHECK_EQUAL(1, error);
+
+    {
+      LogCapture capture {};
+      set_log_level(log_level::off);
+      log_error() << "tester-level-off";
+      error = capture.count("tester-level-off");
+    }
+    CHECK_EQUAL(0, error);
+  }
+
+  /*
+    With sampling, a thread keeps one in n of its debug and info
+    lines, but every warning
+   */
+  TEST(Sampling) {
+    cout << ">> Logger Sampling test" << endl;
+
+    int info {0};
+    int warning {0};
+    {
+      LogCapture capture {};
+      set_log_level(log_level::debug);
+      set_log_sample(3);
+      for (int i {0}; i < 9; ++i) {
+        log_info() << "tester-sample-info";
+        log_warning() << "tester-sample-warning";
+      }
+      info = capture.count("tester-sample-info");
+      warning = capture.count("tester-sample-warning");
+    }
+    CHECK_EQUAL(3, info);
+    CHECK_EQUAL(9, warning);
+  }
+}
+
+SUITE(ROUTER) {
+  /*
+    Requests that match no route get their server's fallback: the
+    status depends on the method, the operation and the arity
+   */
+  TEST_FIXTURE(BasicFixture, Fallbacks) {
+    cout << ">> Router Fallbacks test" << endl;
+
+    const string addr {BasicFixture::addr};
+    const string entity_path {string(BasicFixture::table) + "/" + BasicFixture::partition + "/"
+                              + BasicFixture::row};
+
+    // A known operation with the wrong number of segments
+    CHECK_EQUAL(status_codes::BadRequest,
+                do_request (methods::GET, addr + read_entity_admin + "/" + BasicFixture::table + "/"
+                            + BasicFixture::partition).first);
+    CHECK_EQUAL(status_codes::BadRequest,
+                do_request (methods::PUT, addr + update_entity_admin + "/" + BasicFixture::table).first);
+    // Unknown operations: BadRequest, except a PUT of five or more segments
+    CHECK_EQUAL(status_codes::BadRequest, do_request (methods::GET, addr + "NoSuchOp/" + entity_path).first);
+    CHECK_EQUAL(status_codes::BadRequest, do_request (methods::GET, addr).first);
+    CHECK_EQUAL(status_codes::NotFound,
+                do_request (methods::PUT, addr + "NoSuchOp/" + entity_path + "/Extra").first);
+    // Optional operations from Assignment 1, at any arity
+    CHECK_EQUAL(status_codes::NotImplemented,
+                do_request (methods::PUT, addr + "AddPropertyAdmin/" + BasicFixture::table).first);
+    // A method the server has no routes for
+    CHECK_EQUAL(status_codes::MethodNotAllowed, do_request (methods::PATCH, addr + read_entity_admin).first);
+
+    // AuthServer: BadRequest without a user id, NotFound for an unknown operation
+    const string auth_addr {"http://localhost:34570/"};
+    CHECK_EQUAL(status_codes::BadRequest, do_request (methods::GET, auth_addr + "GetReadToken").first);
+    CHECK_EQUAL(status_codes::NotFound, do_request (methods::GET, auth_addr + "NoSuchOp/user").first);
+  }
+}
+
+SUITE(TOKEN_EXPIRY) {
+  /*
+    Table handles for a SAS token are kept until its "se" time,
+    whether the token in the path is encoded once or twice, and
+    for a minute if it has no readable expiry
+   */
+  TEST(SasTokenExpiry) {
+    cout << ">> SasTokenExpiry test" << endl;
+
+    using utility::datetime;
+    const uint64_t expected {datetime::from_string("2030-01-01T00:00:00Z", datetime::ISO_8601).to_interval()};
+    const string token {"sv=2015-04-05&tn=DataTable&se=2030-01-01T00%3A00%3A00Z&sp=r&sig=abc%2Bdef"};
+    CHECK_EQUAL(expected, sas_token_expiry(token));
+    CHECK_EQUAL(expected, sas_token_expiry(web::http::uri::encode_data_string(token)));
+
+    const uint64_t before {datetime::utc_now().to_interval()};
+    const uint64_t fallback {sas_token_expiry("sv=2015-04-05&sig=abc")};
+    const uint64_t after {datetime::utc_now().to_interval()};
+    CHECK(fallback >= before + datetime::from_seconds(60));
+    CHECK(fallback <= after + datetime::from_seconds(60));
+  }
+}